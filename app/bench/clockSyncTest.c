@@ -0,0 +1,108 @@
+// Clock sync test: one BeatBox on the null audio output, as clock master or
+// slave, printing the sync statistics every second. Run a master and a
+// slave (at another tempo) side by side to watch the slave lock on:
+//
+//   beatbox_clock_sync master|slave [-a address] [-p port] [-b bpm] [-t seconds]
+//                      [-s thread|clock] [-w wave-dir]
+//
+// Defaults: pulses to 127.0.0.1 on port 12346, 120 BPM, 30 seconds, the
+// audio-clock sequencer.
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "clockSync.h"
+#include "instruments.h"
+#include "periodTimer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifndef BENCH_WAVE_FILE_DIR
+#define BENCH_WAVE_FILE_DIR "beatbox-wave-files"
+#endif
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s master|slave [-a address] [-p port] [-b bpm] [-t seconds]"
+            " [-s thread|clock] [-w wave-dir]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *address = "127.0.0.1";
+    int port = 12346;
+    int bpm = 120;
+    int seconds = 30;
+    BeatBox_sequencer_t type = BEATBOX_SEQ_AUDIO_CLOCK;
+    const char *waveDir = BENCH_WAVE_FILE_DIR;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+    ClockSync_role_t role;
+    if (strcmp(argv[1], "master") == 0) {
+        role = CLOCKSYNC_MASTER;
+    } else if (strcmp(argv[1], "slave") == 0) {
+        role = CLOCKSYNC_SLAVE;
+    } else {
+        usage(argv[0]);
+    }
+
+    int option;
+    optind = 2;
+    while ((option = getopt(argc, argv, "a:p:b:t:s:w:")) != -1) {
+        if (option == 'a') {
+            address = optarg;
+        } else if (option == 'p' && atoi(optarg) > 0) {
+            port = atoi(optarg);
+        } else if (option == 'b' && atoi(optarg) >= 40 && atoi(optarg) <= 300) {
+            bpm = atoi(optarg);
+        } else if (option == 't' && atoi(optarg) > 0) {
+            seconds = atoi(optarg);
+        } else if (option == 's' && strcmp(optarg, "thread") == 0) {
+            type = BEATBOX_SEQ_THREAD;
+        } else if (option == 's' && strcmp(optarg, "clock") == 0) {
+            type = BEATBOX_SEQ_AUDIO_CLOCK;
+        } else if (option == 'w') {
+            waveDir = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    Period_init();
+    AudioMixer_setOutput(AUDIOMIXER_OUTPUT_NULL);
+    AudioMixer_init();
+    Instruments_init(waveDir);
+    BeatBox_setSequencer(type);
+    BeatBox_init();
+    setBPM(bpm);
+    setMode(1);
+    ClockSync_init(address, port);
+    ClockSync_setRole(role);
+
+    printf("%-4s %6s %8s %9s %9s %9s %6s\n",
+            "sec", "state", "bpm", "error ms", "mean ms", "max ms", "lost");
+    for (int second = 1; second <= seconds; second++) {
+        sleep(1);
+        ClockSync_stats_t stats;
+        ClockSync_getStatsAndClear(&stats);
+        if (role == CLOCKSYNC_MASTER) {
+            printf("%-4d %6s %8.3f %9s %9s %9s %6s  (%d pulses sent)\n",
+                    second, "master", stats.tempo, "-", "-", "-", "-", stats.numPulses);
+        } else {
+            printf("%-4d %6s %8.3f %+9.3f %9.3f %9.3f %6d\n",
+                    second, stats.locked ? "locked" : "free", stats.tempo, stats.lastErrorMs,
+                    stats.meanAbsErrorMs, stats.maxAbsErrorMs, stats.numLost);
+        }
+        fflush(stdout);
+    }
+
+    ClockSync_cleanup();
+    setMode(0);
+    BeatBox_cleanup();
+    Instruments_cleanup();
+    AudioMixer_cleanup();
+    Period_cleanup();
+    return 0;
+}
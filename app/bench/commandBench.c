@@ -0,0 +1,210 @@
+// Command parser benchmark: commands per second through the text protocol,
+// parsed in place and dispatched through the perfect-hash table
+// (Command_parse() + Command_execute()), against the same commands through
+// the sscanf() / strcmp() chain / sprintf() path it replaced, and as
+// binary protocol frames (BinaryProtocol_parse() + _handleFrame()), all the
+// queries in one frame, as a UI polling its display would send them.
+//
+//   beatbox_command_bench [-n millions]
+//
+// Defaults: 10 million commands per path. The commands are queries
+// ("tempo", "mode", ...), so nothing is changed or printed and the time is
+// the parser's and the reply formatting's; the getters behind them are
+// lock-free reads. Nothing needs initializing.
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "binaryProtocol.h"
+#include "clockSync.h"
+#include "command.h"
+#include "nodeSync.h"
+#include "tapTempo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#define BUFFER_SIZE 1024                // The old parser's stack buffers
+
+static const char *const datagrams[] = {
+    "tempo", "mode", "volume", "song", "record", "sync", "node", "tempo\n", " volume ",
+};
+#define NUM_DATAGRAMS ((int)(sizeof(datagrams) / sizeof(datagrams[0])))
+
+// The same queries as one binary frame
+static const uint8_t frameOpcodes[NUM_DATAGRAMS] = {
+    BINARY_OP_TEMPO, BINARY_OP_MODE, BINARY_OP_VOLUME, BINARY_OP_SONG, BINARY_OP_RECORD,
+    BINARY_OP_SYNC, BINARY_OP_NODE, BINARY_OP_TEMPO, BINARY_OP_VOLUME,
+};
+static uint8_t frame[BINARY_HEADER_SIZE + NUM_DATAGRAMS * BINARY_COMMAND_SIZE];
+
+static volatile int sink;               // Keeps the replies from being optimized away
+
+// Round-robin over the datagrams, without a division per command
+static inline int nextIndex(int index) {
+    return index + 1 < NUM_DATAGRAMS ? index + 1 : 0;
+}
+
+static double getTimeSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The replaced path, as processCommand() was for queries
+static int legacyCommand(const char *command, char *response) {
+    char cmd[BUFFER_SIZE];
+    int value;
+    int numScanned = sscanf(command, "%s %d", cmd, &value);
+    if (numScanned < 1) {
+        return 0;
+    }
+    if (strcmp(cmd, "mode") == 0) {
+        sprintf(response, "%d", getMode());
+    } else if (strcmp(cmd, "song") == 0) {
+        sprintf(response, "%d", BeatBox_getSongPosition());
+    } else if (strcmp(cmd, "record") == 0) {
+        sprintf(response, "%d", BeatBox_isRecording());
+    } else if (strcmp(cmd, "tap") == 0) {
+        sprintf(response, "%d", TapTempo_isEnabled());
+    } else if (strcmp(cmd, "sync") == 0) {
+        sprintf(response, "%d", ClockSync_getRole());
+    } else if (strcmp(cmd, "node") == 0) {
+        sprintf(response, "%d", NodeSync_getRole());
+    } else if (strcmp(cmd, "start") == 0) {
+        return 0;
+    } else if (strcmp(cmd, "volume") == 0) {
+        sprintf(response, "%d", AudioMixer_getVolume());
+    } else if (strcmp(cmd, "tempo") == 0) {
+        sprintf(response, "%d", getBPM());
+    } else {
+        return 0;
+    }
+    return strlen(response);
+}
+
+static double runLegacy(long numCommands, const int *lengths) {
+    (void)lengths;
+    int index = 0;
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands; i++, index = nextIndex(index)) {
+        char response[BUFFER_SIZE];
+        sink = legacyCommand(datagrams[index], response);
+    }
+    return getTimeSeconds() - start;
+}
+
+static double runTable(long numCommands, const int *lengths) {
+    char reply[COMMAND_MAX_REPLY];
+    int index = 0;
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands; i++, index = nextIndex(index)) {
+        Command_t command;
+        if (Command_parse(datagrams[index], lengths[index], &command)) {
+            sink = Command_execute(&command, reply);
+        }
+    }
+    return getTimeSeconds() - start;
+}
+
+static double runParseOnly(long numCommands, const int *lengths) {
+    int index = 0;
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands; i++, index = nextIndex(index)) {
+        Command_t command;
+        Command_parse(datagrams[index], lengths[index], &command);
+        sink = command.id;
+    }
+    return getTimeSeconds() - start;
+}
+
+// numCommands rounded down to whole frames
+static double runFrames(long numCommands, const int *lengths) {
+    (void)lengths;
+    uint8_t reply[BINARY_MAX_FRAME];
+    _Bool stopRequested = false;
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands / NUM_DATAGRAMS; i++) {
+        frame[4] = i;                           // Request ID
+        sink = BinaryProtocol_handleFrame(frame, sizeof(frame), reply, &stopRequested);
+    }
+    return getTimeSeconds() - start;
+}
+
+static double runFrameParseOnly(long numCommands, const int *lengths) {
+    (void)lengths;
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands / NUM_DATAGRAMS; i++) {
+        Command_t commands[BINARY_MAX_COMMANDS];
+        uint32_t requestId;
+        frame[4] = i;
+        sink = BinaryProtocol_parse(frame, sizeof(frame), commands, &requestId);
+    }
+    return getTimeSeconds() - start;
+}
+
+static double runFormatOnly(long numCommands, const int *lengths) {
+    (void)lengths;
+    char reply[COMMAND_MAX_REPLY];
+    double start = getTimeSeconds();
+    for (long i = 0; i < numCommands; i++) {
+        sink = Command_formatInt((int)(i & 0xffff) - 1, reply);
+    }
+    return getTimeSeconds() - start;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n millions]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    double millions = 10;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:")) != -1) {
+        if (option == 'n' && atof(optarg) > 0) {
+            millions = atof(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    long numCommands = (long)(millions * 1e6);
+
+    int lengths[NUM_DATAGRAMS];
+    for (int i = 0; i < NUM_DATAGRAMS; i++) {
+        lengths[i] = strlen(datagrams[i]);
+        frame[BINARY_HEADER_SIZE + i * BINARY_COMMAND_SIZE] = frameOpcodes[i];
+    }
+    frame[0] = BINARY_PROTOCOL_MAGIC;
+    frame[1] = BINARY_PROTOCOL_VERSION;
+    frame[2] = NUM_DATAGRAMS;
+
+    static const struct {
+        const char *name;
+        double (*run)(long numCommands, const int *lengths);
+    } paths[] = {
+        {"sscanf/strcmp/sprintf", runLegacy},
+        {"table dispatch", runTable},
+        {"  parse only", runParseOnly},
+        {"  format only", runFormatOnly},
+        {"binary frames", runFrames},
+        {"  parse only", runFrameParseOnly},
+    };
+
+    printf("%-22s %12s %10s %10s\n", "path", "commands", "ns/cmd", "Mcmd/s");
+    double legacySeconds = 0;
+    for (unsigned i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        double seconds = paths[i].run(numCommands, lengths);
+        if (i == 0) {
+            legacySeconds = seconds;
+        }
+        printf("%-22s %12ld %10.1f %10.2f", paths[i].name, numCommands,
+                seconds * 1e9 / numCommands, numCommands / seconds / 1e6);
+        if (i > 0) {
+            printf("   (%.1fx)", legacySeconds / seconds);
+        }
+        printf("\n");
+    }
+    return 0;
+}
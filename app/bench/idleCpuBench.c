@@ -0,0 +1,171 @@
+// Idle CPU check: a BeatBox in mode 0 ("None") should take next to no CPU.
+// Starts the mixer on the null audio output and the beatbox, stops the
+// beat, and measures the process's user + system CPU time over a window.
+//
+//   beatbox_idle_cpu [-t seconds] [-s thread|clock|both] [-l max-percent] [-w wave-dir]
+//
+// Defaults: 5 seconds per run, both sequencers, at most 2% of one core.
+// Each run is a child process, so every run starts from a fresh BeatBox.
+// Exits with a failure status if any run is over the limit.
+//
+// What remains when idle is the playback thread mixing silence once a
+// period; a beat thread spinning in mode 0 shows up as ~100%.
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "instruments.h"
+#include "periodTimer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef BENCH_WAVE_FILE_DIR
+#define BENCH_WAVE_FILE_DIR "beatbox-wave-files"
+#endif
+
+#define SETTLE_SECONDS 0.5          // Let the beat stop before measuring
+
+typedef struct {
+    double seconds;
+    double cpuSeconds;
+} runResult_t;
+
+static double getTimeSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// User + system CPU of every thread of this process so far
+static double getCpuSeconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+            + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void sleepSeconds(double seconds) {
+    long long ns = (long long)(seconds * 1e9);
+    struct timespec delay = { ns / 1000000000, ns % 1000000000 };
+    while (nanosleep(&delay, &delay) != 0) {
+        // Interrupted: sleep the rest
+    }
+}
+
+// Child side: start a BeatBox, stop the beat, and measure it idling.
+static void runOnce(BeatBox_sequencer_t type, double seconds, const char *waveDir,
+        runResult_t *pResult) {
+    Period_init();
+    AudioMixer_setOutput(AUDIOMIXER_OUTPUT_NULL);
+    AudioMixer_init();
+    Instruments_init(waveDir);
+    BeatBox_setSequencer(type);
+    BeatBox_init();
+    setMode(0);
+    sleepSeconds(SETTLE_SECONDS);
+
+    double startCpu = getCpuSeconds();
+    double start = getTimeSeconds();
+    sleepSeconds(seconds);
+    pResult->cpuSeconds = getCpuSeconds() - startCpu;
+    pResult->seconds = getTimeSeconds() - start;
+
+    BeatBox_cleanup();
+    Instruments_cleanup();
+    AudioMixer_cleanup();
+    Period_cleanup();
+}
+
+// Run in a child (with its chatter discarded) and collect the result.
+// Fails if the child did not report or did not exit cleanly.
+static _Bool runChild(BeatBox_sequencer_t type, double seconds, const char *waveDir,
+        runResult_t *pResult) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            perror("freopen");
+        }
+        runResult_t result = {0};
+        runOnce(type, seconds, waveDir, &result);
+        _Bool ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    _Bool ok = pid > 0 && read(fds[0], pResult, sizeof(*pResult)) == sizeof(*pResult);
+    close(fds[0]);
+    if (pid > 0) {
+        int status = 0;
+        ok = waitpid(pid, &status, 0) == pid && ok
+                && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+    return ok;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t seconds] [-s thread|clock|both] [-l max-percent] [-w wave-dir]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    double seconds = 5.0;
+    double maxPercent = 2.0;
+    const char *waveDir = BENCH_WAVE_FILE_DIR;
+    _Bool runThread = true;
+    _Bool runClock = true;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:s:l:w:")) != -1) {
+        if (option == 't' && atof(optarg) > 0) {
+            seconds = atof(optarg);
+        } else if (option == 's' && strcmp(optarg, "thread") == 0) {
+            runClock = false;
+        } else if (option == 's' && strcmp(optarg, "clock") == 0) {
+            runThread = false;
+        } else if (option == 's' && strcmp(optarg, "both") == 0) {
+            runThread = runClock = true;
+        } else if (option == 'l' && atof(optarg) > 0) {
+            maxPercent = atof(optarg);
+        } else if (option == 'w') {
+            waveDir = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    printf("Idle CPU: mode 0, %.1f s per run, null audio output, limit %.1f%% of a core\n",
+            seconds, maxPercent);
+    printf("%-9s %10s %10s %8s\n", "sequencer", "seconds", "cpu s", "cpu %");
+    _Bool allPassed = true;
+    for (int pass = 0; pass < 2; pass++) {
+        if ((pass == 0 && !runThread) || (pass == 1 && !runClock)) {
+            continue;
+        }
+        BeatBox_sequencer_t type = (pass == 0) ? BEATBOX_SEQ_THREAD : BEATBOX_SEQ_AUDIO_CLOCK;
+        runResult_t result;
+        if (!runChild(type, seconds, waveDir, &result)) {
+            fprintf(stderr, "ERROR: %s run failed.\n", pass == 0 ? "thread" : "clock");
+            allPassed = false;
+            continue;
+        }
+        double percent = 100 * result.cpuSeconds / result.seconds;
+        _Bool passed = percent <= maxPercent;
+        allPassed = allPassed && passed;
+        printf("%-9s %10.2f %10.3f %8.2f  %s\n", pass == 0 ? "thread" : "clock",
+                result.seconds, result.cpuSeconds, percent, passed ? "ok" : "OVER LIMIT");
+    }
+    return allPassed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
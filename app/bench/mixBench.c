@@ -0,0 +1,125 @@
+// Mixing cost benchmark: how long the mixer takes to fill one period with
+// a number of overlapping voices, in whichever sample format it was built
+// with (AUDIOMIXER_FLOAT_SAMPLES; CMake builds both, as
+// beatbox_mix_bench_int16 and beatbox_mix_bench_float32).
+//
+//   beatbox_mix_bench_<format> [-p periods] [-v voices] [-w wave-dir]
+//
+// Defaults: 20000 periods, 20 voices. The mixer runs on the freewheeling
+// null output, so the playback thread fills periods back to back and the
+// time per period is the mix plus the S16 output conversion. A sequencer
+// keeps `voices` lanes busy, each retriggering a kit sample the frame the
+// last one ends, at full velocity.
+#include "audioMixer.h"
+#include "instruments.h"
+#include "periodTimer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#ifndef BENCH_WAVE_FILE_DIR
+#define BENCH_WAVE_FILE_DIR "beatbox-wave-files"
+#endif
+
+#define MAX_VOICES 100                  // The mixer's MAX_SOUND_BITES
+#define WARMUP_PERIODS 200              // Let every lane get going first
+
+// Sequencer state, playback thread only once installed
+static int numLanes;
+static unsigned long long laneNextStart[MAX_VOICES];
+
+static wavedata_t *getLaneSound(int lane) {
+    return Instruments_get(lane % INSTRUMENT_NUM_KIT);
+}
+
+static void keepLanesBusy(unsigned long long bufferStartFrame, int numFrames) {
+    unsigned long long bufferEndFrame = bufferStartFrame + numFrames;
+    for (int lane = 0; lane < numLanes; lane++) {
+        wavedata_t *pSound = getLaneSound(lane);
+        while (laneNextStart[lane] < bufferEndFrame) {
+            unsigned long long start = laneNextStart[lane];
+            if (start < bufferStartFrame) {
+                start = bufferStartFrame;
+            }
+            AudioMixer_startSoundAt(pSound, (int)(start - bufferStartFrame),
+                    AUDIOMIXER_MAX_VELOCITY, true);
+            laneNextStart[lane] = start + pSound->numSamples;
+        }
+    }
+}
+
+static double getTimeSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Wait until the mixer has started `frame`; returns the time it was seen.
+static double waitForFrame(unsigned long long frame) {
+    struct timespec pollDelay = {0, 1000000};  // 1ms
+    while (AudioMixer_getFramePosition() < frame) {
+        nanosleep(&pollDelay, NULL);
+    }
+    return getTimeSeconds();
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-p periods] [-v voices] [-w wave-dir]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    long numPeriods = 20000;
+    const char *waveDir = BENCH_WAVE_FILE_DIR;
+    numLanes = 20;
+
+    int option;
+    while ((option = getopt(argc, argv, "p:v:w:")) != -1) {
+        if (option == 'p' && atol(optarg) > 0) {
+            numPeriods = atol(optarg);
+        } else if (option == 'v' && atoi(optarg) > 0 && atoi(optarg) <= MAX_VOICES) {
+            numLanes = atoi(optarg);
+        } else if (option == 'w') {
+            waveDir = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    Period_init();
+    AudioMixer_setOutput(AUDIOMIXER_OUTPUT_FREEWHEEL);
+    AudioMixer_init();
+    Instruments_init(waveDir);
+    unsigned long periodFrames = AudioMixer_getPeriodFrames();
+
+    // Staggered, so the lanes don't all hit their attacks together
+    unsigned long long startFrame = AudioMixer_getFramePosition() + periodFrames;
+    for (int lane = 0; lane < numLanes; lane++) {
+        laneNextStart[lane] = startFrame + (lane * 977) % getLaneSound(lane)->numSamples;
+    }
+    AudioMixer_setSequencer(keepLanesBusy);
+
+    unsigned long long firstFrame = startFrame + WARMUP_PERIODS * periodFrames;
+    double start = waitForFrame(firstFrame);
+    unsigned long long lastFrame = firstFrame + numPeriods * periodFrames;
+    double seconds = waitForFrame(lastFrame) - start;
+    long periodsMixed = (long)((AudioMixer_getFramePosition() - firstFrame) / periodFrames);
+
+    AudioMixer_setSequencer(NULL);
+    Instruments_cleanup();
+    unsigned int sampleRate = AudioMixer_getSampleRate();
+    AudioMixer_cleanup();
+    Period_cleanup();
+
+    double usPerPeriod = seconds * 1e6 / periodsMixed;
+    double periodUs = periodFrames * 1e6 / sampleRate;
+    printf("%s mix: %d voices, %lu-frame periods at %u Hz\n",
+            sizeof(sample_t) == sizeof(float) ? "float32" : "int16",
+            numLanes, periodFrames, sampleRate);
+    printf("%ld periods in %.3f s: %.2f us per period, %.2f ns per voice-frame, %.2f%% of real time\n",
+            periodsMixed, seconds, usPerPeriod, usPerPeriod * 1e3 / (numLanes * periodFrames),
+            100 * usPerPeriod / periodUs);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Node sync test: one BeatBox on the null audio output, as the leader or a
+// follower of synchronized starts, printing the sync statistics every
+// second. Run a leader and followers side by side (followers first: they
+// need a few clock exchanges before the first start):
+//
+//   beatbox_node_sync leader|follower [-g group] [-i interface] [-p port] [-b bpm]
+//                     [-m mode] [-t seconds] [-s thread|clock] [-w wave-dir]
+//
+// Defaults: group 239.255.43.3 on loopback (127.0.0.1), port 12347, 120 BPM,
+// mode 1, 30 seconds, the audio-clock sequencer. The leader starts `mode`
+// on every node after 3 seconds, and again every 10.
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "instruments.h"
+#include "nodeSync.h"
+#include "periodTimer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifndef BENCH_WAVE_FILE_DIR
+#define BENCH_WAVE_FILE_DIR "beatbox-wave-files"
+#endif
+
+#define FIRST_START_SECONDS 3
+#define START_EVERY_SECONDS 10
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s leader|follower [-g group] [-i interface] [-p port] [-b bpm]"
+            " [-m mode] [-t seconds] [-s thread|clock] [-w wave-dir]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *group = "239.255.43.3";
+    const char *interfaceAddress = "127.0.0.1";
+    int port = 12347;
+    int bpm = 120;
+    int mode = 1;
+    int seconds = 30;
+    BeatBox_sequencer_t type = BEATBOX_SEQ_AUDIO_CLOCK;
+    const char *waveDir = BENCH_WAVE_FILE_DIR;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+    NodeSync_role_t role;
+    if (strcmp(argv[1], "leader") == 0) {
+        role = NODESYNC_LEADER;
+    } else if (strcmp(argv[1], "follower") == 0) {
+        role = NODESYNC_FOLLOWER;
+    } else {
+        usage(argv[0]);
+    }
+
+    int option;
+    optind = 2;
+    while ((option = getopt(argc, argv, "g:i:p:b:m:t:s:w:")) != -1) {
+        if (option == 'g') {
+            group = optarg;
+        } else if (option == 'i') {
+            interfaceAddress = optarg;
+        } else if (option == 'p' && atoi(optarg) > 0) {
+            port = atoi(optarg);
+        } else if (option == 'b' && atoi(optarg) >= 40 && atoi(optarg) <= 300) {
+            bpm = atoi(optarg);
+        } else if (option == 'm' && atoi(optarg) > 0) {
+            mode = atoi(optarg);
+        } else if (option == 't' && atoi(optarg) > 0) {
+            seconds = atoi(optarg);
+        } else if (option == 's' && strcmp(optarg, "thread") == 0) {
+            type = BEATBOX_SEQ_THREAD;
+        } else if (option == 's' && strcmp(optarg, "clock") == 0) {
+            type = BEATBOX_SEQ_AUDIO_CLOCK;
+        } else if (option == 'w') {
+            waveDir = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    Period_init();
+    AudioMixer_setOutput(AUDIOMIXER_OUTPUT_NULL);
+    AudioMixer_init();
+    Instruments_init(waveDir);
+    BeatBox_setSequencer(type);
+    BeatBox_init();
+    setBPM(bpm);
+    setMode(mode);
+    NodeSync_init(group, interfaceAddress, port);
+    NodeSync_setRole(role);
+
+    if (role == NODESYNC_LEADER) {
+        printf("%-4s %5s %5s %10s %10s %10s\n", "sec", "nodes", "bars", "align ms", "max ms", "spread ms");
+    } else {
+        printf("%-4s %4s %10s %9s %9s %5s %10s %10s\n",
+                "sec", "exch", "offset ms", "skew ppm", "delay ms", "bars", "align ms", "max ms");
+    }
+    for (int second = 1; second <= seconds; second++) {
+        sleep(1);
+        if (role == NODESYNC_LEADER && second >= FIRST_START_SECONDS
+                && (second - FIRST_START_SECONDS) % START_EVERY_SECONDS == 0) {
+            NodeSync_startPattern(mode);
+            printf("Start: mode %d at %d BPM\n", mode, bpm);
+        }
+
+        NodeSync_stats_t stats;
+        NodeSync_getStatsAndClear(&stats);
+        if (role == NODESYNC_LEADER) {
+            printf("%-4d %5d %5d %+10.3f %10.3f %10.3f\n", second, stats.numNodes, stats.numBars,
+                    stats.lastAlignMs, stats.maxAbsAlignMs, stats.spreadMs);
+        } else {
+            printf("%-4d %4d %10.3f %+9.2f %9.3f %5d %+10.3f %10.3f\n", second, stats.numExchanges,
+                    stats.offsetMs, stats.skewPpm, stats.delayMs, stats.numBars,
+                    stats.lastAlignMs, stats.maxAbsAlignMs);
+        }
+        fflush(stdout);
+    }
+
+    NodeSync_cleanup();
+    setMode(0);
+    BeatBox_cleanup();
+    Instruments_cleanup();
+    AudioMixer_cleanup();
+    Period_cleanup();
+    return 0;
+}
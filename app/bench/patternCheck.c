@@ -0,0 +1,169 @@
+// Pattern feel golden check: the delay and velocity of every hit of a few
+// swung and humanized patterns over two bars, against stored values. Swing
+// and humanize must stay exact and deterministic for a given seed, so that
+// cached and live renders match and a pattern always plays the same.
+//
+//   beatbox_pattern_check [-g]
+//
+// Exits with a failure status on any difference. -g prints the values as
+// they are now, in the form of the tables below, for a deliberate change.
+#include "beatPattern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#define SAMPLE_RATE 44100
+#define BEAT_FRAMES 22050.0     // 120 BPM
+#define NUM_BARS 2
+#define MAX_HITS 64
+
+typedef struct {
+    int delay;
+    int velocity;
+} hit_t;
+
+typedef struct {
+    const char *name;
+    int pattern;                // Index into the built-in set
+    int swing;
+    int humanizeMs;
+    int humanizeVelocity;
+    uint32_t seed;
+    int numHits;
+    hit_t hits[MAX_HITS];
+} goldenCase_t;
+
+static const goldenCase_t cases[] = {
+    // Rock has no sixteenths, so its off-beat eighths swing
+    {
+        .name = "rock swing 66",
+        .pattern = 0, .swing = 66,
+        .numHits = 12,
+        .hits = {
+            {0, 127}, {0, 127}, {3528, 127}, {0, 127}, {0, 127}, {3528, 127},
+            {0, 127}, {0, 127}, {3528, 127}, {0, 127}, {0, 127}, {3528, 127},
+        },
+    },
+    {
+        .name = "custom swing 66",
+        .pattern = 1, .swing = 66,
+        .numHits = 28,
+        .hits = {
+            {0, 127}, {0, 127}, {1764, 127}, {1764, 127}, {0, 127}, {0, 127},
+            {1764, 127}, {1764, 127}, {0, 127}, {0, 127}, {1764, 127}, {0, 127},
+            {0, 127}, {1764, 127}, {0, 127}, {0, 127}, {1764, 127}, {1764, 127},
+            {0, 127}, {0, 127}, {1764, 127}, {1764, 127}, {0, 127}, {0, 127},
+            {1764, 127}, {0, 127}, {0, 127}, {1764, 127},
+        },
+    },
+    {
+        .name = "custom humanize 20 40 1234",
+        .pattern = 1, .humanizeMs = 20, .humanizeVelocity = 40, .seed = 1234,
+        .numHits = 28,
+        .hits = {
+            {277, 98}, {97, 105}, {701, 111}, {739, 119}, {723, 125}, {704, 94},
+            {618, 124}, {114, 102}, {770, 88}, {293, 97}, {10, 102}, {879, 123},
+            {248, 124}, {172, 126}, {533, 102}, {305, 118}, {265, 93}, {254, 125},
+            {788, 111}, {253, 94}, {308, 103}, {703, 119}, {477, 100}, {57, 119},
+            {453, 105}, {74, 95}, {533, 127}, {303, 111},
+        },
+    },
+    {
+        .name = "rock swing 60 humanize 10 20 7",
+        .pattern = 0, .swing = 60, .humanizeMs = 10, .humanizeVelocity = 20, .seed = 7,
+        .numHits = 12,
+        .hits = {
+            {353, 125}, {154, 127}, {2366, 112}, {427, 113}, {361, 127}, {2566, 109},
+            {182, 118}, {429, 114}, {2244, 120}, {342, 122}, {351, 127}, {2322, 109},
+        },
+    },
+};
+
+// Every hit of the case's pattern over NUM_BARS bars, in play order.
+// Returns the number of hits.
+static int getHits(const goldenCase_t *pCase, hit_t *pHits) {
+    beatPattern_t pattern = BeatPattern_getBuiltinSet()->patterns[pCase->pattern];
+    pattern.swing = pCase->swing;
+    pattern.humanizeMs = pCase->humanizeMs;
+    pattern.humanizeVelocity = pCase->humanizeVelocity;
+    pattern.seed = pCase->seed;
+
+    int numHits = 0;
+    const beatLayer_t *pLayer = &pattern.layers[0];
+    for (unsigned bar = 0; bar < NUM_BARS; bar++) {
+        for (int step = 0; step < pLayer->numSteps; step++) {
+            for (unsigned hits = pLayer->hits[step]; hits != 0; hits &= hits - 1) {
+                int track = __builtin_ctz(hits);
+                if (numHits < MAX_HITS) {
+                    pHits[numHits].delay = BeatPattern_getHitDelay(&pattern, 0, bar, step, track,
+                            BEAT_FRAMES, SAMPLE_RATE, &pHits[numHits].velocity);
+                }
+                numHits++;
+            }
+        }
+    }
+    return numHits;
+}
+
+static void printHits(const goldenCase_t *pCase, const hit_t *pHits, int numHits) {
+    printf("    // %s\n", pCase->name);
+    printf("        .numHits = %d,\n", numHits);
+    printf("        .hits = {");
+    for (int i = 0; i < numHits && i < MAX_HITS; i++) {
+        printf("%s{%d, %d},", i % 6 == 0 ? "\n            " : " ", pHits[i].delay, pHits[i].velocity);
+    }
+    printf("\n        },\n");
+}
+
+static bool checkHits(const goldenCase_t *pCase, const hit_t *pHits, int numHits) {
+    if (numHits != pCase->numHits) {
+        printf("FAIL %s: %d hits, expected %d\n", pCase->name, numHits, pCase->numHits);
+        return false;
+    }
+    bool passed = true;
+    for (int i = 0; i < numHits; i++) {
+        if (pHits[i].delay != pCase->hits[i].delay || pHits[i].velocity != pCase->hits[i].velocity) {
+            printf("FAIL %s: hit %d is {%d, %d}, expected {%d, %d}\n", pCase->name, i,
+                    pHits[i].delay, pHits[i].velocity, pCase->hits[i].delay, pCase->hits[i].velocity);
+            passed = false;
+        }
+    }
+    if (passed) {
+        printf("ok   %s\n", pCase->name);
+    }
+    return passed;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-g]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    bool generate = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "g")) != -1) {
+        if (option == 'g') {
+            generate = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    bool allPassed = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        hit_t hits[MAX_HITS];
+        int numHits = getHits(&cases[i], hits);
+        if (generate) {
+            printHits(&cases[i], hits, numHits);
+        } else if (!checkHits(&cases[i], hits, numHits)) {
+            allPassed = false;
+        }
+    }
+    return allPassed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,267 @@
+// Beat timing benchmark: runs the sequencers against the null audio output
+// at several tempos, records the frame at which every step's hit actually
+// starts, and reports how far those land from the ideal grid.
+//
+//   beatbox_timing_bench [-m minutes] [-s thread|clock|both] [-w wave-dir] [bpm ...]
+//
+// Defaults: 1 minute per run, both sequencers, 60 90 120 200 300 BPM.
+// Each run is a child process, so every run starts from a fresh BeatBox.
+//
+// Jitter is how far each step-to-step interval is from the ideal one;
+// drift is where the last step landed relative to the ideal grid started
+// at the first step (so it includes any rounding of the step length).
+//
+// In a BEATBOX_RT_AUDIT build every run is audited too: a run that made a
+// real-time violation prints its report, and the bench exits with a failure
+// status.
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "beatPattern.h"
+#include "instruments.h"
+#include "periodTimer.h"
+#include "rtAudit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#ifndef BENCH_WAVE_FILE_DIR
+#define BENCH_WAVE_FILE_DIR "beatbox-wave-files"
+#endif
+
+#define STEPS_PER_BEAT 4            // Sixteenth notes
+#define MS_PER_SECOND 1000.0
+#define SECONDS_PER_MINUTE 60
+
+static const int defaultTempos[] = { 60, 90, 120, 200, 300 };
+
+typedef struct {
+    unsigned int sampleRate;
+    unsigned long periodFrames;
+    int numSteps;
+    double meanJitterMs;
+    double p99JitterMs;
+    double maxJitterMs;
+    double driftMs;
+    long numRtViolations;       // Always 0 unless auditing
+} runResult_t;
+
+// Filled by the mixer's voice observer on the playback thread
+static unsigned long long *triggerFrames;
+static int maxTriggers;
+static atomic_int numTriggers;
+
+static void recordTrigger(unsigned long long startFrame) {
+    int index = atomic_load_explicit(&numTriggers, memory_order_relaxed);
+    if (index < maxTriggers) {
+        triggerFrames[index] = startFrame;
+        atomic_store_explicit(&numTriggers, index + 1, memory_order_release);
+    }
+}
+
+// One pattern of a single hi-hat on every sixteenth, so every voice started
+// is exactly one step.
+static beatPatternSet_t *createBenchSet(void) {
+    beatPatternSet_t *pSet = calloc(1, sizeof(*pSet));
+    beatPattern_t *pPattern = &pSet->patterns[0];
+
+    pSet->id = -1;      // Not from a file
+    pSet->numPatterns = 1;
+    strcpy(pPattern->name, "bench");
+    pPattern->numTracks = 1;
+    pPattern->instrument[0] = INSTRUMENT_HI_HAT;
+    pPattern->numLayers = 1;
+    beatLayer_t *pLayer = &pPattern->layers[0];
+    pLayer->numSteps = STEPS_PER_BEAT;
+    pLayer->stepsPerBeat = STEPS_PER_BEAT;
+    for (int step = 0; step < STEPS_PER_BEAT; step++) {
+        pLayer->hits[step] = BEAT_HIT(0);
+        pLayer->velocity[step][0] = AUDIOMIXER_MAX_VELOCITY;
+    }
+    return pSet;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void analyze(double idealStepFrames, runResult_t *pResult) {
+    int count = atomic_load(&numTriggers);
+    double msPerFrame = MS_PER_SECOND / pResult->sampleRate;
+    pResult->numSteps = count;
+    if (count < 2) {
+        return;
+    }
+
+    double *jitterMs = malloc((count - 1) * sizeof(*jitterMs));
+    double sum = 0;
+    for (int i = 1; i < count; i++) {
+        double interval = (double)(triggerFrames[i] - triggerFrames[i - 1]);
+        double error = interval - idealStepFrames;
+        jitterMs[i - 1] = (error < 0 ? -error : error) * msPerFrame;
+        sum += jitterMs[i - 1];
+    }
+    qsort(jitterMs, count - 1, sizeof(*jitterMs), compareDoubles);
+
+    pResult->meanJitterMs = sum / (count - 1);
+    pResult->p99JitterMs = jitterMs[(int)((count - 2) * 0.99)];
+    pResult->maxJitterMs = jitterMs[count - 2];
+    double lastIdeal = triggerFrames[0] + (count - 1) * idealStepFrames;
+    pResult->driftMs = (triggerFrames[count - 1] - lastIdeal) * msPerFrame;
+    free(jitterMs);
+}
+
+// Child side: play the bench pattern for `minutes` and measure it.
+static void runOnce(BeatBox_sequencer_t type, int bpm, double minutes, const char *waveDir,
+        runResult_t *pResult) {
+    double idealSteps = minutes * bpm * STEPS_PER_BEAT;
+    maxTriggers = (int)idealSteps + 2 * bpm;
+    triggerFrames = malloc(maxTriggers * sizeof(*triggerFrames));
+
+    Period_init();
+    AudioMixer_setOutput(AUDIOMIXER_OUTPUT_NULL);
+    AudioMixer_init();
+    Instruments_init(waveDir);
+    BeatBox_setSequencer(type);
+    BeatBox_init();
+    BeatBox_setBarCacheEnabled(false);  // One voice per step
+    BeatBox_setPatternSet(createBenchSet());
+    setBPM(bpm);
+    AudioMixer_setVoiceObserver(recordTrigger);
+
+    setMode(1);
+    long long runNs = (long long)(minutes * SECONDS_PER_MINUTE * 1e9);
+    struct timespec runTime = { runNs / 1000000000, runNs % 1000000000 };
+    while (nanosleep(&runTime, &runTime) != 0) {
+        // Interrupted: sleep the rest
+    }
+    setMode(0);
+
+    AudioMixer_setVoiceObserver(NULL);
+    BeatBox_cleanup();
+    Instruments_cleanup();
+    pResult->sampleRate = AudioMixer_getSampleRate();
+    pResult->periodFrames = AudioMixer_getPeriodFrames();
+    AudioMixer_cleanup();
+    Period_cleanup();
+    if (RtAudit_getViolationCount() > 0) {
+        pResult->numRtViolations = RtAudit_report();
+    }
+
+    double idealStepFrames = (double)pResult->sampleRate * SECONDS_PER_MINUTE
+            / (bpm * STEPS_PER_BEAT);
+    analyze(idealStepFrames, pResult);
+    free(triggerFrames);
+}
+
+// Run in a child (with its chatter discarded) and collect the result.
+// Fails if the child did not report or did not exit cleanly, e.g. it crashed
+// during cleanup after reporting.
+static _Bool runChild(BeatBox_sequencer_t type, int bpm, double minutes, const char *waveDir,
+        runResult_t *pResult) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            perror("freopen");
+        }
+        runResult_t result = {0};
+        runOnce(type, bpm, minutes, waveDir, &result);
+        _Bool ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    _Bool ok = pid > 0 && read(fds[0], pResult, sizeof(*pResult)) == sizeof(*pResult);
+    close(fds[0]);
+    if (pid > 0) {
+        int status = 0;
+        ok = waitpid(pid, &status, 0) == pid && ok
+                && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+    return ok;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m minutes] [-s thread|clock|both] [-w wave-dir] [bpm ...]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    double minutes = 1.0;
+    const char *waveDir = BENCH_WAVE_FILE_DIR;
+    _Bool runThread = true;
+    _Bool runClock = true;
+
+    int option;
+    while ((option = getopt(argc, argv, "m:s:w:")) != -1) {
+        if (option == 'm' && atof(optarg) > 0) {
+            minutes = atof(optarg);
+        } else if (option == 's' && strcmp(optarg, "thread") == 0) {
+            runClock = false;
+        } else if (option == 's' && strcmp(optarg, "clock") == 0) {
+            runThread = false;
+        } else if (option == 's' && strcmp(optarg, "both") == 0) {
+            runThread = runClock = true;
+        } else if (option == 'w') {
+            waveDir = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    int numTempos = argc - optind;
+    int *tempos = malloc(sizeof(defaultTempos) + numTempos * sizeof(*tempos));
+    for (int i = 0; i < numTempos; i++) {
+        tempos[i] = atoi(argv[optind + i]);
+        if (tempos[i] < 40 || tempos[i] > 300) {
+            usage(argv[0]);
+        }
+    }
+    if (numTempos == 0) {
+        numTempos = sizeof(defaultTempos) / sizeof(defaultTempos[0]);
+        memcpy(tempos, defaultTempos, sizeof(defaultTempos));
+    }
+
+    printf("Beat timing: %.2f min per run, sixteenth-note steps, null audio output\n", minutes);
+    _Bool allPassed = true;
+    printf("%-9s %4s %7s  %23s  %10s\n",
+            "sequencer", "bpm", "steps", "jitter mean/p99/max ms", "drift ms");
+    for (int pass = 0; pass < 2; pass++) {
+        if ((pass == 0 && !runThread) || (pass == 1 && !runClock)) {
+            continue;
+        }
+        BeatBox_sequencer_t type = (pass == 0) ? BEATBOX_SEQ_THREAD : BEATBOX_SEQ_AUDIO_CLOCK;
+        for (int i = 0; i < numTempos; i++) {
+            runResult_t result;
+            if (!runChild(type, tempos[i], minutes, waveDir, &result)) {
+                fprintf(stderr, "ERROR: run at %d BPM failed.\n", tempos[i]);
+                allPassed = false;
+                continue;
+            }
+            printf("%-9s %4d %7d  %7.3f /%7.3f /%7.3f  %+10.3f\n",
+                    pass == 0 ? "thread" : "clock", tempos[i], result.numSteps,
+                    result.meanJitterMs, result.p99JitterMs, result.maxJitterMs, result.driftMs);
+            if (result.numRtViolations > 0) {
+                printf("          ^ %ld real-time violation(s)\n", result.numRtViolations);
+                allPassed = false;
+            }
+        }
+    }
+    free(tempos);
+    return allPassed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,33 +1,120 @@
-// Playback sounds in real time, allowing multiple simultaneous wave files
-// to be mixed together and played without jitter.
-#ifndef AUDIO_MIXER_H
-#define AUDIO_MIXER_H
-
-typedef struct {
-	int numSamples;
-	short *pData;
-} wavedata_t;
-
-#define AUDIOMIXER_MAX_VOLUME 100
-
-// init() must be called before any other functions,
-// cleanup() must be called last to stop playback threads and free memory.
-void AudioMixer_init(void);
-void AudioMixer_cleanup(void);
-
-// Read the contents of a wave file into the pSound structure. Note that
-// the pData pointer in this structure will be dynamically allocated in
-// readWaveFileIntoMemory(), and is freed by calling freeWaveFileData().
-void AudioMixer_readWaveFileIntoMemory(char *fileName, wavedata_t *pSound);
-void AudioMixer_freeWaveFileData(wavedata_t *pSound);
-
-// Queue up another sound bite to play as soon as possible.
-void AudioMixer_queueSound(wavedata_t *pSound);
-
-// Get/set the volume.
-// setVolume() function posted by StackOverflow user "trenki" at:
-// http://stackoverflow.com/questions/6787318/set-alsa-master-volume-from-c-code
-int  AudioMixer_getVolume();
-void AudioMixer_setVolume(int newVolume);
-
-#endif
+// Playback sounds in real time, allowing multiple simultaneous wave files
+// to be mixed together and played without jitter.
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+// Internal sample format, chosen at compile time. The default is int16;
+// define AUDIOMIXER_FLOAT_SAMPLES (CMake option BEATBOX_FLOAT_SAMPLES) to mix
+// in float32 instead. Either way the output is converted to S16 for ALSA.
+#ifdef AUDIOMIXER_FLOAT_SAMPLES
+typedef float sample_t;
+#else
+typedef short sample_t;
+#endif
+
+typedef struct {
+	int numSamples;
+	sample_t *pData;
+} wavedata_t;
+
+#include <stdbool.h>
+
+#define AUDIOMIXER_MAX_VOLUME 100
+#define AUDIOMIXER_MAX_VELOCITY 127		// Per-sound level; gain is velocity / max
+
+// Where the mix goes:
+// - AUDIOMIXER_OUTPUT_ALSA (default): the "default" ALSA device.
+// - AUDIOMIXER_OUTPUT_NULL: nowhere. The playback thread still consumes one
+//   period per period-time on CLOCK_MONOTONIC, as a card would, so timing
+//   can be measured without audio hardware (see app/bench/).
+// - AUDIOMIXER_OUTPUT_FREEWHEEL: nowhere, as fast as the mixer can go, so
+//   the cost of mixing a period can be measured (beatbox_mix_bench).
+typedef enum {
+	AUDIOMIXER_OUTPUT_ALSA,
+	AUDIOMIXER_OUTPUT_NULL,
+	AUDIOMIXER_OUTPUT_FREEWHEEL,
+} AudioMixer_output_t;
+
+// Choose the output; must be called before init().
+void AudioMixer_setOutput(AudioMixer_output_t output);
+
+// init() must be called before any other functions,
+// cleanup() must be called last to stop playback threads and free memory.
+void AudioMixer_init(void);
+void AudioMixer_cleanup(void);
+
+// Output format negotiated with the sound card by init(). The mixer runs at
+// the card's native rate (44.1 kHz preferred) rather than resampling, so all
+// timing should be computed in frames at getSampleRate().
+unsigned int AudioMixer_getSampleRate(void);
+unsigned int AudioMixer_getNumChannels(void);
+unsigned long AudioMixer_getPeriodFrames(void);
+
+// Read the contents of a wave file into the pSound structure. Note that
+// the pData pointer in this structure will be dynamically allocated in
+// readWaveFileIntoMemory(), and is freed by calling freeWaveFileData().
+// Must be called after init(): the data is resampled to the output rate.
+void AudioMixer_readWaveFileIntoMemory(char *fileName, wavedata_t *pSound);
+void AudioMixer_freeWaveFileData(wavedata_t *pSound);
+
+// Allocate a silent (zeroed) sound of numSamples; free with freeWaveFileData().
+void AudioMixer_allocWaveData(wavedata_t *pSound, int numSamples);
+
+// Offline render: mix pSound into pDest at `velocity`, starting at sample
+// `offset`. Samples that would run past the end of pDest are left out.
+void AudioMixer_mixInto(wavedata_t *pDest, wavedata_t *pSound, int offset, int velocity);
+
+// Queue up another sound bite to play as soon as possible.
+// Each voice fades in over a short attack ramp to avoid clicks.
+void AudioMixer_queueSound(wavedata_t *pSound);
+
+// As queueSound(), at velocity 0..AUDIOMIXER_MAX_VELOCITY (queueSound() is
+// max), starting delayFrames into the buffer in which it is picked up.
+void AudioMixer_queueSoundDelayed(wavedata_t *pSound, int delayFrames, int velocity);
+
+// As queueSound(), but without the attack ramp. For pre-rendered material
+// whose first sample continues the previous buffer (e.g. a looped bar).
+void AudioMixer_queueSoundNoAttack(wavedata_t *pSound);
+
+// Fade out every queued/playing instance of pSound over a short release ramp;
+// instances queued with a delay that haven't started yet are dropped.
+// Once this returns the caller may safely free or overwrite pSound's data.
+void AudioMixer_dequeueSound(wavedata_t *pSound);
+
+// Audio-clock sequencing. A sequencer is called on the playback thread at the
+// start of every buffer, with the absolute frame position of the buffer's
+// first frame (see getFramePosition()) and its length in frames. It runs in
+// the real-time section, so it must not block, allocate or print; it starts
+// sounds with startSoundAt(). Pass NULL to remove it. setSequencer() returns
+// once the previous sequencer can no longer be running.
+typedef void (*AudioMixer_sequencer_t)(unsigned long long bufferStartFrame, int numFrames);
+void AudioMixer_setSequencer(AudioMixer_sequencer_t sequencer);
+
+// From inside the sequencer only: start pSound at `velocity` exactly `offset`
+// frames into the current buffer (offset may run past it), with or without
+// the attack ramp.
+void AudioMixer_startSoundAt(wavedata_t *pSound, int offset, int velocity, bool attack);
+
+// From inside the sequencer only: start the release of every voice playing
+// pSound, from the start of the current buffer, and drop any not started
+// yet. Unlike dequeueSound() this doesn't wait, so pSound must stay valid
+// until the release has played out.
+void AudioMixer_releaseSound(wavedata_t *pSound);
+
+// Frames mixed since init(): the audio clock that sequencing is based on.
+unsigned long long AudioMixer_getFramePosition(void);
+
+// Timing measurement: an observer is called on the playback thread with the
+// absolute frame at which each voice starts (its buffer's first frame plus
+// its offset), under the same real-time rules as a sequencer. Pass NULL to
+// remove it; like setSequencer(), this returns once the old one is done.
+typedef void (*AudioMixer_voiceObserver_t)(unsigned long long startFrame);
+void AudioMixer_setVoiceObserver(AudioMixer_voiceObserver_t observer);
+
+// Get/set the volume.
+// setVolume() function posted by StackOverflow user "trenki" at:
+// http://stackoverflow.com/questions/6787318/set-alsa-master-volume-from-c-code
+int  AudioMixer_getVolume();
+void AudioMixer_setVolume(int newVolume);
+
+#endif
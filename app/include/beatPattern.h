@@ -0,0 +1,110 @@
+// Drum patterns as data: one or more layers, each a loop of N steps over
+// the pattern's instrument tracks, at its own resolution. Each step stores
+// a bitmask of the tracks that sound on it, plus a velocity per track, so a
+// single generic player can walk any pattern. Each track plays one
+// instrument from the registry (see instruments.h).
+//
+// Layers loop independently from the moment the pattern starts, so layers
+// of different lengths are polymetric (e.g. a 3-step tom loop over a
+// 16-step hi-hat). The first layer's loop is the pattern's bar.
+#ifndef BEAT_PATTERN_H
+#define BEAT_PATTERN_H
+
+#include <stdint.h>
+
+#define BEATPATTERN_MAX_STEPS 32
+#define BEATPATTERN_MAX_TRACKS 8    // Tracks fit the per-step uint8_t mask
+#define BEATPATTERN_MAX_NAME 16
+#define BEATPATTERN_MAX_LAYERS 4
+
+#define BEAT_HIT(track) (1u << (track))
+
+// Feel: swing delays every odd sixteenth of the beat, counted from the
+// start of the pattern in every layer alike; 50% (or 0) is straight, 66% a
+// triplet shuffle. A pattern with no layer finer than eighths swings its
+// odd eighths instead. Humanize delays each hit by up to humanizeMs and lowers its
+// velocity by up to humanizeVelocity, using values drawn from `seed`, the
+// bar number, step and track only, so a given seed always plays the same.
+#define BEATPATTERN_SWING_STRAIGHT 50
+#define BEATPATTERN_SWING_MAX 75
+#define BEATPATTERN_HUMANIZE_MAX_MS 30
+
+typedef struct {
+    uint8_t numSteps;                   // 1..BEATPATTERN_MAX_STEPS
+    uint8_t stepsPerBeat;
+    uint8_t hits[BEATPATTERN_MAX_STEPS];    // BEAT_HIT() bits of the tracks hit on each step
+    uint8_t velocity[BEATPATTERN_MAX_STEPS][BEATPATTERN_MAX_TRACKS];  // 0..AUDIOMIXER_MAX_VELOCITY
+} beatLayer_t;
+
+typedef struct {
+    char name[BEATPATTERN_MAX_NAME];
+    uint8_t swing;                      // Percent, up to BEATPATTERN_SWING_MAX
+    uint8_t humanizeMs;                 // 0..BEATPATTERN_HUMANIZE_MAX_MS
+    uint8_t humanizeVelocity;
+    uint32_t seed;
+    uint8_t numTracks;
+    uint8_t instrument[BEATPATTERN_MAX_TRACKS];     // Instrument ID of each track
+    uint8_t numLayers;                  // 1..BEATPATTERN_MAX_LAYERS
+    beatLayer_t layers[BEATPATTERN_MAX_LAYERS];
+} beatPattern_t;
+
+// Where and how hard a hit lands: its delay in frames after its step's
+// grid time, for a beat of beatFrames (exact, at the output rate
+// sampleRate), and its velocity. `cycle` counts the layer's loops since the pattern started
+// (for the first layer, the bar number). Deterministic; see the feel notes
+// above.
+int BeatPattern_getHitDelay(const beatPattern_t *pPattern, int layer, unsigned cycle, int step,
+        int track, double beatFrames, unsigned int sampleRate, int *pVelocity);
+
+// True if every bar of the pattern sounds the same (no humanize, every
+// layer's loop fits a whole number of times into the bar, and with swing
+// the bar is whole swing pairs), so one rendered
+// bar can stand in for all of them.
+_Bool BeatPattern_isRepeatable(const beatPattern_t *pPattern);
+
+// An ordered set of patterns: mode n plays patterns[n-1]. A set may also
+// hold a song: a list of its patterns, each played for some number of bars.
+#define BEATPATTERN_MAX_PATTERNS 16
+#define BEATPATTERN_MAX_SONG_ENTRIES 64
+#define BEATPATTERN_MAX_REPEATS 255
+
+typedef struct {
+    uint8_t pattern;    // Index into patterns[]
+    uint8_t repeats;    // Bars it plays for, 1..BEATPATTERN_MAX_REPEATS
+} beatSongEntry_t;
+
+typedef struct {
+    int id;             // Unique per loaded set (0 is the built-in set)
+    int numPatterns;    // At least 1
+    beatPattern_t patterns[BEATPATTERN_MAX_PATTERNS];
+    int songLength;     // Song entries; 0 if the set has no song
+    int songBars;       // Total bars in the song
+    beatSongEntry_t song[BEATPATTERN_MAX_SONG_ENTRIES];
+} beatPatternSet_t;
+
+// The built-in set: Rock, then Custom. Never freed.
+const beatPatternSet_t *BeatPattern_getBuiltinSet(void);
+
+// Parse a pattern file into a newly allocated set. Returns NULL (after
+// printing the offending line) if the file can't be read or has errors.
+//
+// Format, one directive per line ('#' starts a comment):
+//   pattern <name> <steps-per-beat>    Start the next pattern (and its first layer)
+//   layer <steps-per-beat>             Start another layer of the pattern
+//   swing <percent>                    Optional, 50 (straight) to 75
+//   humanize <ms> <velocity> <seed>    Optional, see the feel notes above
+//   song <name>[*<bars>] ...           Append to the song: each named pattern
+//                                      (defined above) for 1 or <bars> bars
+//   <instrument> <steps>               One character per step:
+//                                      '.' rest, 'x' full velocity,
+//                                      '1'-'9' softer (9 is full)
+// Instruments are named as for Instruments_find() (e.g. bass, hihat, snare,
+// tom, splash, gui-drum-co or an ID), up to 8 per pattern; all of a
+// layer's instrument lines must have the same number of steps.
+// Must be called after Instruments_init().
+beatPatternSet_t *BeatPattern_loadFile(const char *fileName);
+
+// Free a set from loadFile(); the built-in set is ignored.
+void BeatPattern_freeSet(const beatPatternSet_t *pSet);
+
+#endif
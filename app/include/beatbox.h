@@ -1,33 +1,146 @@
 #ifndef BEATBOX_H
 #define BEATBOX_H
 
-#include <pthread.h>
+#include "beatPattern.h"
 
-// Initialize the BeatBox system (loads sounds, starts the beat thread)
+// How beats are scheduled:
+// - BEATBOX_SEQ_AUDIO_CLOCK (default): the sequencer runs inside the audio
+//   playback thread, stepping on the mixer's frame counter, and starts each
+//   sound at its exact frame. No beat thread exists.
+// - BEATBOX_SEQ_THREAD: a separate beat thread sleeps until each step's
+//   deadline and queues the sounds, so hits land on buffer boundaries.
+typedef enum {
+    BEATBOX_SEQ_AUDIO_CLOCK,
+    BEATBOX_SEQ_THREAD,
+} BeatBox_sequencer_t;
+
+// Choose the sequencer; must be called before BeatBox_init().
+void BeatBox_setSequencer(BeatBox_sequencer_t type);
+
+// Initialize the BeatBox system (starts the sequencer). The instruments
+// must already be loaded (Instruments_init()).
 void BeatBox_init(void);
 
-// Cleanup BeatBox system (frees memory, stops the beat thread)
+// Cleanup BeatBox system (frees memory, stops the sequencer); call before
+// Instruments_cleanup().
 void BeatBox_cleanup(void);
 
 // Set the BPM (Tempo) - must be in the range 40-300
+// A tempo change is heard at once: the beat carries on from where it is at
+// the new tempo, every layer together. A mode change starts the new
+// pattern at the first layer's next step.
 void setBPM(int bpm);
 
+// The getters read the published transport state (transport.h): lock-free.
 int getBPM();
 
+// Set the tempo from the next bar line on (tap tempo), so the change lands
+// on the downbeat; straight away if nothing is playing. A later setBPM()
+// cancels it.
+void BeatBox_setBPMAtNextBar(int bpm);
+
+// External clock sync: steer the sequencer tempo, in thousandths of a BPM
+// (within the bpm range), continuously; the beat carries on from where it
+// is. 0 hands the tempo back to setBPM(). getBPM() is not changed.
+void BeatBox_setSyncTempo(int milliBPM);
+
+// Where the beat is: at timeNs (CLOCK_MONOTONIC) the position was `beats`,
+// counted from the start of the pattern playing, moving on at `tempo` BPM.
+// Lock-free; for the clock sync. Returns false if nothing is playing.
+typedef struct {
+    long long timeNs;
+    double beats;
+    double tempo;
+    double beatsPerBar;     // Of the pattern playing
+} BeatBox_beatClock_t;
+_Bool BeatBox_getBeatClock(BeatBox_beatClock_t *pClock);
+
+// Start pattern `mode` from its first step at timeNs (CLOCK_MONOTONIC, as
+// in BeatBox_getBeatClock()): on the exact frame heard then with the
+// audio-clock sequencer, or the beat thread's frame due then. What is
+// playing carries on until then; at once if timeNs has passed. For starting
+// several BeatBoxes together. Replaces a start still pending; setMode() and
+// songs cancel it. Returns false if mode is out of range.
+_Bool BeatBox_startPatternAt(int mode, long long timeNs);
+
 // Set the beat mode: 
-// 0 - None (off), 1 - Rock, 2 - Custom
+// 0 - None (off), 1 - Rock, 2 - Custom, n - pattern n (up to getNumPatterns())
 void setMode(int mode);
 
 int getMode();
 
+// Set any of the tempo, mode and volume (-1 leaves one as it is) as one
+// change: the sequencer takes up the tempo and mode on the same step, and
+// the transport state publishes all three in one update. Returns false,
+// changing nothing, if any is out of range.
+_Bool BeatBox_setTransport(int bpm, int mode, int volume);
+
+// Number of patterns; the valid modes are 0..getNumPatterns().
+int BeatBox_getNumPatterns(void);
+
+// Replace the pattern set (initially the built-in one); the beatbox takes
+// ownership. The sequencer switches over at its next bar boundary, and this
+// returns once the old set has been freed. The mode is clamped to the new
+// set's size. Must not be called once BeatBox_cleanup() has started.
+void BeatBox_setPatternSet(const beatPatternSet_t *pSet);
+
+// Song mode: play the pattern set's song (see BeatPattern_loadFile()) from
+// `bar`, looping at its end. The song starts, and later moves between its
+// patterns, exactly on bar boundaries; while it plays getMode() reports the
+// current bar's pattern. setMode() stops it. Returns false if the set has
+// no song or `bar` is past its end. Also used to seek a playing song.
+_Bool BeatBox_playSong(int bar);
+
+// Stop the song; the pattern it was on carries on as the mode.
+void BeatBox_stopSong(void);
+
+// Bar of the song now playing (from 0), or -1 if none is.
+int BeatBox_getSongPosition(void);
+
+// Length of the current set's song in bars; 0 if it has none.
+int BeatBox_getSongBars(void);
+
+// Record mode: while enabled, every hit played with BeatBox_playInstrument()
+// (air drums, UDP `play`) is quantized to the nearest step of the playing
+// pattern's bar and added to the take, a one-bar loop played over the
+// pattern from the next bar on. Recording again overdubs the same take. The
+// take stays on while patterns share its grid; a pattern with a different
+// bar length or steps-per-beat starts an empty one.
+void BeatBox_setRecording(_Bool enabled);
+_Bool BeatBox_isRecording(void);
+
+// Empty the take (recording carries on if enabled).
+void BeatBox_clearRecording(void);
+
+// Step to the next pattern, wrapping through 0 (None).
 void cycleBeatMode();
 
-void playSnare();
-void playBassDrum();
-void playHiHat();
-void playTom();
-void playSplash();
-extern pthread_mutex_t beatMutex;
-extern int currentMode; 
+// Enable/disable the rendered-bar cache (on by default). When enabled, a
+// fixed pattern is mixed live for one bar, then replayed from a pre-rendered
+// copy as a single voice until the tempo, mode or sample set changes.
+void BeatBox_setBarCacheEnabled(_Bool enabled);
+
+// Sequencer timing: each step is scheduled at an absolute deadline on the
+// ideal beat grid. "Late" is how far after its grid time a step (of any
+// layer) actually fired; driftMs is the most recent step's offset, which
+// stays bounded (it does not accumulate) as long as the grid is holding.
+// The audio-clock sequencer starts steps on their exact frame, so its
+// steps are only late when one comes due in a buffer already begun (after
+// a stall); resyncs are the beat thread's alone.
+typedef struct {
+    int numSteps;
+    double minLateMs;
+    double maxLateMs;
+    double avgLateMs;
+    double driftMs;
+    int numResyncs;     // Times the grid was moved on after a long stall
+} BeatBox_timingStats_t;
+
+// Fill pStats with the step timing since the previous call, then clear it.
+void BeatBox_getTimingStatsAndClear(BeatBox_timingStats_t *pStats);
+
+// Play one instrument now (see instruments.h for IDs).
+// Returns false if there is no such instrument.
+_Bool BeatBox_playInstrument(int id);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+// Binary control protocol, on the UDP server's port alongside the text
+// one. A datagram whose first byte is BINARY_PROTOCOL_MAGIC (never the
+// start of a text command) is a frame of one or more commands, so a UI can
+// send "set tempo + set mode + play" in one datagram.
+//
+// The whole frame is checked before anything runs. If any command is
+// malformed, nothing runs: an unknown opcode, a bad payload type, a
+// non-zero reserved byte, or a volume, tempo or mode out of range. The
+// frame's settings (tempo, mode, volume; the last of each wins) then go in
+// as one change (BeatBox_setTransport()): the sequencer takes up the tempo
+// and mode on the same step, and they are published together. After that
+// the other commands run in order, each with its own status. One that fails
+// when run (a song, play or start) doesn't stop the rest.
+//
+// All fields are little-endian. A frame is an 8-byte header and then
+// 8 bytes per command:
+//
+//   header:   u8 magic, u8 version, u8 numCommands (1-16), u8 0 (reserved),
+//             u32 requestId (chosen by the sender)
+//   command:  u8 opcode, u8 payload type, u16 0 (reserved),
+//             i32 value (BINARY_PAYLOAD_INT32; 0 for BINARY_PAYLOAD_NONE)
+//
+// Reserved bytes must be 0, so later versions can give them a meaning.
+//
+// A command without a payload is a query, as the text command without its
+// value. The reply has the same layout. The header echoes requestId, and
+// its fourth byte is the frame's status. Then come one 8-byte result per
+// command, in order:
+//
+//   result:   u8 opcode, u8 status, u16 0,
+//             i32 value (the number the text reply gives; `play`: the
+//             instrument, `stop`: 0)
+//
+// A rejected frame is answered with its header alone. Frames too short to
+// carry a request ID are dropped.
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include "command.h"
+#include <stdint.h>
+
+#define BINARY_PROTOCOL_MAGIC 0xB7
+#define BINARY_PROTOCOL_VERSION 1
+#define BINARY_HEADER_SIZE 8
+#define BINARY_COMMAND_SIZE 8
+#define BINARY_MAX_COMMANDS 16
+#define BINARY_MAX_FRAME (BINARY_HEADER_SIZE + BINARY_MAX_COMMANDS * BINARY_COMMAND_SIZE)
+
+// Command id + 1, so decoding one is a subtraction. Part of the wire
+// format: new commands get new opcodes at the end.
+typedef enum {
+    BINARY_OP_MODE = COMMAND_MODE + 1,
+    BINARY_OP_SONG = COMMAND_SONG + 1,
+    BINARY_OP_RECORD = COMMAND_RECORD + 1,
+    BINARY_OP_TAP = COMMAND_TAP + 1,
+    BINARY_OP_SYNC = COMMAND_SYNC + 1,
+    BINARY_OP_NODE = COMMAND_NODE + 1,
+    BINARY_OP_START = COMMAND_START + 1,
+    BINARY_OP_VOLUME = COMMAND_VOLUME + 1,
+    BINARY_OP_TEMPO = COMMAND_TEMPO + 1,
+    BINARY_OP_PLAY = COMMAND_PLAY + 1,
+    BINARY_OP_STOP = COMMAND_STOP + 1,
+} BinaryProtocol_opcode_t;
+
+typedef enum {
+    BINARY_PAYLOAD_NONE,
+    BINARY_PAYLOAD_INT32,
+} BinaryProtocol_payload_t;
+
+typedef enum {
+    BINARY_STATUS_OK,
+    BINARY_STATUS_FAILED,       // Result: the command failed (the text one would say why)
+    BINARY_STATUS_BAD_FRAME,    // Header: malformed, nothing was run
+} BinaryProtocol_status_t;
+
+static inline _Bool BinaryProtocol_isFrame(const char *datagram, int length) {
+    return length > 0 && (unsigned char)datagram[0] == BINARY_PROTOCOL_MAGIC;
+}
+
+// Decode a frame into commands (BINARY_MAX_COMMANDS of room), without
+// running them. Returns how many it holds, or -1 if it is malformed.
+// *pRequestId is set if the frame is long enough to hold it.
+int BinaryProtocol_parse(const uint8_t *frame, int length, Command_t *commands,
+        uint32_t *pRequestId);
+
+// Parse and run a frame, writing the reply (BINARY_MAX_FRAME bytes) to
+// `reply`. Returns the reply's length, or 0 for none. *pStopRequested is
+// set if the frame ran `stop`: shutting down is up to the caller.
+int BinaryProtocol_handleFrame(const uint8_t *frame, int length, uint8_t *reply,
+        _Bool *pStopRequested);
+
+#endif
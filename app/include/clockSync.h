@@ -0,0 +1,43 @@
+// Beat clock over UDP, after MIDI clock: 24 pulses per beat.
+//
+// As master, the BeatBox sends a datagram "clock <n>" at every 24th of a
+// beat while it plays, n counting pulses since the pattern started. As
+// slave, it follows a master's pulses: a software phase-locked loop steers
+// the sequencer tempo (BeatBox_setSyncTempo) so its own beat stays in phase
+// with the master's, to the nearest beat. Each pulse carries its count, so
+// a lost datagram costs one correction rather than a pulse of phase.
+//
+// Phase error is the master's beat position minus ours as each pulse
+// arrives, in ms: positive means we are behind.
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+typedef enum {
+    CLOCKSYNC_OFF,
+    CLOCKSYNC_MASTER,
+    CLOCKSYNC_SLAVE,
+} ClockSync_role_t;
+
+typedef struct {
+    _Bool locked;           // Slave: following, within a pulse of the master
+    double tempo;           // BPM sent (master) or followed (slave)
+    int numPulses;          // Sent or received
+    int numLost;            // Gaps in the pulse count received
+    double lastErrorMs;
+    double meanAbsErrorMs;
+    double maxAbsErrorMs;
+} ClockSync_stats_t;
+
+// A master sends its pulses to `address` (a broadcast address reaches every
+// slave on the network) on `port`; a slave listens on `port`. Starts off.
+// Call after BeatBox_init(); cleanup before BeatBox_cleanup().
+void ClockSync_init(const char *address, int port);
+void ClockSync_cleanup(void);
+
+void ClockSync_setRole(ClockSync_role_t role);
+ClockSync_role_t ClockSync_getRole(void);
+
+// Counts and phase error since the last call.
+void ClockSync_getStatsAndClear(ClockSync_stats_t *pStats);
+
+#endif
@@ -0,0 +1,66 @@
+// Control commands: the text protocol of the UDP server ("mode 1",
+// "tempo", ...), a name with an optional integer value.
+//
+// A command is tokenized in place, without copying: its name is left
+// pointing into the datagram. The name is looked up in a perfect-hash
+// table of handlers, built at compile time. Numeric replies are formatted
+// with Command_formatInt() straight into the caller's reply buffer.
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#define COMMAND_MAX_REPLY 256           // Reply buffer size, NUL included
+
+typedef enum {
+    COMMAND_UNKNOWN = -1,
+    COMMAND_MODE,
+    COMMAND_SONG,
+    COMMAND_RECORD,
+    COMMAND_TAP,
+    COMMAND_SYNC,
+    COMMAND_NODE,
+    COMMAND_START,
+    COMMAND_VOLUME,
+    COMMAND_TEMPO,
+    COMMAND_PLAY,
+    COMMAND_STOP,
+    NUM_COMMANDS,
+} Command_id_t;
+
+typedef struct {
+    Command_id_t id;
+    const char *name;       // Points into the text; nameLength chars, not NUL-terminated
+    int nameLength;
+    _Bool hasValue;
+    int value;
+} Command_t;
+
+// Tokenize `length` chars of `text` (need not be NUL-terminated). Returns
+// false, with an error printed, if it holds no command; an unknown name is
+// parsed with id COMMAND_UNKNOWN.
+_Bool Command_parse(const char *text, int length, Command_t *pCommand);
+
+// Run a parsed command. Its reply, if any, is written NUL-terminated to
+// `reply` (COMMAND_MAX_REPLY bytes); returns the reply's length, 0 for none.
+// `stop` only replies: shutting down is up to the caller.
+int Command_execute(const Command_t *pCommand, char *reply);
+
+// Run a command of known id (for the binary protocol: `name` is not
+// used). Returns false if it failed; otherwise *pResult is the number the
+// text reply gives (`play`: the instrument, `stop`: 0).
+_Bool Command_run(const Command_t *pCommand, int *pResult);
+
+// False if the id is unknown, or the command sets volume, tempo or mode to
+// an out-of-range value. Other commands can still fail when run.
+_Bool Command_isValid(const Command_t *pCommand);
+
+// For coalescing a batch: if the command sets a setting a later one
+// replaces (volume, tempo, mode) to a valid value, or asks for it,
+// returns the command's id, with *pIsSet telling which; otherwise
+// COMMAND_UNKNOWN.
+Command_id_t Command_getSetting(const Command_t *pCommand, _Bool *pIsSet);
+
+// Write `value` in decimal, NUL-terminated, to `buffer` (12 bytes will
+// do); returns the length.
+int Command_formatInt(int value, char *buffer);
+
+#endif
@@ -0,0 +1,42 @@
+// Instrument registry: every sample in the sample directory, loaded once at
+// startup and looked up by a small integer ID.
+//
+// IDs are stable: the standard kit always has the IDs below (so "play 0" is
+// always the bass drum), and the remaining .wav files follow in file-name
+// order. Lookups by ID are a plain array index, safe from the audio thread.
+#ifndef INSTRUMENTS_H
+#define INSTRUMENTS_H
+
+#include "audioMixer.h"
+
+#define INSTRUMENTS_MAX 64
+
+// The standard kit
+typedef enum {
+    INSTRUMENT_BASS_DRUM,
+    INSTRUMENT_HI_HAT,
+    INSTRUMENT_SNARE,
+    INSTRUMENT_TOM,
+    INSTRUMENT_SPLASH,
+    INSTRUMENT_NUM_KIT,
+} instrumentKit_t;
+
+// Scan `directory` and load all its samples (in parallel); must be called
+// after AudioMixer_init(). Exits if a kit sample is missing.
+void Instruments_init(const char *directory);
+// Stops any voice still playing a sample, then frees them all.
+void Instruments_cleanup(void);
+
+int Instruments_getCount(void);
+
+// The sample for `id`, or NULL if there is no such instrument.
+wavedata_t *Instruments_get(int id);
+
+// Short name: the kit's "bass", "hihat", "snare", "tom", "splash", or the
+// file name without ".wav" and any "<id>__<author>__" sound-library prefix.
+const char *Instruments_getName(int id);
+
+// ID for a short name (as above) or a decimal ID, or -1 if unknown.
+int Instruments_find(const char *name);
+
+#endif
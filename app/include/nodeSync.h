@@ -0,0 +1,57 @@
+// Synchronized playback across several BeatBoxes (an installation driven
+// from one UI), over UDP multicast.
+//
+// One node leads, and its CLOCK_MONOTONIC is the common timebase. Each
+// follower estimates the leader's clock NTP-style. It timestamps
+// request/reply exchanges and keeps the ones with the least round-trip
+// delay. It then fits the leader's offset and skew (clock rate difference)
+// to them.
+//
+// Starts are scheduled. The leader multicasts "start this pattern at leader
+// time T" a little ahead. Each node converts T to its own clock and starts
+// the pattern on the audio frame heard then (BeatBox_startPatternAt()). It
+// plays at the leader's tempo, corrected for the skew, so bar lines stay
+// together.
+//
+// Alignment error is how far a node's bar starts land from the schedule, in
+// the leader's time. Every node measures its own at each bar. Followers
+// multicast theirs, so the leader can report the spread across nodes.
+#ifndef NODE_SYNC_H
+#define NODE_SYNC_H
+
+typedef enum {
+    NODESYNC_OFF,
+    NODESYNC_LEADER,
+    NODESYNC_FOLLOWER,
+} NodeSync_role_t;
+
+typedef struct {
+    int numExchanges;       // Follower: clock exchanges completed
+    double offsetMs;        // Follower: leader's clock minus ours, now
+    double skewPpm;         // Follower: how much faster the leader's clock runs
+    double delayMs;         // Follower: least round trip of the exchanges in use
+    int numNodes;           // Leader: nodes that reported bars (itself included)
+    int numBars;            // Bar starts measured (leader: on every node)
+    double lastAlignMs;     // This node's last bar start, after the schedule
+    double maxAbsAlignMs;   // Worst bar start (leader: on any node)
+    double spreadMs;        // Leader: between the nodes' latest bar starts
+} NodeSync_stats_t;
+
+// Join multicast `group` on `port`, through the interface with address
+// `interfaceAddress` ("0.0.0.0": the default one; "127.0.0.1": loopback,
+// for nodes on one machine). Starts off. Call after BeatBox_init();
+// cleanup before BeatBox_cleanup().
+void NodeSync_init(const char *group, const char *interfaceAddress, int port);
+void NodeSync_cleanup(void);
+
+void NodeSync_setRole(NodeSync_role_t role);
+NodeSync_role_t NodeSync_getRole(void);
+
+// Leader: start pattern `mode` on every node, this one included, shortly
+// from now, at this node's tempo. Returns false if not leading.
+_Bool NodeSync_startPattern(int mode);
+
+// Estimates now, and the counts and alignment since the last call.
+void NodeSync_getStatsAndClear(NodeSync_stats_t *pStats);
+
+#endif
@@ -0,0 +1,14 @@
+// Hot reload of the beat pattern file. The file is loaded at init and again
+// whenever it is rewritten or replaced (inotify on its directory, so editors
+// that save via rename are seen too). Each version that parses cleanly is
+// installed with BeatBox_setPatternSet(); bad edits are reported and the
+// current patterns keep playing. Parsing runs on the watcher's own thread,
+// never on the audio path.
+#ifndef PATTERN_WATCHER_H
+#define PATTERN_WATCHER_H
+
+// Call after BeatBox_init(); cleanup before BeatBox_cleanup().
+void PatternWatcher_init(const char *fileName);
+void PatternWatcher_cleanup(void);
+
+#endif
@@ -0,0 +1,32 @@
+// Real-time audit: catch allocation, stdio, locking and sleeping inside the
+// audio thread's real-time section.
+//
+// Only active in debug builds configured with -DBEATBOX_RT_AUDIT=ON. Those
+// builds link with --wrap for malloc/free, the pthread mutex and condition
+// calls, nanosleep/usleep and stdio so every such call made by our code
+// passes through a check. Calls made between
+// RtAudit_enter() and RtAudit_exit() on the same thread are counted as
+// violations and their backtraces kept for RtAudit_report().
+// In normal builds enter/exit compile to nothing and report() returns 0.
+#ifndef RT_AUDIT_H
+#define RT_AUDIT_H
+
+#include <stdbool.h>
+
+#ifdef BEATBOX_RT_AUDIT
+void RtAudit_setRtSection(bool inRtSection);
+#define RtAudit_enter() RtAudit_setRtSection(true)
+#define RtAudit_exit()  RtAudit_setRtSection(false)
+#else
+#define RtAudit_enter() ((void)0)
+#define RtAudit_exit()  ((void)0)
+#endif
+
+// Number of violations seen so far (always 0 when auditing is off).
+long RtAudit_getViolationCount(void);
+
+// Print every recorded violation with its backtrace to stderr.
+// Returns the violation count, so callers can fail on a non-zero result.
+long RtAudit_report(void);
+
+#endif
@@ -0,0 +1,22 @@
+// Tap tempo. While enabled, taps (the joystick button or air-drum hits) set
+// the tempo: the estimate is the median of the last few tap intervals, so
+// one early or late tap barely moves it. An interval far from
+// that median is rejected as a stray tap; several in a row mean the player
+// has changed tempo, and the history restarts from them. A pause longer
+// than a beat at the slowest tempo starts a fresh run of taps.
+//
+// Each estimate is applied with BeatBox_setBPMAtNextBar(), so the beat
+// changes tempo on its next bar line. Every tap takes constant time: the
+// history is a fixed-size window.
+#ifndef TAP_TEMPO_H
+#define TAP_TEMPO_H
+
+void TapTempo_setEnabled(_Bool enabled);
+_Bool TapTempo_isEnabled(void);
+
+// Register a tap now. Returns the tempo it set (in BPM), or 0 if it set
+// none: tap tempo is off, there are too few taps yet, or the tap was
+// rejected.
+int TapTempo_tap(void);
+
+#endif
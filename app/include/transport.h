@@ -0,0 +1,35 @@
+// Transport state: the tempo, mode, volume and song position the UI
+// threads (rotary encoder, UDP, LCD, status loop) poll, published as one
+// packed 64-bit atomic word. A read is a single atomic load, so readers
+// never block or take a lock, and always see the fields of one moment.
+// Writers update their fields with a compare-and-swap, which is lock-free,
+// so the sequencer can publish from the audio thread too.
+//
+// Every update that changes a field bumps the generation, so a consumer can
+// tell that anything changed by comparing just that
+// (Transport_getGeneration()).
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+typedef struct {
+    int bpm;
+    int mode;           // As getMode(): the song bar's pattern while a song plays
+    int volume;
+    int songPosition;   // As BeatBox_getSongPosition(): -1 if no song is playing
+    unsigned generation;
+} Transport_state_t;
+
+void Transport_get(Transport_state_t *pState);
+unsigned Transport_getGeneration(void);
+
+// Writers. The beatbox publishes the beat fields (its own state, which it
+// re-reads until the update goes in), the audio mixer the volume.
+void Transport_setVolume(int volume);
+
+// Publish the beat fields, and the volume unless it is -1, as one update,
+// if nothing has been published since `generation` was read; false
+// (nothing written) if something has. Setting the same values does not
+// bump the generation.
+_Bool Transport_setBeat(unsigned generation, int bpm, int mode, int songPosition, int volume);
+
+#endif
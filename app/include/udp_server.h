@@ -2,8 +2,30 @@
 #define UDP_SERVER_H
 
 extern volatile int keepRunning;
-// Function to start the UDP server (runs in a separate thread)
-void* udp_server_main(void* arg);
+// Start the UDP server on its own thread, an epoll loop over the socket
+// and its stop and timer fds. It takes text commands (command.h) and
+// binary frames (binaryProtocol.h). The `stop` command clears keepRunning.
+void udp_server_init(void);
+// Stop the server thread (within one loop iteration), join it and close
+// the socket.
 void udp_server_cleanup(void);
 
-#endif // UDP_SERVER_H
\ No newline at end of file
+// Datagrams are received in batches (one recvmmsg() drains up to 16), and
+// each batch's replies go out together with one sendmmsg(). A `volume`,
+// `tempo` or `mode` set-command followed in its batch by another of the
+// same kind, from any sender, with only set-commands between, is skipped,
+// and its sender answered with the later one's reply.
+typedef struct {
+    int numBatches;
+    int numDatagrams;
+    int maxBatch;           // Datagrams in the largest batch
+    int numCoalesced;       // Set-commands skipped as superseded...
+    int numCoalescedAcross; // ...of them by another sender's set
+    int numFrames;          // Binary protocol frames (see binaryProtocol.h)
+    int numSendCalls;       // sendmmsg() calls for the replies
+} udp_server_stats_t;
+
+// Counts since the last call.
+void udp_server_getStatsAndClear(udp_server_stats_t *pStats);
+
+#endif // UDP_SERVER_H
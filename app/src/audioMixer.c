@@ -1,352 +1,994 @@
-// Incomplete implementation of an audio mixer. Search for "REVISIT" to find things
-// which are left as incomplete.
-// Note: Generates low latency audio on BeagleBone Black; higher latency found on host.
-#include "audioMixer.h"
-#include <alsa/asoundlib.h>
-#include <stdbool.h>
-#include <pthread.h>
-#include <limits.h>
-#include <alloca.h> // needed for mixer
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-#include <assert.h>
-#include <periodTimer.h>
-
-
-static snd_pcm_t *handle;
-
-#define DEFAULT_VOLUME 80
-#define SAMPLE_RATE 44100
-#define NUM_CHANNELS 1
-#define SAMPLE_SIZE (sizeof(short)) 			// bytes per sample
-// Sample size note: This works for mono files because each sample ("frame') is 1 value.
-// If using stereo files then a frame would be two samples.
-
-static unsigned long playbackBufferSize = 0;
-static short *playbackBuffer = NULL;
-
-
-// Currently active (waiting to be played) sound bites
-#define MAX_SOUND_BITES 100
-typedef struct {
-	// A pointer to a previously allocated sound bite (wavedata_t struct).
-	// Note that many different sound-bite slots could share the same pointer
-	// (overlapping cymbal crashes, for example)
-	wavedata_t *pSound;
-
-	// The offset into the pData of pSound. Indicates how much of the
-	// sound has already been played (and hence where to start playing next).
-	int location;
-} playbackSound_t;
-
-
-static playbackSound_t soundBites[MAX_SOUND_BITES];
-// Playback threading
-void* playbackThread(void* arg);
-static _Bool stopping = false;
-static pthread_t playbackThreadId;
-static pthread_mutex_t audioMutex = PTHREAD_MUTEX_INITIALIZER;
-static int volume = 0;
-
-void AudioMixer_init(void)
-{
-	AudioMixer_setVolume(DEFAULT_VOLUME);
-
-	// Initialize the currently active sound-bites being played
-	// REVISIT:- Implement this. Hint: set the pSound pointer to NULL for each
-	//     sound bite.
-    
-    pthread_mutex_lock(&audioMutex);
-    for (int i = 0; i < MAX_SOUND_BITES; i++) {
-        soundBites[i].pSound = NULL;
-        soundBites[i].location = 0;
-    }
-    pthread_mutex_unlock(&audioMutex);
-
-	// Open the PCM output
-	int err = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
-	if (err < 0) {
-		printf("Playback open error: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
-	}
-
-	// Configure parameters of PCM output
-	err = snd_pcm_set_params(handle,
-			SND_PCM_FORMAT_S16_LE,
-			SND_PCM_ACCESS_RW_INTERLEAVED,
-			NUM_CHANNELS,
-			SAMPLE_RATE,
-			1,			// Allow software resampling
-			50000);		// 0.05 seconds per buffer
-	if (err < 0) {
-		printf("Playback open error: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
-	}
-
-	// Allocate this software's playback buffer to be the same size as the
-	// the hardware's playback buffers for efficient data transfers.
-	// ..get info on the hardware buffers:
- 	unsigned long unusedBufferSize = 0;
-	snd_pcm_get_params(handle, &unusedBufferSize, &playbackBufferSize);
-	// ..allocate playback buffer:
-	playbackBuffer = malloc(playbackBufferSize * sizeof(*playbackBuffer));
-
-	// Launch playback thread:
-	pthread_create(&playbackThreadId, NULL, playbackThread, NULL);
-}
-
-
-// Client code must call AudioMixer_freeWaveFileData to free dynamically allocated data.
-void AudioMixer_readWaveFileIntoMemory(char *fileName, wavedata_t *pSound)
-{
-	assert(pSound);
-
-	// The PCM data in a wave file starts after the header:
-	const int PCM_DATA_OFFSET = 44;
-
-	// Open the wave file
-	FILE *file = fopen(fileName, "rb");
-	if (file == NULL) {
-		fprintf(stderr, "ERROR: Unable to open file %s.\n", fileName);
-		exit(EXIT_FAILURE);
-	}
-
-	// Get file size
-	fseek(file, 0, SEEK_END);
-	int sizeInBytes = ftell(file) - PCM_DATA_OFFSET;
-	pSound->numSamples = sizeInBytes / SAMPLE_SIZE;
-
-	// Search to the start of the data in the file
-	fseek(file, PCM_DATA_OFFSET, SEEK_SET);
-
-	// Allocate space to hold all PCM data
-	pSound->pData = malloc(sizeInBytes);
-	if (pSound->pData == 0) {
-		fprintf(stderr, "ERROR: Unable to allocate %d bytes for file %s.\n",
-				sizeInBytes, fileName);
-		exit(EXIT_FAILURE);
-	}
-
-	// Read PCM data from wave file into memory
-	int samplesRead = fread(pSound->pData, SAMPLE_SIZE, pSound->numSamples, file);
-	if (samplesRead != pSound->numSamples) {
-		fprintf(stderr, "ERROR: Unable to read %d samples from file %s (read %d).\n",
-				pSound->numSamples, fileName, samplesRead);
-		exit(EXIT_FAILURE);
-	}
-}
-
-void AudioMixer_freeWaveFileData(wavedata_t *pSound)
-{
-	pSound->numSamples = 0;
-	free(pSound->pData);
-	pSound->pData = NULL;
-}
-
-void AudioMixer_queueSound(wavedata_t *pSound)
-{
-	// Ensure we are only being asked to play "good" sounds:
-	assert(pSound->numSamples > 0);
-	assert(pSound->pData);
-
-	// Insert the sound by searching for an empty sound bite spot
-	/*
-	 * REVISIT: Implement this:
-	 * 1. Since this may be called by other threads, and there is a thread
-	 *    processing the soundBites[] array, we must ensure access is threadsafe.
-	 * 2. Search through the soundBites[] array looking for a free slot.
-	 * 3. If a free slot is found, place the new sound file into that slot.
-	 *    Note: You are only copying a pointer, not the entire data of the wave file!
-	 * 4. After searching through all slots, if no free slot is found then print
-	 *    an error message to the console (and likely just return vs asserting/exiting
-	 *    because the application most likely doesn't want to crash just for
-	 *    not being able to play another wave file.
-	 */
-
-	pthread_mutex_lock(&audioMutex);
-	
-	int foundSlot = 0;
-	// Insert the sound by searching for an empty sound bite slot
-	for (int i = 0; i < MAX_SOUND_BITES; i++) {
-		if (soundBites[i].pSound == NULL) {
-			soundBites[i].pSound = pSound;
-			soundBites[i].location = 0;
-			foundSlot = 1;
-			break;
-		}
-	}
-
-	if (!foundSlot) {
-	printf("Error: No available slots for new sound! Sound lost");
-    }
- 
-	pthread_mutex_unlock(&audioMutex);
-}
-
-void AudioMixer_cleanup(void)
-{
-	printf("Stopping audio...\n");
-
-	// Stop the PCM generation thread
-	stopping = true;
-	pthread_join(playbackThreadId, NULL);
-
-	// Shutdown the PCM output, allowing any pending sound to play out (drain)
-	snd_pcm_drain(handle);
-	snd_pcm_close(handle);
-
-	// Free playback buffer
-	// (note that any wave files read into wavedata_t records must be freed
-	//  in addition to this by calling AudioMixer_freeWaveFileData() on that struct.)
-	free(playbackBuffer);
-	playbackBuffer = NULL;
-
-	printf("Done stopping audio...\n");
-	fflush(stdout);
-}
-
-
-int AudioMixer_getVolume()
-{
-	// Return the cached volume; good enough unless someone is changing
-	// the volume through other means and the cached value is out of date.
-	return volume;
-}
-
-// Function copied from:
-// http://stackoverflow.com/questions/6787318/set-alsa-master-volume-from-c-code
-// Written by user "trenki".
-void AudioMixer_setVolume(int newVolume)
-{
-	// Ensure volume is reasonable; If so, cache it for later getVolume() calls.
-	if (newVolume < 0 || newVolume > AUDIOMIXER_MAX_VOLUME) {
-		printf("ERROR: Volume must be between 0 and 100.\n");
-		return;
-	}
-	volume = newVolume;
-
-    long min, max;
-    snd_mixer_t *mixerHandle;
-    snd_mixer_selem_id_t *sid;
-    const char *card = "default";
-    const char *selem_name = "PCM";	// For ZEN cape
-    //const char *selem_name = "Speaker";	// For USB Audio
-
-    snd_mixer_open(&mixerHandle, 0);
-    snd_mixer_attach(mixerHandle, card);
-    snd_mixer_selem_register(mixerHandle, NULL, NULL);
-    snd_mixer_load(mixerHandle);
-
-    snd_mixer_selem_id_alloca(&sid);
-    snd_mixer_selem_id_set_index(sid, 0);
-    snd_mixer_selem_id_set_name(sid, selem_name);
-    snd_mixer_elem_t* elem = snd_mixer_find_selem(mixerHandle, sid);
-
-    snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
-    snd_mixer_selem_set_playback_volume_all(elem, volume * max / 100);
-
-    snd_mixer_close(mixerHandle);
-}
-
-
-// Fill the buff array with new PCM values to output.
-//    buff: buffer to fill with new PCM data from sound bites.
-//    size: the number of *values* to store into buff
-static void fillPlaybackBuffer(short *buff, int size)
-{
-	/*
-	 * REVISIT: Implement this
-	 * 1. Wipe the buff to all 0's to clear any previous PCM data.
-	 *    Hint: use memset(); read the docs about its use of size.
-	 * 2. Since this is called from a background thread, and soundBites[] array
-	 *    may be used by any other thread, must synchronize this.
-	 * 3. Loop through each slot in soundBites[], which are sounds that are either
-	 *    waiting to be played, or partially already played:
-	 *    - If the sound bite slot is unused, do nothing for this slot.
-	 *    - Otherwise "add" this sound bite's data to the play-back buffer
-	 *      (other sound bites needing to be played back will also add to the same data).
-	 *      * Record that this portion of the sound bite has been played back by incrementing
-	 *        the location inside the data where play-back currently is.
-	 *      * If you have now played back the entire sample, free the slot in the
-	 *        soundBites[] array.
-	 *
-	 * Notes on "adding" PCM samples:
-	 * - PCM is stored as signed shorts (between SHRT_MIN and SHRT_MAX).
-	 * - When adding values, ensure there is not an overflow. Any values which would
-	 *   greater than SHRT_MAX should be clipped to SHRT_MAX; likewise for underflow.
-	 * - Don't overflow any arrays!
-	 * - Efficiency matters here! The compiler may do quite a bit for you, but it doesn't
-	 *   hurt to keep it in mind. Here are some tips for efficiency and readability:
-	 *   * If, for each pass of the loop which "adds" you need to change a value inside
-	 *     a struct inside an array, it may be faster to first load the value into a local
-	 *      variable, increment this variable as needed throughout the loop, and then write it
-	 *     back into the struct inside the array after. For example:
-	 *           int offset = myArray[someIdx].value;
-	 *           for (int i =...; i < ...; i++) {
-	 *               offset ++;
-	 *           }
-	 *           myArray[someIdx].value = offset;
-	 *   * If you need a value in a number of places, try loading it into a local variable
-	 *          int someNum = myArray[someIdx].value;
-	 *          if (someNum < X || someNum > Y || someNum != Z) {
-	 *              someNum = 42;
-	 *          }
-	 *          ... use someNum vs myArray[someIdx].value;
-	 *
-	 */
-
-	memset(buff, 0, size * sizeof(short));
-    
-	pthread_mutex_lock(&audioMutex);
-	for (int i = 0; i < MAX_SOUND_BITES; i++) {
-		if (soundBites[i].pSound != NULL) {
-			for (int j = 0; j < size; j++) {
-				if (soundBites[i].location < soundBites[i].pSound->numSamples) {
-					int mixedValue = buff[j] + soundBites[i].pSound->pData[soundBites[i].location];
-					if (mixedValue > SHRT_MAX) mixedValue = SHRT_MAX;
-					if (mixedValue < SHRT_MIN) mixedValue = SHRT_MIN;
-					buff[j] = (short)mixedValue;
-					soundBites[i].location++;
-				}else {
-					soundBites[i].pSound = NULL;
-					break;
-				}
-			}
-		}
-	}
-	pthread_mutex_unlock(&audioMutex);
-}
-
-
-void* playbackThread(void* _arg)
-{
-	(void)_arg;
-	while (!stopping) {
-
-		Period_markEvent(PERIOD_EVENT_AUDIO_BUFFER_FILL);
-		// Generate next block of audio
-		fillPlaybackBuffer(playbackBuffer, playbackBufferSize);
-
-		// Output the audio
-		snd_pcm_sframes_t frames = snd_pcm_writei(handle,
-				playbackBuffer, playbackBufferSize);
-
-		// Check for (and handle) possible error conditions on output
-		if (frames < 0) {
-			fprintf(stderr, "AudioMixer: writei() returned %li\n", frames);
-			frames = snd_pcm_recover(handle, frames, 1);
-		}
-		if (frames < 0) {
-			fprintf(stderr, "ERROR: Failed writing audio with snd_pcm_writei(): %li\n",
-					frames);
-			exit(EXIT_FAILURE);
-		}
-		if (frames > 0 && frames < (snd_pcm_sframes_t)playbackBufferSize) {     //fixed here
-			printf("Short write (expected %li, wrote %li)\n",
-					playbackBufferSize, frames);
-		}
-	}
-
-	return NULL;
+// Incomplete implementation of an audio mixer. Search for "REVISIT" to find things
+// which are left as incomplete.
+// Note: Generates low latency audio on BeagleBone Black; higher latency found on host.
+#include "audioMixer.h"
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <limits.h>
+#include <alloca.h> // needed for mixer
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <periodTimer.h>
+#include "rtAudit.h"
+#include "transport.h"
+
+
+static snd_pcm_t *handle;
+static AudioMixer_output_t outputType = AUDIOMIXER_OUTPUT_ALSA;
+
+#define DEFAULT_VOLUME 80
+#define PREFERRED_SAMPLE_RATE 44100		// What the wave files were recorded at
+#define PREFERRED_NUM_CHANNELS 1
+#define BUFFER_TIME_US 50000			// 0.05 seconds per buffer
+#define SAMPLE_SIZE (sizeof(short)) 			// bytes per sample (in wave files and to ALSA)
+// Sample size note: Voices and the mix bus are mono, so a bus frame is 1 value.
+// The output conversion copies it to each of the negotiated output channels.
+
+// Negotiated with the card in AudioMixer_init(); fixed after that.
+static unsigned int sampleRate = PREFERRED_SAMPLE_RATE;
+static unsigned int numChannels = PREFERRED_NUM_CHANNELS;
+
+static unsigned long playbackBufferSize = 0;	// Frames per period
+static short *playbackBuffer = NULL;	// S16 output (interleaved) handed to ALSA
+static sample_t *mixBus = NULL;		// Internal mono mix; aliases playbackBuffer for int16 mono
+
+
+// Sample-format specific arithmetic. Everything up to the output conversion
+// works on sample_t, so the voice/bus code is shared by both formats.
+#ifdef AUDIOMIXER_FLOAT_SAMPLES
+static inline sample_t mixSample(sample_t a, sample_t b)
+{
+	return a + b;	// Headroom is free in float; clip once at the output
+}
+
+static inline sample_t sampleFromS16(short s)
+{
+	return s * (1.0f / 32768.0f);
+}
+
+typedef float gain_t;			// 0.0 .. 1.0
+#define UNITY_GAIN 1.0f
+
+static inline sample_t applyGain(sample_t s, gain_t gain)
+{
+	return s * gain;
+}
+
+static inline short sampleToS16(sample_t s)
+{
+	float value = s * 32768.0f;
+	if (value > SHRT_MAX) value = SHRT_MAX;
+	if (value < SHRT_MIN) value = SHRT_MIN;
+	return (short)value;
+}
+#else
+static inline sample_t mixSample(sample_t a, sample_t b)
+{
+	int mixedValue = a + b;
+	if (mixedValue > SHRT_MAX) mixedValue = SHRT_MAX;
+	if (mixedValue < SHRT_MIN) mixedValue = SHRT_MIN;
+	return (sample_t)mixedValue;
+}
+
+static inline sample_t sampleFromS16(short s)
+{
+	return s;
+}
+
+typedef int gain_t;			// Q15: 0 .. 32768
+#define UNITY_GAIN 32768
+
+static inline sample_t applyGain(sample_t s, gain_t gain)
+{
+	return (sample_t)((s * gain) >> 15);
+}
+
+static inline short sampleToS16(sample_t s)
+{
+	return s;
+}
+#endif
+
+// Convert `frames` mono bus frames to interleaved S16 output frames.
+static void convertToOutput(short *out, const sample_t *bus, int frames)
+{
+	if ((const void *)out == (const void *)bus) {
+		// int16 mono: the bus already is the output buffer
+		return;
+	}
+	if (numChannels == 1) {
+		for (int i = 0; i < frames; i++) {
+			out[i] = sampleToS16(bus[i]);
+		}
+		return;
+	}
+	for (int i = 0; i < frames; i++) {
+		short value = sampleToS16(bus[i]);
+		for (unsigned int ch = 0; ch < numChannels; ch++) {
+			*out++ = value;
+		}
+	}
+}
+
+
+// Voice envelopes: a short attack when a sound starts and a release when it is
+// stopped or stolen, so neither end clicks. Gains come from precomputed ramp
+// tables, and only voices inside a ramp take the multiply path.
+// Ramp lengths are in frames at the negotiated rate (set in AudioMixer_init()).
+#define ATTACK_MS 1
+#define RELEASE_MS 5
+static int attackFrames = 0;
+static int releaseFrames = 0;
+static gain_t *attackRamp = NULL;
+static gain_t *releaseRamp = NULL;
+
+// Currently active (waiting to be played) sound bites.
+// MAX_SOUND_BITES may play at once; the extra slots let voices that were
+// stolen to make room finish their release.
+#define MAX_SOUND_BITES 100
+#define MAX_RELEASING_BITES 8
+#define NUM_SOUND_BITE_SLOTS (MAX_SOUND_BITES + MAX_RELEASING_BITES)
+typedef struct {
+	// A pointer to a previously allocated sound bite (wavedata_t struct).
+	// Note that many different sound-bite slots could share the same pointer
+	// (overlapping cymbal crashes, for example)
+	wavedata_t *pSound;
+
+	// The offset into the pData of pSound. Indicates how much of the
+	// sound has already been played (and hence where to start playing next).
+	int location;
+
+	// Position within the attack ramp (attackFrames once past it), and
+	// within the release ramp (-1 while not releasing).
+	int attackPos;
+	int releasePos;
+
+	// Frames of the current buffer to skip before the voice starts; lets the
+	// sequencer start sounds at an exact frame inside a buffer.
+	int startDelay;
+
+	// Velocity as a gain; voices at full velocity skip the multiply.
+	gain_t gain;
+} playbackSound_t;
+
+
+// Owned by the playback thread; other threads only reach it through the
+// command queue below.
+static playbackSound_t soundBites[NUM_SOUND_BITE_SLOTS];
+
+// Commands from other threads to the playback thread. A single-consumer
+// ring: producers serialize on audioMutex, while the playback thread drains
+// it without taking any lock so the real-time path never blocks.
+#define COMMAND_QUEUE_SIZE 256		// Must be a power of two
+typedef enum {
+	MIXER_CMD_PLAY,
+	MIXER_CMD_PLAY_NO_ATTACK,
+	MIXER_CMD_STOP,
+} mixerCommandType_t;
+
+typedef struct {
+	mixerCommandType_t type;
+	wavedata_t *pSound;
+	int velocity;
+	int delay;		// Frames into the next buffer to start at
+} mixerCommand_t;
+
+static mixerCommand_t commands[COMMAND_QUEUE_SIZE];
+static atomic_uint commandHead = 0;	// Next slot to write (producers)
+static atomic_uint commandTail = 0;	// Next slot to read (playback thread)
+static atomic_ulong buffersFilled = 0;	// Lets stoppers wait out a release
+
+// Audio clock: frames handed to the card so far, and the optional sequencer
+// run at the start of every buffer.
+static atomic_ullong framePosition = 0;
+static _Atomic(AudioMixer_sequencer_t) sequencer = NULL;
+static _Atomic(AudioMixer_voiceObserver_t) voiceObserver = NULL;
+
+// Counted on the playback thread instead of printed; reported at cleanup.
+static atomic_long droppedSounds = 0;
+static atomic_long stolenVoices = 0;
+static atomic_long shortWrites = 0;
+
+// Playback threading
+void* playbackThread(void* arg);
+static _Bool stopping = false;
+static atomic_bool playbackRunning = false;
+static pthread_t playbackThreadId;
+static pthread_mutex_t audioMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Linear gain for a velocity of 0..AUDIOMIXER_MAX_VELOCITY.
+static gain_t velocityGain(int velocity)
+{
+	if (velocity >= AUDIOMIXER_MAX_VELOCITY) {
+		return UNITY_GAIN;
+	}
+	if (velocity <= 0) {
+		return 0;
+	}
+	return (gain_t)(velocity * UNITY_GAIN / AUDIOMIXER_MAX_VELOCITY);
+}
+
+// Gain at step `pos` of an n-step smoothstep ramp from 0 to UNITY_GAIN.
+static gain_t smoothGain(int pos, int n)
+{
+	double t = (double)pos / n;
+	return (gain_t)(UNITY_GAIN * t * t * (3 - 2 * t));
+}
+
+static void checkPcm(int err, const char *what)
+{
+	if (err < 0) {
+		printf("Playback open error (%s): %s\n", what, snd_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Negotiate the output format with the card and record the result in
+// sampleRate, numChannels and playbackBufferSize.
+static void configurePcm(void)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	checkPcm(snd_pcm_hw_params_any(handle, params), "hw params");
+
+	checkPcm(snd_pcm_hw_params_set_rate_resample(handle, params, 0), "resample");
+	checkPcm(snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED), "access");
+	checkPcm(snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE), "format");
+
+	unsigned int channels = PREFERRED_NUM_CHANNELS;
+	checkPcm(snd_pcm_hw_params_set_channels_near(handle, params, &channels), "channels");
+	unsigned int rate = PREFERRED_SAMPLE_RATE;
+	checkPcm(snd_pcm_hw_params_set_rate_near(handle, params, &rate, NULL), "rate");
+
+	// Same buffering snd_pcm_set_params() used: 50ms buffer in 4 periods
+	unsigned int bufferTime = BUFFER_TIME_US;
+	unsigned int periodTime = BUFFER_TIME_US / 4;
+	checkPcm(snd_pcm_hw_params_set_buffer_time_near(handle, params, &bufferTime, NULL), "buffer time");
+	checkPcm(snd_pcm_hw_params_set_period_time_near(handle, params, &periodTime, NULL), "period time");
+	checkPcm(snd_pcm_hw_params(handle, params), "apply");
+
+	snd_pcm_uframes_t periodFrames = 0;
+	checkPcm(snd_pcm_hw_params_get_rate(params, &sampleRate, NULL), "get rate");
+	checkPcm(snd_pcm_hw_params_get_channels(params, &numChannels), "get channels");
+	checkPcm(snd_pcm_hw_params_get_period_size(params, &periodFrames, NULL), "get period");
+	playbackBufferSize = periodFrames;
+}
+
+// Null output: the preferred format, with the period ALSA would pick.
+static void configureNullOutput(void)
+{
+	sampleRate = PREFERRED_SAMPLE_RATE;
+	numChannels = PREFERRED_NUM_CHANNELS;
+	playbackBufferSize = (unsigned long long)sampleRate * (BUFFER_TIME_US / 4) / 1000000;
+}
+
+// Null output: "play" a period by waiting until the card would have taken
+// it, on an absolute deadline so the frame clock keeps real time.
+static void writeNullOutput(void)
+{
+	static struct timespec start;
+	static unsigned long long framesWritten = 0;
+	if (framesWritten == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	framesWritten += playbackBufferSize;
+
+	long long ns = start.tv_nsec + (long long)(framesWritten * 1000000000ULL / sampleRate);
+	struct timespec deadline = {
+		.tv_sec = start.tv_sec + ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0) {
+		// Interrupted by a signal: keep waiting
+	}
+}
+
+void AudioMixer_setOutput(AudioMixer_output_t output)
+{
+	outputType = output;
+}
+
+void AudioMixer_init(void)
+{
+	AudioMixer_setVolume(DEFAULT_VOLUME);
+
+	// Initialize the currently active sound-bites being played
+	// REVISIT:- Implement this. Hint: set the pSound pointer to NULL for each
+	//     sound bite.
+    
+    // (playback thread not started yet, so no need to go through the queue)
+    for (int i = 0; i < NUM_SOUND_BITE_SLOTS; i++) {
+        soundBites[i].pSound = NULL;
+        soundBites[i].location = 0;
+    }
+
+	if (outputType != AUDIOMIXER_OUTPUT_ALSA) {
+		configureNullOutput();
+	} else {
+		// Open the PCM output
+		int err = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0);
+		if (err < 0) {
+			printf("Playback open error: %s\n", snd_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+
+		// Configure parameters of PCM output. Rather than having ALSA resample,
+		// take the card's nearest native rate and channel count and run at that.
+		configurePcm();
+	}
+	static const char *const outputNames[] = {
+		[AUDIOMIXER_OUTPUT_ALSA] = "",
+		[AUDIOMIXER_OUTPUT_NULL] = "null output, ",
+		[AUDIOMIXER_OUTPUT_FREEWHEEL] = "freewheeling null output, ",
+	};
+	printf("Audio: %s%u Hz, %u channel(s), %lu frames per period\n",
+			outputNames[outputType],
+			sampleRate, numChannels, playbackBufferSize);
+
+	// Envelope ramps: smoothstep curves from silence to full (attack) and back
+	attackFrames = sampleRate * ATTACK_MS / 1000;
+	releaseFrames = sampleRate * RELEASE_MS / 1000;
+	attackRamp = malloc(attackFrames * sizeof(*attackRamp));
+	releaseRamp = malloc(releaseFrames * sizeof(*releaseRamp));
+	for (int i = 0; i < attackFrames; i++) {
+		attackRamp[i] = smoothGain(i, attackFrames);
+	}
+	for (int i = 0; i < releaseFrames; i++) {
+		releaseRamp[i] = smoothGain(releaseFrames - 1 - i, releaseFrames);
+	}
+
+	// Allocate this software's playback buffer to be the same size as the
+	// the hardware's playback buffers for efficient data transfers.
+	playbackBuffer = malloc(playbackBufferSize * numChannels * sizeof(*playbackBuffer));
+#ifdef AUDIOMIXER_FLOAT_SAMPLES
+	mixBus = malloc(playbackBufferSize * sizeof(*mixBus));
+#else
+	if (numChannels == 1) {
+		mixBus = playbackBuffer;
+	} else {
+		mixBus = malloc(playbackBufferSize * sizeof(*mixBus));
+	}
+#endif
+
+	// Launch playback thread:
+	atomic_store(&playbackRunning, true);
+	pthread_create(&playbackThreadId, NULL, playbackThread, NULL);
+}
+
+
+// Fill pSound from S16 data recorded at srcRate, converting to sample_t and,
+// if srcRate differs from the output rate, resampling by linear interpolation.
+static void loadSamples(const short *src, int srcSamples, unsigned int srcRate, wavedata_t *pSound)
+{
+	if (srcRate == 0) {
+		srcRate = sampleRate;
+	}
+	int numSamples = (int)((long long)srcSamples * sampleRate / srcRate);
+
+	pSound->numSamples = numSamples;
+	pSound->pData = malloc(numSamples * sizeof(sample_t));
+	if (pSound->pData == 0) {
+		fprintf(stderr, "ERROR: Unable to allocate %d samples.\n", numSamples);
+		exit(EXIT_FAILURE);
+	}
+
+	if (srcRate == sampleRate) {
+		for (int i = 0; i < numSamples; i++) {
+			pSound->pData[i] = sampleFromS16(src[i]);
+		}
+		return;
+	}
+
+	double step = (double)srcRate / sampleRate;
+	for (int i = 0; i < numSamples; i++) {
+		double pos = i * step;
+		int index = (int)pos;
+		double frac = pos - index;
+		short next = (index + 1 < srcSamples) ? src[index + 1] : src[index];
+		pSound->pData[i] = sampleFromS16((short)(src[index] + (next - src[index]) * frac));
+	}
+}
+
+// Client code must call AudioMixer_freeWaveFileData to free dynamically allocated data.
+void AudioMixer_readWaveFileIntoMemory(char *fileName, wavedata_t *pSound)
+{
+	assert(pSound);
+
+	// The PCM data in a wave file starts after the header:
+	const int PCM_DATA_OFFSET = 44;
+	const int SAMPLE_RATE_OFFSET = 24;
+
+	// Open the wave file
+	FILE *file = fopen(fileName, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: Unable to open file %s.\n", fileName);
+		exit(EXIT_FAILURE);
+	}
+
+	// Read the header for the file's sample rate (little-endian u32)
+	unsigned char header[PCM_DATA_OFFSET];
+	if (fread(header, 1, PCM_DATA_OFFSET, file) != (size_t)PCM_DATA_OFFSET) {
+		fprintf(stderr, "ERROR: Unable to read header of file %s.\n", fileName);
+		exit(EXIT_FAILURE);
+	}
+	unsigned int fileRate = header[SAMPLE_RATE_OFFSET]
+			| header[SAMPLE_RATE_OFFSET + 1] << 8
+			| header[SAMPLE_RATE_OFFSET + 2] << 16
+			| (unsigned int)header[SAMPLE_RATE_OFFSET + 3] << 24;
+
+	// Get file size
+	fseek(file, 0, SEEK_END);
+	int sizeInBytes = ftell(file) - PCM_DATA_OFFSET;
+	int fileSamples = sizeInBytes / SAMPLE_SIZE;
+
+	// Search to the start of the data in the file
+	fseek(file, PCM_DATA_OFFSET, SEEK_SET);
+
+	// Read PCM data from wave file into a temporary S16 buffer
+	short *fileData = malloc(sizeInBytes);
+	if (fileData == 0) {
+		fprintf(stderr, "ERROR: Unable to allocate %d bytes for file %s.\n",
+				sizeInBytes, fileName);
+		exit(EXIT_FAILURE);
+	}
+	int samplesRead = fread(fileData, SAMPLE_SIZE, fileSamples, file);
+	if (samplesRead != fileSamples) {
+		fprintf(stderr, "ERROR: Unable to read %d samples from file %s (read %d).\n",
+				fileSamples, fileName, samplesRead);
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+
+	// Convert to the internal format at the output rate, so playback never resamples
+	loadSamples(fileData, fileSamples, fileRate, pSound);
+	free(fileData);
+}
+
+void AudioMixer_freeWaveFileData(wavedata_t *pSound)
+{
+	pSound->numSamples = 0;
+	free(pSound->pData);
+	pSound->pData = NULL;
+}
+
+void AudioMixer_allocWaveData(wavedata_t *pSound, int numSamples)
+{
+	assert(pSound);
+	assert(numSamples > 0);
+
+	pSound->numSamples = numSamples;
+	pSound->pData = calloc(numSamples, sizeof(sample_t));
+	if (pSound->pData == NULL) {
+		fprintf(stderr, "ERROR: Unable to allocate %d samples.\n", numSamples);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void AudioMixer_mixInto(wavedata_t *pDest, wavedata_t *pSound, int offset, int velocity)
+{
+	assert(pDest->numSamples > 0 && pDest->pData);
+	assert(pSound->numSamples > 0 && pSound->pData);
+	assert(offset >= 0);
+
+	sample_t *dest = pDest->pData + offset;
+	const sample_t *src = pSound->pData;
+	int numSamples = pSound->numSamples;
+	if (numSamples > pDest->numSamples - offset) {
+		numSamples = pDest->numSamples - offset;
+	}
+	gain_t gain = velocityGain(velocity);
+
+	for (int i = 0; i < numSamples; i++) {
+		// Same attack ramp and velocity gain a live voice gets
+		sample_t value = (i < attackFrames) ? applyGain(src[i], attackRamp[i]) : src[i];
+		if (gain != UNITY_GAIN) {
+			value = applyGain(value, gain);
+		}
+		dest[i] = mixSample(dest[i], value);
+	}
+}
+
+// Block until the playback thread has started `count` more buffers.
+static void waitForBuffers(unsigned long count)
+{
+	struct timespec retryDelay = {0, 1000000};	// 1ms
+	unsigned long target = atomic_load(&buffersFilled) + count;
+	while (atomic_load(&playbackRunning)
+			&& (long)(atomic_load(&buffersFilled) - target) < 0) {
+		nanosleep(&retryDelay, NULL);
+	}
+}
+
+// Post a command to the playback thread. Returns false if the queue is full.
+// On success, *pTicket (if given) receives the command's queue position.
+static _Bool postCommand(const mixerCommand_t *pCommand, unsigned *pTicket)
+{
+	_Bool posted = false;
+
+	pthread_mutex_lock(&audioMutex);
+	unsigned head = atomic_load_explicit(&commandHead, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&commandTail, memory_order_acquire);
+	if (head - tail < COMMAND_QUEUE_SIZE) {
+		commands[head % COMMAND_QUEUE_SIZE] = *pCommand;
+		atomic_store_explicit(&commandHead, head + 1, memory_order_release);
+		if (pTicket) {
+			*pTicket = head;
+		}
+		posted = true;
+	}
+	pthread_mutex_unlock(&audioMutex);
+
+	return posted;
+}
+
+static void queueSound(mixerCommandType_t type, wavedata_t *pSound, int velocity, int delay)
+{
+	// Ensure we are only being asked to play "good" sounds:
+	assert(pSound->numSamples > 0);
+	assert(pSound->pData);
+
+	// The playback thread places the sound into a free sound-bite slot the
+	// next time it fills a buffer (see applyCommands()).
+	mixerCommand_t command = {
+		.type = type,
+		.pSound = pSound,
+		.velocity = velocity,
+		.delay = delay,
+	};
+	if (!postCommand(&command, NULL)) {
+		printf("Error: Mixer command queue full! Sound lost\n");
+	}
+}
+
+void AudioMixer_queueSound(wavedata_t *pSound)
+{
+	queueSound(MIXER_CMD_PLAY, pSound, AUDIOMIXER_MAX_VELOCITY, 0);
+}
+
+void AudioMixer_queueSoundDelayed(wavedata_t *pSound, int delayFrames, int velocity)
+{
+	assert(delayFrames >= 0);
+	queueSound(MIXER_CMD_PLAY, pSound, velocity, delayFrames);
+}
+
+void AudioMixer_queueSoundNoAttack(wavedata_t *pSound)
+{
+	queueSound(MIXER_CMD_PLAY_NO_ATTACK, pSound, AUDIOMIXER_MAX_VELOCITY, 0);
+}
+
+void AudioMixer_dequeueSound(wavedata_t *pSound)
+{
+	struct timespec retryDelay = {0, 1000000};	// 1ms
+	mixerCommand_t command = { .type = MIXER_CMD_STOP, .pSound = pSound };
+	unsigned ticket;
+
+	while (!postCommand(&command, &ticket)) {
+		nanosleep(&retryDelay, NULL);
+	}
+
+	// Wait for the playback thread to act on it (at most about one buffer)...
+	while (atomic_load(&playbackRunning)
+			&& (int)(atomic_load(&commandTail) - ticket) <= 0) {
+		nanosleep(&retryDelay, NULL);
+	}
+
+	// ..then for the release ramp to play out, after which the slot is freed.
+	// (Voices still waiting out a start delay were dropped outright.)
+	waitForBuffers((releaseFrames + playbackBufferSize - 1) / playbackBufferSize);
+
+	// Thread not running: apply directly (nobody else touches the slots).
+	if (!atomic_load(&playbackRunning)) {
+		for (int i = 0; i < NUM_SOUND_BITE_SLOTS; i++) {
+			if (soundBites[i].pSound == pSound) {
+				soundBites[i].pSound = NULL;
+			}
+		}
+	}
+}
+
+void AudioMixer_cleanup(void)
+{
+	printf("Stopping audio...\n");
+
+	// Stop the PCM generation thread
+	stopping = true;
+	pthread_join(playbackThreadId, NULL);
+	atomic_store(&playbackRunning, false);
+
+	long dropped = atomic_load(&droppedSounds);
+	long stolen = atomic_load(&stolenVoices);
+	long shorts = atomic_load(&shortWrites);
+	if (dropped > 0 || stolen > 0 || shorts > 0) {
+		printf("Audio: %ld sound(s) dropped (no free slot), %ld voice(s) stolen, %ld short write(s)\n",
+				dropped, stolen, shorts);
+	}
+
+	// Shutdown the PCM output, allowing any pending sound to play out (drain)
+	if (outputType == AUDIOMIXER_OUTPUT_ALSA) {
+		snd_pcm_drain(handle);
+		snd_pcm_close(handle);
+	}
+
+	// Free playback buffer
+	// (note that any wave files read into wavedata_t records must be freed
+	//  in addition to this by calling AudioMixer_freeWaveFileData() on that struct.)
+	if ((void *)mixBus != (void *)playbackBuffer) {
+		free(mixBus);
+	}
+	mixBus = NULL;
+	free(playbackBuffer);
+	playbackBuffer = NULL;
+	free(attackRamp);
+	attackRamp = NULL;
+	free(releaseRamp);
+	releaseRamp = NULL;
+
+	printf("Done stopping audio...\n");
+	fflush(stdout);
+}
+
+
+void AudioMixer_setSequencer(AudioMixer_sequencer_t newSequencer)
+{
+	atomic_store(&sequencer, newSequencer);
+
+	// The old one may be mid-call; wait until a full buffer has gone by.
+	waitForBuffers(2);
+}
+
+void AudioMixer_setVoiceObserver(AudioMixer_voiceObserver_t observer)
+{
+	atomic_store(&voiceObserver, observer);
+	waitForBuffers(2);
+}
+
+unsigned long long AudioMixer_getFramePosition(void)
+{
+	return atomic_load(&framePosition);
+}
+
+unsigned int AudioMixer_getSampleRate(void)
+{
+	return sampleRate;
+}
+
+unsigned int AudioMixer_getNumChannels(void)
+{
+	return numChannels;
+}
+
+unsigned long AudioMixer_getPeriodFrames(void)
+{
+	return playbackBufferSize;
+}
+
+int AudioMixer_getVolume()
+{
+	// Return the published volume; good enough unless someone is changing
+	// the volume through other means and the published value is out of date.
+	Transport_state_t transport;
+	Transport_get(&transport);
+	return transport.volume;
+}
+
+// Function copied from:
+// http://stackoverflow.com/questions/6787318/set-alsa-master-volume-from-c-code
+// Written by user "trenki".
+void AudioMixer_setVolume(int newVolume)
+{
+	// Ensure volume is reasonable; If so, publish it for later getVolume() calls.
+	if (newVolume < 0 || newVolume > AUDIOMIXER_MAX_VOLUME) {
+		printf("ERROR: Volume must be between 0 and 100.\n");
+		return;
+	}
+	Transport_setVolume(newVolume);
+	if (outputType != AUDIOMIXER_OUTPUT_ALSA) {
+		return;
+	}
+
+    long min, max;
+    snd_mixer_t *mixerHandle;
+    snd_mixer_selem_id_t *sid;
+    const char *card = "default";
+    const char *selem_name = "PCM";	// For ZEN cape
+    //const char *selem_name = "Speaker";	// For USB Audio
+
+    snd_mixer_open(&mixerHandle, 0);
+    snd_mixer_attach(mixerHandle, card);
+    snd_mixer_selem_register(mixerHandle, NULL, NULL);
+    snd_mixer_load(mixerHandle);
+
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_index(sid, 0);
+    snd_mixer_selem_id_set_name(sid, selem_name);
+    snd_mixer_elem_t* elem = snd_mixer_find_selem(mixerHandle, sid);
+
+    snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
+    snd_mixer_selem_set_playback_volume_all(elem, newVolume * max / 100);
+
+    snd_mixer_close(mixerHandle);
+}
+
+
+static void startRelease(playbackSound_t *pVoice)
+{
+	if (pVoice->releasePos < 0) {
+		pVoice->releasePos = 0;
+	}
+}
+
+// Find a slot for a new voice. If MAX_SOUND_BITES are already sounding, the
+// oldest is stolen: it starts its release and the new voice takes a spare
+// slot. Returns NULL only if every slot is still busy releasing.
+static playbackSound_t *allocateVoice(void)
+{
+	playbackSound_t *pFree = NULL;
+	playbackSound_t *pOldest = NULL;
+	playbackSound_t *pMostReleased = NULL;
+	int numSounding = 0;
+
+	for (int i = 0; i < NUM_SOUND_BITE_SLOTS; i++) {
+		playbackSound_t *pVoice = &soundBites[i];
+		if (pVoice->pSound == NULL) {
+			if (pFree == NULL) {
+				pFree = pVoice;
+			}
+		} else if (pVoice->releasePos < 0) {
+			numSounding++;
+			if (pOldest == NULL || pVoice->location > pOldest->location) {
+				pOldest = pVoice;
+			}
+		} else if (pMostReleased == NULL || pVoice->releasePos > pMostReleased->releasePos) {
+			pMostReleased = pVoice;
+		}
+	}
+
+	if (numSounding >= MAX_SOUND_BITES) {
+		startRelease(pOldest);
+		atomic_fetch_add(&stolenVoices, 1);
+	}
+	if (pFree == NULL && pMostReleased != NULL) {
+		// Out of spare slots: cut the voice nearest the end of its release
+		pFree = pMostReleased;
+	}
+	return pFree;
+}
+
+// Start pSound `offset` frames into the buffer being filled. Playback thread only.
+static void startVoice(wavedata_t *pSound, int offset, int velocity, _Bool attack)
+{
+	playbackSound_t *pVoice = allocateVoice();
+	if (pVoice == NULL) {
+		atomic_fetch_add(&droppedSounds, 1);
+		return;
+	}
+	pVoice->pSound = pSound;
+	pVoice->location = 0;
+	pVoice->attackPos = attack ? 0 : attackFrames;
+	pVoice->releasePos = -1;
+	pVoice->startDelay = offset;
+	pVoice->gain = velocityGain(velocity);
+
+	AudioMixer_voiceObserver_t observe = atomic_load(&voiceObserver);
+	if (observe != NULL) {
+		// framePosition is still the current buffer's first frame
+		observe(atomic_load(&framePosition) + offset);
+	}
+}
+
+void AudioMixer_startSoundAt(wavedata_t *pSound, int offset, int velocity, _Bool attack)
+{
+	assert(pSound->numSamples > 0);
+	assert(pSound->pData);
+	assert(offset >= 0);
+	startVoice(pSound, offset, velocity, attack);
+}
+
+void AudioMixer_releaseSound(wavedata_t *pSound)
+{
+	for (int i = 0; i < NUM_SOUND_BITE_SLOTS; i++) {
+		if (soundBites[i].pSound != pSound) {
+			continue;
+		}
+		if (soundBites[i].startDelay > 0) {
+			// Not sounding yet (a delayed start): drop it now, or it would
+			// still read pSound once its delay ran out
+			soundBites[i].pSound = NULL;
+		} else {
+			startRelease(&soundBites[i]);
+		}
+	}
+}
+
+// Apply all queued commands to the sound-bite slots. Playback thread only;
+// lock-free and allocation-free.
+static void applyCommands(void)
+{
+	unsigned tail = atomic_load_explicit(&commandTail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&commandHead, memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		mixerCommand_t *pCommand = &commands[tail % COMMAND_QUEUE_SIZE];
+
+		if (pCommand->type == MIXER_CMD_STOP) {
+			AudioMixer_releaseSound(pCommand->pSound);
+			continue;
+		}
+
+		startVoice(pCommand->pSound, pCommand->delay, pCommand->velocity,
+				pCommand->type == MIXER_CMD_PLAY);
+	}
+
+	atomic_store_explicit(&commandTail, tail, memory_order_release);
+}
+
+// Mix one voice into the bus. Voices inside their attack or release ramp
+// are scaled by the ramp table, and below full velocity by their gain;
+// everything else is a plain add.
+static void mixVoice(sample_t *buff, int size, playbackSound_t *pVoice)
+{
+	if (pVoice->startDelay > 0) {
+		if (pVoice->startDelay >= size) {
+			pVoice->startDelay -= size;
+			return;
+		}
+		buff += pVoice->startDelay;
+		size -= pVoice->startDelay;
+		pVoice->startDelay = 0;
+	}
+
+	const sample_t *data = pVoice->pSound->pData + pVoice->location;
+	int remaining = pVoice->pSound->numSamples - pVoice->location;
+	int count = (size < remaining) ? size : remaining;
+	gain_t gain = pVoice->gain;
+	int j = 0;
+
+	if (pVoice->releasePos >= 0) {
+		int releasePos = pVoice->releasePos;
+		for (; j < count && releasePos < releaseFrames; j++, releasePos++) {
+			sample_t value = applyGain(data[j], releaseRamp[releasePos]);
+			buff[j] = mixSample(buff[j], applyGain(value, gain));
+		}
+		pVoice->releasePos = releasePos;
+		if (releasePos >= releaseFrames) {
+			pVoice->pSound = NULL;
+			return;
+		}
+	} else {
+		int attackPos = pVoice->attackPos;
+		for (; j < count && attackPos < attackFrames; j++, attackPos++) {
+			sample_t value = applyGain(data[j], attackRamp[attackPos]);
+			buff[j] = mixSample(buff[j], applyGain(value, gain));
+		}
+		pVoice->attackPos = attackPos;
+
+		if (gain == UNITY_GAIN) {
+			for (; j < count; j++) {
+				buff[j] = mixSample(buff[j], data[j]);
+			}
+		} else {
+			for (; j < count; j++) {
+				buff[j] = mixSample(buff[j], applyGain(data[j], gain));
+			}
+		}
+	}
+
+	pVoice->location += j;
+	if (pVoice->location >= pVoice->pSound->numSamples) {
+		pVoice->pSound = NULL;
+	}
+}
+
+// Fill the buff array with new PCM values to output.
+//    buff: mix bus to fill with new PCM data from sound bites.
+//    size: the number of *values* to store into buff
+static void fillPlaybackBuffer(sample_t *buff, int size)
+{
+	/*
+	 * REVISIT: Implement this
+	 * 1. Wipe the buff to all 0's to clear any previous PCM data.
+	 *    Hint: use memset(); read the docs about its use of size.
+	 * 2. Since this is called from a background thread, and soundBites[] array
+	 *    may be used by any other thread, must synchronize this.
+	 * 3. Loop through each slot in soundBites[], which are sounds that are either
+	 *    waiting to be played, or partially already played:
+	 *    - If the sound bite slot is unused, do nothing for this slot.
+	 *    - Otherwise "add" this sound bite's data to the play-back buffer
+	 *      (other sound bites needing to be played back will also add to the same data).
+	 *      * Record that this portion of the sound bite has been played back by incrementing
+	 *        the location inside the data where play-back currently is.
+	 *      * If you have now played back the entire sample, free the slot in the
+	 *        soundBites[] array.
+	 *
+	 * Notes on "adding" PCM samples:
+	 * - PCM is stored as signed shorts (between SHRT_MIN and SHRT_MAX).
+	 * - When adding values, ensure there is not an overflow. Any values which would
+	 *   greater than SHRT_MAX should be clipped to SHRT_MAX; likewise for underflow.
+	 * - Don't overflow any arrays!
+	 * - Efficiency matters here! The compiler may do quite a bit for you, but it doesn't
+	 *   hurt to keep it in mind. Here are some tips for efficiency and readability:
+	 *   * If, for each pass of the loop which "adds" you need to change a value inside
+	 *     a struct inside an array, it may be faster to first load the value into a local
+	 *      variable, increment this variable as needed throughout the loop, and then write it
+	 *     back into the struct inside the array after. For example:
+	 *           int offset = myArray[someIdx].value;
+	 *           for (int i =...; i < ...; i++) {
+	 *               offset ++;
+	 *           }
+	 *           myArray[someIdx].value = offset;
+	 *   * If you need a value in a number of places, try loading it into a local variable
+	 *          int someNum = myArray[someIdx].value;
+	 *          if (someNum < X || someNum > Y || someNum != Z) {
+	 *              someNum = 42;
+	 *          }
+	 *          ... use someNum vs myArray[someIdx].value;
+	 *
+	 */
+
+	memset(buff, 0, size * sizeof(*buff));
+
+	// Sequencer first, so a stop command posted after it picked up a sound
+	// is still applied to the voice it started.
+	unsigned long long startFrame = atomic_load(&framePosition);
+	AudioMixer_sequencer_t runSequencer = atomic_load(&sequencer);
+	if (runSequencer != NULL) {
+		runSequencer(startFrame, size);
+	}
+
+	applyCommands();
+	for (int i = 0; i < NUM_SOUND_BITE_SLOTS; i++) {
+		if (soundBites[i].pSound != NULL) {
+			mixVoice(buff, size, &soundBites[i]);
+		}
+	}
+	atomic_store(&framePosition, startFrame + size);
+	atomic_fetch_add(&buffersFilled, 1);
+}
+
+
+void* playbackThread(void* _arg)
+{
+	(void)_arg;
+	while (!stopping) {
+
+		Period_markEvent(PERIOD_EVENT_AUDIO_BUFFER_FILL);
+		// Generate next block of audio
+		RtAudit_enter();
+		fillPlaybackBuffer(mixBus, playbackBufferSize);
+		convertToOutput(playbackBuffer, mixBus, playbackBufferSize);
+		RtAudit_exit();
+
+		if (outputType == AUDIOMIXER_OUTPUT_NULL) {
+			writeNullOutput();
+			continue;
+		}
+		if (outputType == AUDIOMIXER_OUTPUT_FREEWHEEL) {
+			continue;
+		}
+
+		// Output the audio
+		snd_pcm_sframes_t frames = snd_pcm_writei(handle,
+				playbackBuffer, playbackBufferSize);
+
+		// Check for (and handle) possible error conditions on output
+		if (frames < 0) {
+			fprintf(stderr, "AudioMixer: writei() returned %li\n", frames);
+			frames = snd_pcm_recover(handle, frames, 1);
+		}
+		if (frames < 0) {
+			fprintf(stderr, "ERROR: Failed writing audio with snd_pcm_writei(): %li\n",
+					frames);
+			exit(EXIT_FAILURE);
+		}
+		if (frames > 0 && frames < (snd_pcm_sframes_t)playbackBufferSize) {     //fixed here
+			atomic_fetch_add(&shortWrites, 1);
+		}
+	}
+
+	return NULL;
 }
\ No newline at end of file
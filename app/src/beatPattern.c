@@ -0,0 +1,373 @@
+#include "beatPattern.h"
+#include "audioMixer.h"
+#include "instruments.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define FULL AUDIOMIXER_MAX_VELOCITY
+#define ALL_FULL { FULL, FULL, FULL, FULL, FULL, FULL, FULL, FULL }
+
+// The built-in patterns give each kit instrument the track of the same number
+#define KIT_TRACKS { INSTRUMENT_BASS_DRUM, INSTRUMENT_HI_HAT, INSTRUMENT_SNARE, \
+        INSTRUMENT_TOM, INSTRUMENT_SPLASH }
+#define BASS BEAT_HIT(INSTRUMENT_BASS_DRUM)
+#define HIHAT BEAT_HIT(INSTRUMENT_HI_HAT)
+#define SNARE BEAT_HIT(INSTRUMENT_SNARE)
+#define TOM BEAT_HIT(INSTRUMENT_TOM)
+#define SPLASH BEAT_HIT(INSTRUMENT_SPLASH)
+
+static const beatPatternSet_t builtinSet = {
+    .id = 0,
+    .numPatterns = 2,
+    .patterns = {
+        // Rock: eighth notes, hi-hat throughout, bass on 1 and snare on 2
+        {
+            .name = "rock",
+            .numTracks = INSTRUMENT_NUM_KIT,
+            .instrument = KIT_TRACKS,
+            .numLayers = 1,
+            .layers = {{
+                .numSteps = 4,
+                .stepsPerBeat = 2,
+                .hits = {
+                    BASS | HIHAT,
+                    HIHAT,
+                    SNARE | HIHAT,
+                    HIHAT,
+                },
+                .velocity = { ALL_FULL, ALL_FULL, ALL_FULL, ALL_FULL },
+            }},
+        },
+        // Custom: sixteenth notes ending on a splash
+        {
+            .name = "custom",
+            .numTracks = INSTRUMENT_NUM_KIT,
+            .instrument = KIT_TRACKS,
+            .numLayers = 1,
+            .layers = {{
+                .numSteps = 8,
+                .stepsPerBeat = 4,
+                .hits = {
+                    BASS | HIHAT,
+                    SNARE | TOM,
+                    BASS | HIHAT,
+                    SNARE | TOM,
+                    BASS | HIHAT,
+                    TOM,
+                    HIHAT | SNARE,
+                    SPLASH,
+                },
+                .velocity = {
+                    ALL_FULL, ALL_FULL, ALL_FULL, ALL_FULL,
+                    ALL_FULL, ALL_FULL, ALL_FULL, ALL_FULL,
+                },
+            }},
+        },
+    },
+};
+
+#define MAX_LINE_LENGTH 256
+#define MS_PER_SECOND 1000
+#define EIGHTHS_PER_BEAT 2
+#define SIXTEENTHS_PER_BEAT 4
+
+static atomic_int lastSetId = 0;
+
+const beatPatternSet_t *BeatPattern_getBuiltinSet(void) {
+    return &builtinSet;
+}
+
+void BeatPattern_freeSet(const beatPatternSet_t *pSet) {
+    if (pSet != NULL && pSet != &builtinSet) {
+        free((void *)pSet);
+    }
+}
+
+// Well-mixed 32-bit hash (lowbias32), for stateless per-hit randomness.
+static uint32_t hashBits(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// The grid swing works on: sixteenths, or eighths if no layer is finer than
+// eighths (e.g. Rock), so those patterns swing their off-beats instead.
+static int getSwingUnitsPerBeat(const beatPattern_t *pPattern) {
+    for (int layer = 0; layer < pPattern->numLayers; layer++) {
+        if (pPattern->layers[layer].stepsPerBeat > EIGHTHS_PER_BEAT) {
+            return SIXTEENTHS_PER_BEAT;
+        }
+    }
+    return EIGHTHS_PER_BEAT;
+}
+
+// Swing delay of a layer's `globalStep` (counted from the start of the
+// pattern), on the swing grid shared by every layer: the odd unit of each
+// pair moves from 50% of the pair towards its end, and positions in between
+// (triplet layers) move in proportion, so no hit passes another.
+static int getSwingDelay(const beatPattern_t *pPattern, const beatLayer_t *pLayer,
+        unsigned long long globalStep, double beatFrames) {
+    // Position within its pair, in units: pairPosition / stepsPerBeat
+    int unitsPerBeat = getSwingUnitsPerBeat(pPattern);
+    int pairSteps = 2 * pLayer->stepsPerBeat;
+    int pairPosition = (int)(globalStep * unitsPerBeat % pairSteps);
+    int fromEdge = pairPosition < pairSteps - pairPosition ? pairPosition : pairSteps - pairPosition;
+
+    double unitFrames = beatFrames / unitsPerBeat;
+    double amount = (pPattern->swing - BEATPATTERN_SWING_STRAIGHT) / (double)BEATPATTERN_SWING_STRAIGHT;
+    return (int)(unitFrames * amount * fromEdge / pLayer->stepsPerBeat + 0.5);
+}
+
+int BeatPattern_getHitDelay(const beatPattern_t *pPattern, int layer, unsigned cycle, int step,
+        int track, double beatFrames, unsigned int sampleRate, int *pVelocity) {
+    const beatLayer_t *pLayer = &pPattern->layers[layer];
+    int delay = 0;
+    int velocity = pLayer->velocity[step][track];
+
+    if (pPattern->swing > BEATPATTERN_SWING_STRAIGHT) {
+        unsigned long long globalStep = (unsigned long long)cycle * pLayer->numSteps + step;
+        delay = getSwingDelay(pPattern, pLayer, globalStep, beatFrames);
+    }
+
+    if (pPattern->humanizeMs > 0 || pPattern->humanizeVelocity > 0) {
+        uint32_t random = hashBits(pPattern->seed
+                ^ hashBits(cycle * BEATPATTERN_MAX_STEPS + step)
+                ^ hashBits(layer * BEATPATTERN_MAX_TRACKS + track + 0x9e3779b9U));
+        int maxDelay = pPattern->humanizeMs * sampleRate / MS_PER_SECOND;
+        if (maxDelay > 0) {
+            delay += (random & 0xffff) % (maxDelay + 1);
+        }
+        if (pPattern->humanizeVelocity > 0) {
+            velocity -= (random >> 16) % (pPattern->humanizeVelocity + 1);
+            if (velocity < 1) {
+                velocity = 1;
+            }
+        }
+    }
+
+    *pVelocity = velocity;
+    return delay;
+}
+
+_Bool BeatPattern_isRepeatable(const beatPattern_t *pPattern) {
+    if (pPattern->humanizeMs > 0 || pPattern->humanizeVelocity > 0) {
+        return false;
+    }
+
+    // Swing runs on pairs of its units from the start of the pattern, so the
+    // bar must hold a whole number of pairs
+    const beatLayer_t *pBar = &pPattern->layers[0];
+    if (pPattern->swing > BEATPATTERN_SWING_STRAIGHT
+            && (pBar->numSteps * getSwingUnitsPerBeat(pPattern)) % (2 * pBar->stepsPerBeat) != 0) {
+        return false;
+    }
+
+    // Each layer's loop (numSteps / stepsPerBeat beats) must divide the bar
+    for (int layer = 1; layer < pPattern->numLayers; layer++) {
+        const beatLayer_t *pLayer = &pPattern->layers[layer];
+        if ((pBar->numSteps * pLayer->stepsPerBeat) % (pLayer->numSteps * pBar->stepsPerBeat) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The pattern's track for an instrument, added if it has none yet.
+// Returns -1 if the pattern is out of tracks.
+static int getTrack(beatPattern_t *pPattern, int instrumentId) {
+    for (int track = 0; track < pPattern->numTracks; track++) {
+        if (pPattern->instrument[track] == instrumentId) {
+            return track;
+        }
+    }
+    if (pPattern->numTracks == BEATPATTERN_MAX_TRACKS) {
+        return -1;
+    }
+    pPattern->instrument[pPattern->numTracks] = instrumentId;
+    return pPattern->numTracks++;
+}
+
+// Parse one track's step characters into pLayer. Returns an error message,
+// or NULL on success.
+static const char *parseSteps(beatLayer_t *pLayer, int track, const char *steps) {
+    int numSteps = strlen(steps);
+    if (numSteps < 1 || numSteps > BEATPATTERN_MAX_STEPS) {
+        return "bad number of steps";
+    }
+    if (pLayer->numSteps != 0 && pLayer->numSteps != numSteps) {
+        return "step count differs from the layer's other tracks";
+    }
+    pLayer->numSteps = numSteps;
+
+    for (int step = 0; step < numSteps; step++) {
+        int velocity;
+        if (steps[step] == '.') {
+            continue;
+        } else if (steps[step] == 'x') {
+            velocity = AUDIOMIXER_MAX_VELOCITY;
+        } else if (steps[step] >= '1' && steps[step] <= '9') {
+            velocity = (steps[step] - '0') * AUDIOMIXER_MAX_VELOCITY / 9;
+        } else {
+            return "unknown step character";
+        }
+        pLayer->hits[step] |= BEAT_HIT(track);
+        pLayer->velocity[step][track] = velocity;
+    }
+    return NULL;
+}
+
+// Parse the entries of a "song" line (after the keyword) onto pSet's song.
+// Returns an error message, or NULL on success.
+static const char *parseSong(beatPatternSet_t *pSet, char *entries) {
+    char *savePtr;
+    for (char *entry = strtok_r(entries, " \t\r\n", &savePtr); entry != NULL;
+            entry = strtok_r(NULL, " \t\r\n", &savePtr)) {
+        int repeats = 1;
+        char *star = strchr(entry, '*');
+        if (star != NULL) {
+            char *end;
+            *star = '\0';
+            repeats = strtol(star + 1, &end, 10);
+            if (end == star + 1 || *end != '\0'
+                    || repeats < 1 || repeats > BEATPATTERN_MAX_REPEATS) {
+                return "expected: song <pattern>[*<1-255 bars>] ...";
+            }
+        }
+
+        int pattern = 0;
+        while (pattern < pSet->numPatterns && strcmp(entry, pSet->patterns[pattern].name) != 0) {
+            pattern++;
+        }
+        if (pattern == pSet->numPatterns) {
+            return "song names a pattern not defined above it";
+        }
+        if (pSet->songLength == BEATPATTERN_MAX_SONG_ENTRIES) {
+            return "song too long";
+        }
+        pSet->song[pSet->songLength].pattern = pattern;
+        pSet->song[pSet->songLength].repeats = repeats;
+        pSet->songLength++;
+        pSet->songBars += repeats;
+    }
+    return NULL;
+}
+
+beatPatternSet_t *BeatPattern_loadFile(const char *fileName) {
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Unable to open pattern file %s.\n", fileName);
+        return NULL;
+    }
+
+    beatPatternSet_t *pSet = calloc(1, sizeof(*pSet));
+    if (pSet == NULL) {
+        fprintf(stderr, "ERROR: Unable to allocate pattern set.\n");
+        fclose(file);
+        return NULL;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int lineNumber = 0;
+    const char *error = NULL;
+    beatPattern_t *pPattern = NULL;
+    beatLayer_t *pLayer = NULL;     // Current layer of pPattern
+
+    while (error == NULL && fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char word[32];
+        char arg[MAX_LINE_LENGTH];
+        int stepsPerBeat, swing, humanizeMs, humanizeVelocity;
+        unsigned seed;
+        char extra;
+        int numScanned = sscanf(line, "%31s %255s %c", word, arg, &extra);
+        if (numScanned <= 0) {
+            continue;   // Blank
+        }
+
+        if (strcmp(word, "pattern") == 0) {
+            if (pLayer != NULL && pLayer->numSteps == 0) {
+                error = "previous pattern has no tracks";
+            } else if (pSet->numPatterns == BEATPATTERN_MAX_PATTERNS) {
+                error = "too many patterns";
+            } else if (sscanf(line, "%*s %*s %d %c", &stepsPerBeat, &extra) != 1
+                    || stepsPerBeat < 1 || stepsPerBeat > BEATPATTERN_MAX_STEPS) {
+                error = "expected: pattern <name> <steps-per-beat>";
+            } else if (strlen(arg) >= BEATPATTERN_MAX_NAME) {
+                error = "pattern name too long";
+            } else {
+                pPattern = &pSet->patterns[pSet->numPatterns++];
+                strcpy(pPattern->name, arg);
+                pLayer = &pPattern->layers[pPattern->numLayers++];
+                pLayer->stepsPerBeat = stepsPerBeat;
+            }
+        } else if (strcmp(word, "song") == 0) {
+            error = parseSong(pSet, strstr(line, "song") + strlen("song"));
+        } else if (pPattern == NULL) {
+            error = "directive before the first pattern";
+        } else if (strcmp(word, "layer") == 0) {
+            if (pLayer->numSteps == 0) {
+                error = "previous layer has no tracks";
+            } else if (pPattern->numLayers == BEATPATTERN_MAX_LAYERS) {
+                error = "too many layers";
+            } else if (sscanf(line, "%*s %d %c", &stepsPerBeat, &extra) != 1
+                    || stepsPerBeat < 1 || stepsPerBeat > BEATPATTERN_MAX_STEPS) {
+                error = "expected: layer <steps-per-beat>";
+            } else {
+                pLayer = &pPattern->layers[pPattern->numLayers++];
+                pLayer->stepsPerBeat = stepsPerBeat;
+            }
+        } else if (strcmp(word, "swing") == 0) {
+            if (sscanf(line, "%*s %d %c", &swing, &extra) != 1
+                    || swing < BEATPATTERN_SWING_STRAIGHT || swing > BEATPATTERN_SWING_MAX) {
+                error = "expected: swing <50-75>";
+            } else {
+                pPattern->swing = swing;
+            }
+        } else if (strcmp(word, "humanize") == 0) {
+            if (sscanf(line, "%*s %d %d %u %c", &humanizeMs, &humanizeVelocity, &seed, &extra) != 3
+                    || humanizeMs < 0 || humanizeMs > BEATPATTERN_HUMANIZE_MAX_MS
+                    || humanizeVelocity < 0 || humanizeVelocity > AUDIOMIXER_MAX_VELOCITY) {
+                error = "expected: humanize <0-30 ms> <0-127 velocity> <seed>";
+            } else {
+                pPattern->humanizeMs = humanizeMs;
+                pPattern->humanizeVelocity = humanizeVelocity;
+                pPattern->seed = seed;
+            }
+        } else if (numScanned != 2) {
+            error = "expected: <instrument> <steps>";
+        } else {
+            int instrumentId = Instruments_find(word);
+            int track = (instrumentId < 0) ? -1 : getTrack(pPattern, instrumentId);
+            if (instrumentId < 0) {
+                error = "unknown instrument";
+            } else if (track < 0) {
+                error = "too many instruments in one pattern";
+            } else {
+                error = parseSteps(pLayer, track, arg);
+            }
+        }
+    }
+    fclose(file);
+
+    if (error == NULL && (pSet->numPatterns == 0 || pLayer->numSteps == 0)) {
+        error = "pattern has no tracks";
+    }
+    if (error != NULL) {
+        fprintf(stderr, "ERROR: %s:%d: %s.\n", fileName, lineNumber, error);
+        free(pSet);
+        return NULL;
+    }
+
+    pSet->id = atomic_fetch_add(&lastSetId, 1) + 1;
+    return pSet;
+}
@@ -1,5 +1,8 @@
 #include "audioMixer.h"
 #include "beatbox.h"
+#include "beatPattern.h"
+#include "instruments.h"
+#include "transport.h"
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h> 
@@ -7,52 +10,262 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 
-//#define BPM_DEFAULT 120
+#define BPM_DEFAULT 120
 #define BPM_MIN 40
 #define BPM_MAX 300
 
-static int bpm;
-static int mode; //Default is 1, 0: None, 1: Rock, 2: Custom
+// Written under beatMutex; atomic so the audio-clock sequencer can read them
+// from the playback thread without locking. The sequencer itself also takes
+// up nextBarBPM (into bpm) at bar lines. Control threads read the tempo and
+// mode from the published transport state (publishTransport()).
+static _Atomic int bpm;
+static _Atomic int mode; // 0: None, n: pattern n-1 of the set (1: Rock, 2: Custom)
+static _Atomic int nextBarBPM;  // Tempo the sequencer switches to at its next bar line, 0 if none
+static _Atomic int syncTempo;   // External clock's tempo (TEMPO_SCALE units), 0 if free-running
+static _Atomic long long startAtNs; // Scheduled pattern start (CLOCK_MONOTONIC), 0 if none...
+static _Atomic int startAtMode;     // ...and the mode it starts; the sequencer takes it up into mode
+// Bumped before and after BeatBox_setTransport() changes tempo and mode
+// together, so odd in between: the sequencer can tell a half-made change
+// and leave it for its next step rather than wait for it.
+static atomic_uint settingsSequence;
 static _Bool isRunning = true;
 static pthread_t beatThreadId;
-pthread_mutex_t beatMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t beatMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t beatChanged;  // Signalled (under beatMutex) on tempo/mode changes
 
-static wavedata_t bassDrum, hiHat, snare, tom, splash;
+static BeatBox_sequencer_t sequencerType = BEATBOX_SEQ_AUDIO_CLOCK;
+
+// Song mode. Control threads start, seek and stop the song under beatMutex;
+// the running sequencer consumes seeks and moves the position on at bar
+// boundaries, publishing the bar it is playing and that bar's mode.
+static _Atomic _Bool songPlaying = false;
+static _Atomic int songSeek = -1;       // Bar to jump to at the next boundary, -1 if none
+static _Atomic int songPosition = -1;   // Bar now playing, -1 until the song starts
+static _Atomic int songBarMode;         // Mode of that bar
+
+// Sequencer-only song cursor. The bar after the one playing is resolved a
+// bar ahead, so a boundary just takes it.
+typedef struct {
+    int bar;        // Bar within the song
+    int entry;      // Song entry it is part of...
+    int repeat;     // ...and which of that entry's bars
+} songCursor_t;
+static songCursor_t songNext;
+static int songSetId = -1;              // Pattern set songNext refers to
+
+// Record mode. Hits played while recording are captured into a lock-free
+// ring (any thread may add to it; the running sequencer drains it), so the
+// live hit is queued just as when not recording. The sequencer files each
+// one on the nearest step of the first layer's grid in the take, a one-bar
+// loop played over the pattern from the next bar on.
+#define RECORD_RING_SIZE 64             // Must be a power of two
+typedef struct {
+    atomic_uint sequence;               // Ring position the slot holds (+1 once written)
+    int instrument;
+    long long time;                     // Audio-clock frame, or CLOCK_MONOTONIC ns (beat thread)
+} recordSlot_t;
+static recordSlot_t recordRing[RECORD_RING_SIZE];
+static atomic_uint recordHead;          // Next position to claim (producers)
+static unsigned recordTail;             // Next position to read (sequencer)
+static _Atomic _Bool recording = false;
+static _Atomic _Bool takeCleared = false;
+
+// Sequencer-only take: one layer on the bar's grid, with its own instruments
+static beatPattern_t take;
+static uint8_t takePending[BEATPATTERN_MAX_STEPS];  // Hits filed this bar, merged at the next
+
+static int sampleSet = 0; // Bumped on every init, as the samples may have been reloaded
+
+// Pattern sets are swapped RCU-style. A new set is published in latestSet
+// (under beatMutex, so control threads can read it under that lock); the
+// running sequencer adopts it at its next bar boundary and reports the set
+// it is using in activeSet. The replaced set is freed once the sequencer
+// has moved off it.
+static const beatPatternSet_t *_Atomic latestSet;
+static const beatPatternSet_t *_Atomic activeSet;
+static pthread_mutex_t patternSetMutex = PTHREAD_MUTEX_INITIALIZER;  // Serializes swaps
+
+// Rendered-bar cache: after a pattern has played one bar live at some tempo,
+// that bar is pre-mixed into a single sound and started as one voice every
+// bar until the pattern, tempo or sample set changes. The render runs on
+// past the bar for as long as its hits' tails ring, under the next bar (so
+// usually two of its voices at once), just as live hits would. A render
+// that is replaced rings out too, and is freed once it can no longer sound.
+typedef struct {
+    _Bool valid;
+    int mode;
+    int bpm;
+    int sampleSet;
+    int patternSetId;
+    wavedata_t bar;
+} barCache_t;
+
+static _Atomic _Bool barCacheEnabled = true;
+// Beat-thread sequencer's cache: the current render, and the other slot
+// holding the one it replaced while that rings out
+static barCache_t barCaches[2];
+static barCache_t *pBarCache = &barCaches[0];
+static unsigned long long retiredBarEnd;    // Mixer frame by which the replaced one is silent
+
+// Sequencer tempo is in thousandths of a BPM, so an external clock can
+// steer it smoothly; bpm itself stays whole.
+#define TEMPO_SCALE 1000
+
+// Sequencer state: the pattern playing and where it is. Owned by whichever
+// sequencer runs (the playback thread or the beat thread), each counting
+// frames on its own clock.
+//
+// The position is counted in ticks of 1/(60 * TEMPO_SCALE * sample rate)
+// beat, so at `tempo` it advances exactly tempo ticks per frame. Every
+// layer's steps sit at fixed positions, so the frame of each layer's next
+// step is computed from this one position: layers need no timers of their
+// own. A tempo change re-anchors the position, so the beat carries on from
+// where it is.
+typedef struct {
+    _Bool running;
+    const beatPattern_t *pattern;       // Pattern playing...
+    int mode;                           // ...which mode and set it came from
+    int setId;
+    unsigned barNumber;                 // Bars since the pattern started
+    int barTempo;                       // Tempo of the whole bar so far, 0 if it changed
+    _Bool steadyBar;                    // The last bar was this pattern, at this tempo throughout
+    unsigned long long anchorFrame;     // Position anchor: a frame...
+    long long anchorTicks;              // ...and the position there
+    int tempo;                          // Tempo since the anchor (TEMPO_SCALE units)
+    long long nextStep[BEATPATTERN_MAX_LAYERS];  // Each layer's next step, counted from the pattern start
+} sequencer_t;
+
+static sequencer_t seq;
+
+// Where the beat is, for other threads (the clock sync): the position at a
+// frame heard at a CLOCK_MONOTONIC time, and the tempo since. The running
+// sequencer publishes it under a seqlock; readers retry while it changes.
+static atomic_uint positionSequence;    // Odd while being written
+static _Atomic _Bool positionRunning;
+static _Atomic long long positionTimeNs;
+static _Atomic long long positionTicks;
+static _Atomic int positionTempo;
+static _Atomic int positionBarSteps;    // Bar length: steps of the first layer...
+static _Atomic int positionStepsPerBeat;
+
+// What a step of the first layer starts
+typedef enum {
+    STEP_IN_BAR,        // Nothing new
+    STEP_NEXT_BAR,      // Another bar of the same pattern
+    STEP_NEW_PATTERN,   // A different pattern (or the same one afresh) from here
+    STEP_STOPPED,       // Nothing to play
+} stepStart_t;
+
+// Audio-clock sequencer: render playing this bar, if any. Playback thread only.
+static barCache_t *clockBarPlaying;
+
+// The audio-clock sequencer's bar cache is rendered on control threads (it
+// allocates) and published to the playback thread through this pointer.
+static barCache_t *_Atomic clockBar = NULL;
+static pthread_mutex_t clockBarMutex = PTHREAD_MUTEX_INITIALIZER;
+// Replaced, ringing out until the frame given (written under clockBarMutex).
+// The sequencer may play this bar on from it.
+static barCache_t *_Atomic retiredClockBar;
+static unsigned long long retiredClockBarEnd;
+
+// Beat-thread clock: its frame n is due at gridStartNs + n frames on
+// CLOCK_MONOTONIC, so neither the time spent triggering sounds nor rounding
+// accumulates into tempo drift.
+#define NS_PER_SECOND 1000000000LL
+#define NS_PER_MS 1000000.0
+#define GRID_RESYNC_NS (100 * 1000000LL)    // Restart the grid if this late
+
+static long long gridStartNs;
+
+// Step timing (lateness of each step vs. its ideal grid time). Lock-free,
+// as the audio-clock sequencer records it from the playback thread.
+static atomic_int statSteps;
+static _Atomic long long statMinLateNs = LLONG_MAX;
+static _Atomic long long statMaxLateNs = LLONG_MIN;
+static _Atomic long long statSumLateNs, statLastLateNs;
+static atomic_int statResyncs;
 
 void* beatThread(void* arg);
-void playRockBeat();
-void playCustomBeat();
+static void invalidateBarCache(void);
+static void freeBar(barCache_t *pCache);
+static void sequenceBuffer(unsigned long long bufferStartFrame, int numFrames);
+static void refreshClockBar(void);
+static void dropClockBar(void);
+static void stopSongLocked(void);
+static void publishTransport(void);
+static void publishTransportWithVolume(int volume);
+static long long getTicksPerBeat(void);
 
-void BeatBox_init() {
-    char path[256];
+static long long getTimeNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+void BeatBox_setSequencer(BeatBox_sequencer_t type) {
+    sequencerType = type;
+}
+
+// The sample a pattern track plays
+static inline wavedata_t *getTrackSound(const beatPattern_t *pattern, int track) {
+    return Instruments_get(pattern->instrument[track]);
+}
 
-    strcpy(path, "/mnt/remote/myApps/beatbox-wave-files/100051__menegass__gui-drum-bd-hard.wav");
-    AudioMixer_readWaveFileIntoMemory(path, &bassDrum);
+void BeatBox_init() {
+    sampleSet++;
 
-    strcpy(path, "/mnt/remote/myApps/beatbox-wave-files/100053__menegass__gui-drum-cc.wav");
-    AudioMixer_readWaveFileIntoMemory(path, &hiHat);
+    // The beat thread waits for step deadlines on CLOCK_MONOTONIC
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&beatChanged, &condAttr);
+    pthread_condattr_destroy(&condAttr);
 
-    strcpy(path, "/mnt/remote/myApps/beatbox-wave-files/100059__menegass__gui-drum-snare-soft.wav");
-    AudioMixer_readWaveFileIntoMemory(path, &snare);
+    latestSet = BeatPattern_getBuiltinSet();
+    activeSet = latestSet;
 
-    strcpy(path, "/mnt/remote/myApps/beatbox-wave-files/100063__menegass__gui-drum-tom-hi-soft.wav");
-    AudioMixer_readWaveFileIntoMemory(path, &tom);
+    atomic_store(&recordHead, 0);
+    recordTail = 0;
+    for (unsigned i = 0; i < RECORD_RING_SIZE; i++) {
+        atomic_store(&recordRing[i].sequence, i);
+    }
 
-    strcpy(path, "/mnt/remote/myApps/beatbox-wave-files/100061__menegass__gui-drum-splash-soft.wav");
-    AudioMixer_readWaveFileIntoMemory(path, &splash);
+    // A tempo before either sequencer can start a pattern: the step frames
+    // are worked out from it
+    pthread_mutex_lock(&beatMutex);
+    bpm = BPM_DEFAULT;
+    nextBarBPM = 0;
+    publishTransport();
+    pthread_mutex_unlock(&beatMutex);
 
-    pthread_create(&beatThreadId, NULL, beatThread, NULL);
+    if (sequencerType == BEATBOX_SEQ_AUDIO_CLOCK) {
+        refreshClockBar();
+        AudioMixer_setSequencer(sequenceBuffer);
+    } else {
+        pthread_create(&beatThreadId, NULL, beatThread, NULL);
+    }
 }
 
 void BeatBox_cleanup() {
+    pthread_mutex_lock(&beatMutex);
     isRunning = false;
-    pthread_join(beatThreadId, NULL);
-    AudioMixer_freeWaveFileData(&bassDrum);
-    AudioMixer_freeWaveFileData(&hiHat);
-    AudioMixer_freeWaveFileData(&snare);
-    AudioMixer_freeWaveFileData(&tom);
-    AudioMixer_freeWaveFileData(&splash);
+    pthread_cond_broadcast(&beatChanged);   // Cut short any step wait
+    pthread_mutex_unlock(&beatMutex);
+    if (sequencerType == BEATBOX_SEQ_AUDIO_CLOCK) {
+        AudioMixer_setSequencer(NULL);
+        dropClockBar();
+    } else {
+        pthread_join(beatThreadId, NULL);
+        freeBar(&barCaches[0]);
+        freeBar(&barCaches[1]);
+    }
+
+    BeatPattern_freeSet(latestSet);
+    pthread_cond_destroy(&beatChanged);
     pthread_mutex_destroy(&beatMutex);
 }
 
@@ -60,141 +273,1186 @@ void setBPM(int newBPM) {
     pthread_mutex_lock(&beatMutex);
     if (newBPM >= BPM_MIN && newBPM <= BPM_MAX) {
         bpm = newBPM;
+        nextBarBPM = 0;
+        pthread_cond_broadcast(&beatChanged);
+        publishTransport();
     }
     pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
 }
 
-int getBPM() {
+void BeatBox_setBPMAtNextBar(int newBPM) {
+    pthread_mutex_lock(&beatMutex);
+    if (newBPM >= BPM_MIN && newBPM <= BPM_MAX) {
+        if (mode == 0 && !songPlaying) {
+            bpm = newBPM;       // No bar to wait for
+            nextBarBPM = 0;
+            publishTransport();
+        } else {
+            nextBarBPM = newBPM;
+        }
+    }
+    pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
+}
+
+void BeatBox_setSyncTempo(int milliBPM) {
+    if (milliBPM == 0 || (milliBPM >= BPM_MIN * TEMPO_SCALE && milliBPM <= BPM_MAX * TEMPO_SCALE)) {
+        atomic_store(&syncTempo, milliBPM);
+    }
+}
+
+_Bool BeatBox_getBeatClock(BeatBox_beatClock_t *pClock) {
+    unsigned sequence;
+    _Bool running;
+    long long ticks;
+    int tempo, barSteps, stepsPerBeat;
+    do {
+        sequence = atomic_load_explicit(&positionSequence, memory_order_acquire);
+        running = atomic_load_explicit(&positionRunning, memory_order_relaxed);
+        pClock->timeNs = atomic_load_explicit(&positionTimeNs, memory_order_relaxed);
+        ticks = atomic_load_explicit(&positionTicks, memory_order_relaxed);
+        tempo = atomic_load_explicit(&positionTempo, memory_order_relaxed);
+        barSteps = atomic_load_explicit(&positionBarSteps, memory_order_relaxed);
+        stepsPerBeat = atomic_load_explicit(&positionStepsPerBeat, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) != 0
+            || sequence != atomic_load_explicit(&positionSequence, memory_order_relaxed));
+
+    if (!running) {
+        return false;
+    }
+    pClock->beats = (double)ticks / getTicksPerBeat();
+    pClock->tempo = (double)tempo / TEMPO_SCALE;
+    pClock->beatsPerBar = (double)barSteps / stepsPerBeat;
+    return true;
+}
+
+_Bool BeatBox_startPatternAt(int startMode, long long timeNs) {
+    _Bool valid = false;
     pthread_mutex_lock(&beatMutex);
-    int currentBPM = bpm;
+    if (startMode >= 0 && startMode <= latestSet->numPatterns && timeNs > 0) {
+        if (songPlaying) {
+            stopSongLocked();
+        }
+        atomic_store(&startAtNs, 0);    // The sequencer must not pair the old time with the new mode
+        atomic_store(&startAtMode, startMode);
+        atomic_store(&startAtNs, timeNs);
+        pthread_cond_broadcast(&beatChanged);
+        valid = true;
+    }
     pthread_mutex_unlock(&beatMutex);
-    return currentBPM;
+    refreshClockBar();
+    return valid;
+}
+
+// The tempo the next bar will play at.
+static int getUpcomingBPM(void) {
+    int upcomingBPM = atomic_load(&nextBarBPM);
+    return upcomingBPM != 0 ? upcomingBPM : atomic_load(&bpm);
+}
+
+int getBPM() {
+    Transport_state_t transport;
+    Transport_get(&transport);
+    return transport.bpm;
 }
 
 void setMode(int input_mode) {
     pthread_mutex_lock(&beatMutex);
-    if (input_mode >= 0 && input_mode <= 2) {
+    if (input_mode >= 0 && input_mode <= latestSet->numPatterns) {
+        songPlaying = false;
+        startAtNs = 0;
         mode = input_mode;
+        pthread_cond_broadcast(&beatChanged);
+        publishTransport();
+    }
+    pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
+}
+
+_Bool BeatBox_setTransport(int newBPM, int newMode, int newVolume) {
+    pthread_mutex_lock(&beatMutex);
+    _Bool valid = (newBPM == -1 || (newBPM >= BPM_MIN && newBPM <= BPM_MAX))
+            && newMode >= -1 && newMode <= latestSet->numPatterns
+            && newVolume >= -1 && newVolume <= AUDIOMIXER_MAX_VOLUME;
+    if (valid) {
+        atomic_fetch_add(&settingsSequence, 1);
+        if (newBPM != -1) {
+            bpm = newBPM;
+            nextBarBPM = 0;
+        }
+        if (newMode != -1) {
+            songPlaying = false;
+            startAtNs = 0;
+            mode = newMode;
+        }
+        atomic_fetch_add(&settingsSequence, 1);
+        pthread_cond_broadcast(&beatChanged);
+        publishTransportWithVolume(newVolume);
+    }
+    pthread_mutex_unlock(&beatMutex);
+
+    if (valid && newVolume != -1) {
+        AudioMixer_setVolume(newVolume);    // The hardware; the value is already published
+    }
+    if (valid) {
+        refreshClockBar();
+    }
+    return valid;
+}
+
+void BeatBox_setBarCacheEnabled(_Bool enabled) {
+    atomic_store(&barCacheEnabled, enabled);
+    refreshClockBar();
+}
+
+static _Bool isBarCacheEnabled(void) {
+    return atomic_load(&barCacheEnabled);
+}
+
+int BeatBox_getNumPatterns(void) {
+    pthread_mutex_lock(&beatMutex);
+    int numPatterns = latestSet->numPatterns;
+    pthread_mutex_unlock(&beatMutex);
+    return numPatterns;
+}
+
+void BeatBox_setPatternSet(const beatPatternSet_t *pSet) {
+    struct timespec retryDelay = {0, 1000000};  // 1ms
+
+    pthread_mutex_lock(&patternSetMutex);
+
+    pthread_mutex_lock(&beatMutex);
+    const beatPatternSet_t *pOld = atomic_exchange(&latestSet, pSet);
+    if (songPlaying && pSet->songLength == 0) {
+        stopSongLocked();
+    }
+    if (mode > pSet->numPatterns) {
+        mode = pSet->numPatterns;
+        publishTransport();
     }
+    pthread_cond_broadcast(&beatChanged);   // An idle beat thread must adopt it too
     pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
+
+    // Grace period: the sequencer may be part way through a bar of pOld
+    while (isRunning && atomic_load(&activeSet) == pOld) {
+        nanosleep(&retryDelay, NULL);
+    }
+    // ...and a render started before the swap may still be reading it
+    pthread_mutex_lock(&clockBarMutex);
+    pthread_mutex_unlock(&clockBarMutex);
+    BeatPattern_freeSet(pOld);
+
+    pthread_mutex_unlock(&patternSetMutex);
 }
 
 int getMode() {
+    Transport_state_t transport;
+    Transport_get(&transport);
+    return transport.mode;
+}
+
+// Publish the tempo, the mode getMode() reports and the song position to
+// the transport state, with `volume` in the same update unless it is -1.
+// The state is re-read until the update goes in, so after racing writers
+// the one publishing last has seen every change, and the published state
+// ends up current. Lock-free; real-time safe.
+static void publishTransportWithVolume(int volume) {
+    unsigned generation;
+    int position, reportedMode;
+    do {
+        generation = Transport_getGeneration();
+        position = atomic_load(&songPlaying) ? atomic_load(&songPosition) : -1;
+        reportedMode = position >= 0 ? atomic_load(&songBarMode) : atomic_load(&mode);
+    } while (!Transport_setBeat(generation, atomic_load(&bpm), reportedMode, position, volume));
+}
+
+static void publishTransport(void) {
+    publishTransportWithVolume(-1);
+}
+
+// Stop the song, leaving the pattern it was playing on as the mode.
+// Called with beatMutex held.
+static void stopSongLocked(void) {
+    if (songPosition >= 0) {
+        mode = songBarMode;
+    }
+    songPlaying = false;
+    pthread_cond_broadcast(&beatChanged);
+    publishTransport();
+}
+
+_Bool BeatBox_playSong(int bar) {
     pthread_mutex_lock(&beatMutex);
-    int currentMode = mode;
+    _Bool valid = bar >= 0 && bar < latestSet->songBars;
+    if (valid) {
+        if (!songPlaying) {
+            songPosition = -1;
+        }
+        songSeek = bar;
+        songPlaying = true;
+        startAtNs = 0;
+        pthread_cond_broadcast(&beatChanged);
+    }
     pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
+    return valid;
+}
 
-    return currentMode;
+void BeatBox_stopSong(void) {
+    pthread_mutex_lock(&beatMutex);
+    if (songPlaying) {
+        stopSongLocked();
+    }
+    pthread_mutex_unlock(&beatMutex);
+    refreshClockBar();
 }
 
-void* beatThread(void* arg) {
-    (void)arg;
-    while (isRunning) {
-        int mode = getMode();
+int BeatBox_getSongPosition(void) {
+    Transport_state_t transport;
+    Transport_get(&transport);
+    return transport.songPosition;
+}
+
+int BeatBox_getSongBars(void) {
+    pthread_mutex_lock(&beatMutex);
+    int songBars = latestSet->songBars;
+    pthread_mutex_unlock(&beatMutex);
+    return songBars;
+}
+
+void BeatBox_setRecording(_Bool enabled) {
+    atomic_store(&recording, enabled);
+}
+
+_Bool BeatBox_isRecording(void) {
+    return atomic_load(&recording);
+}
+
+void BeatBox_clearRecording(void) {
+    atomic_store(&takeCleared, true);
+}
 
-        if (mode == 1) {
-            playRockBeat();
-        } else if (mode == 2) {
-            playCustomBeat();
+// Capture a hit for the take, timestamped on the sequencer's clock: the
+// audio-clock frame it is mixed from, or now for the beat thread. Dropped if
+// the ring is full. Lock-free, so it never holds up the live hit.
+static void captureHit(int instrument) {
+    long long time = sequencerType == BEATBOX_SEQ_AUDIO_CLOCK
+            ? (long long)AudioMixer_getFramePosition() : getTimeNs();
+    unsigned pos = atomic_load_explicit(&recordHead, memory_order_relaxed);
+    for (;;) {
+        recordSlot_t *pSlot = &recordRing[pos % RECORD_RING_SIZE];
+        int ready = (int)(atomic_load_explicit(&pSlot->sequence, memory_order_acquire) - pos);
+        if (ready < 0) {
+            return;     // Full: the sequencer hasn't read this slot's last lap yet
+        }
+        if (ready > 0) {
+            // Another producer claimed it
+            pos = atomic_load_explicit(&recordHead, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(&recordHead, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed)) {
+            pSlot->instrument = instrument;
+            pSlot->time = time;
+            atomic_store_explicit(&pSlot->sequence, pos + 1, memory_order_release);
+            return;
         }
     }
-    return NULL;
+}
+
+// Sequencer side: the oldest captured hit, if any. Real-time safe.
+static _Bool takeCapturedHit(int *pInstrument, long long *pTime) {
+    recordSlot_t *pSlot = &recordRing[recordTail % RECORD_RING_SIZE];
+    if (atomic_load_explicit(&pSlot->sequence, memory_order_acquire) != recordTail + 1) {
+        return false;
+    }
+    *pInstrument = pSlot->instrument;
+    *pTime = pSlot->time;
+    atomic_store_explicit(&pSlot->sequence, recordTail + RECORD_RING_SIZE, memory_order_release);
+    recordTail++;
+    return true;
+}
+
+static void clearTake(void) {
+    take.numTracks = 0;
+    memset(take.layers[0].hits, 0, sizeof(take.layers[0].hits));
+    memset(takePending, 0, sizeof(takePending));
+}
+
+// Sequencer side, when a pattern starts: the take follows its bar's grid,
+// and is emptied if that changes.
+static void fitTake(const beatPattern_t *pattern) {
+    beatLayer_t *pTakeLayer = &take.layers[0];
+    if (pTakeLayer->numSteps != pattern->layers[0].numSteps
+            || pTakeLayer->stepsPerBeat != pattern->layers[0].stepsPerBeat) {
+        clearTake();
+        take.numLayers = 1;
+        pTakeLayer->numSteps = pattern->layers[0].numSteps;
+        pTakeLayer->stepsPerBeat = pattern->layers[0].stepsPerBeat;
+    }
+}
+
+// Sequencer side, at a bar boundary: the hits filed during the last bar
+// join the loop.
+static void startTakeBar(void) {
+    for (int step = 0; step < take.layers[0].numSteps; step++) {
+        take.layers[0].hits[step] |= takePending[step];
+        takePending[step] = 0;
+    }
+}
+
+// The take's track for an instrument, added if it has none yet; -1 if the
+// take is out of tracks.
+static int getTakeTrack(int instrument) {
+    for (int track = 0; track < take.numTracks; track++) {
+        if (take.instrument[track] == instrument) {
+            return track;
+        }
+    }
+    if (take.numTracks == BEATPATTERN_MAX_TRACKS) {
+        return -1;
+    }
+    take.instrument[take.numTracks] = instrument;
+    return take.numTracks++;
+}
+
+// Point pCursor at `bar` of pSet's song (which must have one).
+static void seekSong(const beatPatternSet_t *pSet, int bar, songCursor_t *pCursor) {
+    bar %= pSet->songBars;
+    pCursor->bar = bar;
+    pCursor->entry = 0;
+    while (bar >= pSet->song[pCursor->entry].repeats) {
+        bar -= pSet->song[pCursor->entry].repeats;
+        pCursor->entry++;
+    }
+    pCursor->repeat = bar;
+}
+
+// Move pCursor on one bar, looping at the end of the song.
+static void advanceSong(const beatPatternSet_t *pSet, songCursor_t *pCursor) {
+    pCursor->bar++;
+    if (++pCursor->repeat == pSet->song[pCursor->entry].repeats) {
+        pCursor->repeat = 0;
+        if (++pCursor->entry == pSet->songLength) {
+            pCursor->entry = 0;
+            pCursor->bar = 0;
+        }
+    }
+}
+
+// Sequencer side, at a bar boundary while the song plays: the mode of the
+// bar starting now. A seek or a reloaded song re-resolves it; otherwise it
+// was resolved when the previous bar started. Real-time safe.
+static int startSongBar(const beatPatternSet_t *pSet) {
+    if (pSet->songLength == 0) {
+        return atomic_load(&mode);  // Song replaced by a set without one
+    }
+
+    int seek = atomic_exchange(&songSeek, -1);
+    if (seek >= 0) {
+        seekSong(pSet, seek, &songNext);
+        songSetId = pSet->id;
+    } else if (songSetId != pSet->id) {
+        // Reloaded: carry on from the same bar of the new song
+        seekSong(pSet, songNext.bar, &songNext);
+        songSetId = pSet->id;
+    }
+
+    songCursor_t bar = songNext;
+    advanceSong(pSet, &songNext);
+    int barMode = pSet->song[bar.entry].pattern + 1;
+    atomic_store(&songBarMode, barMode);
+    atomic_store(&songPosition, bar.bar);
+    return barMode;
+}
+
+// Sequencer side: switch to the newest pattern set. Called at bar
+// boundaries (and while idle); real-time safe.
+static const beatPatternSet_t *adoptPatternSet(void) {
+    const beatPatternSet_t *pLatest = atomic_load(&latestSet);
+    atomic_store(&activeSet, pLatest);
+    return pLatest;
+}
+
+// Pattern for `patternMode` in pSet, or NULL for none.
+static const beatPattern_t *getPattern(const beatPatternSet_t *pSet, int patternMode) {
+    if (patternMode < 1 || patternMode > pSet->numPatterns) {
+        return NULL;
+    }
+    return &pSet->patterns[patternMode - 1];
 }
 
 void cycleBeatMode() {
+    // 1, 2, ..., numPatterns, then 0 (None), then back to 1
     int currentMode = getMode();
-    currentMode = (currentMode % 3) + 1; // Cycle through modes
-    
-    if (currentMode == 3) {
-        setMode(0);
-    } else {
-        setMode(currentMode);
+    setMode((currentMode + 1) % (BeatBox_getNumPatterns() + 1));
+}
+
+// All sequencer timing is in output frames at the mixer's negotiated rate;
+// wall-clock deadlines are derived from those. Position ticks per beat:
+static long long getTicksPerBeat(void) {
+    return 60LL * TEMPO_SCALE * AudioMixer_getSampleRate();
+}
+
+// Sequencer tempo: the external clock's while synced, else bpm.
+static int getSequencerTempo(void) {
+    int synced = atomic_load(&syncTempo);
+    return synced != 0 ? synced : atomic_load(&bpm) * TEMPO_SCALE;
+}
+
+// The mode and sequencer tempo, as of one moment; false (with the values
+// mixed) if BeatBox_setTransport() was half-way through changing them.
+// Real-time safe: never waits.
+static _Bool readSettings(int *pMode, int *pTempo) {
+    unsigned sequence = atomic_load(&settingsSequence);
+    *pMode = atomic_load(&mode);
+    *pTempo = getSequencerTempo();
+    return sequence % 2 == 0 && atomic_load(&settingsSequence) == sequence;
+}
+
+// A new mode waits for the first layer's next step, and a tempo set with
+// it waits too, so startStep() takes up both on the same step.
+static _Bool isTempoHeld(const sequencer_t *pSeq, int currentMode) {
+    return !atomic_load(&songPlaying) && currentMode != pSeq->mode;
+}
+
+// Frames from the start of a pattern to `step` of a layer at `beatsPerMinute`,
+// rounded up so the step never sounds early. Exact: no truncation of the
+// step length builds up over a bar.
+static int getStepOffset(int step, int stepsPerBeat, int beatsPerMinute) {
+    long long ticksPerStep = 60LL * AudioMixer_getSampleRate();
+    long long ticksPerFrame = (long long)stepsPerBeat * beatsPerMinute;
+    return (int)((step * ticksPerStep + ticksPerFrame - 1) / ticksPerFrame);
+}
+
+// Frame of `step` of a layer: the first frame at which the position has
+// reached it (the anchor, if it already has).
+static unsigned long long getStepFrame(const sequencer_t *pSeq, long long step, int stepsPerBeat) {
+    // Ticks still to go, scaled by stepsPerBeat to keep them whole
+    long long ahead = step * getTicksPerBeat() - stepsPerBeat * pSeq->anchorTicks;
+    long long ticksPerFrame = (long long)stepsPerBeat * pSeq->tempo;
+    if (ahead <= 0) {
+        return pSeq->anchorFrame;
     }
+    return pSeq->anchorFrame + (ahead + ticksPerFrame - 1) / ticksPerFrame;
 }
 
-void playRockBeat() {
-    int localBPM;
+// The layer whose step comes next (the lowest on a tie, so the first layer
+// starts bars before the others play on them), and that step's frame.
+static int getNextStep(const sequencer_t *pSeq, unsigned long long *pFrame) {
+    int next = 0;
+    for (int layer = 0; layer < pSeq->pattern->numLayers; layer++) {
+        unsigned long long frame = getStepFrame(pSeq, pSeq->nextStep[layer],
+                pSeq->pattern->layers[layer].stepsPerBeat);
+        if (layer == 0 || frame < *pFrame) {
+            next = layer;
+            *pFrame = frame;
+        }
+    }
+    return next;
+}
 
-    pthread_mutex_lock(&beatMutex);
-    localBPM = bpm;
-    pthread_mutex_unlock(&beatMutex);
+// Carry the position on at `newTempo` from `frame`.
+static void setSequencerTempo(sequencer_t *pSeq, unsigned long long frame, int newTempo) {
+    if (newTempo == pSeq->tempo) {
+        return;
+    }
+    if (frame < pSeq->anchorFrame) {
+        frame = pSeq->anchorFrame;
+    }
+    pSeq->anchorTicks += (long long)(frame - pSeq->anchorFrame) * pSeq->tempo;
+    pSeq->anchorFrame = frame;
+    pSeq->tempo = newTempo;
+    pSeq->barTempo = 0;
+}
+
+// Publish where the beat is at `frame` (not before the anchor), heard at
+// timeNs. Real-time safe.
+static void publishPosition(const sequencer_t *pSeq, unsigned long long frame, long long timeNs) {
+    unsigned sequence = atomic_load_explicit(&positionSequence, memory_order_relaxed);
+    atomic_store_explicit(&positionSequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&positionRunning, pSeq->running, memory_order_relaxed);
+    if (pSeq->running) {
+        long long ticks = pSeq->anchorTicks + (long long)(frame - pSeq->anchorFrame) * pSeq->tempo;
+        atomic_store_explicit(&positionTimeNs, timeNs, memory_order_relaxed);
+        atomic_store_explicit(&positionTicks, ticks, memory_order_relaxed);
+        atomic_store_explicit(&positionTempo, pSeq->tempo, memory_order_relaxed);
+        atomic_store_explicit(&positionBarSteps, pSeq->pattern->layers[0].numSteps, memory_order_relaxed);
+        atomic_store_explicit(&positionStepsPerBeat, pSeq->pattern->layers[0].stepsPerBeat,
+                memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&positionSequence, sequence + 2, memory_order_release);
+}
+
+// Take up the scheduled start read as `startNs`: its mode becomes the mode,
+// as if set then. False if it was replaced or cancelled meanwhile.
+// Real-time safe.
+static _Bool claimScheduledStart(long long startNs) {
+    int startMode = atomic_load(&startAtMode);
+    if (!atomic_compare_exchange_strong(&startAtNs, &startNs, 0)) {
+        return false;
+    }
+    atomic_store(&mode, startMode);
+    publishTransport();
+    return true;
+}
+
+// At a step of the first layer, due at `frame`: move on to the next bar, or
+// start a pattern here. A song only changes pattern at bar boundaries, where
+// it names the next one; otherwise the mode may change on any such step.
+// Pattern set swaps are adopted here too. Real-time safe.
+static stepStart_t startStep(sequencer_t *pSeq, unsigned long long frame) {
+    _Bool barStart = !pSeq->running
+            || pSeq->nextStep[0] % pSeq->pattern->layers[0].numSteps == 0;
+    int currentMode, currentTempo;
+    if (!readSettings(&currentMode, &currentTempo)) {
+        // A change half made: this step goes on as before, the next takes it up
+        if (!pSeq->running) {
+            return STEP_STOPPED;
+        }
+        currentMode = pSeq->mode;
+        currentTempo = pSeq->tempo;
+    }
+    if (atomic_load(&songPlaying) ? !barStart : !barStart && currentMode == pSeq->mode) {
+        return STEP_IN_BAR;
+    }
+
+    // A tempo set for the next bar starts on this bar line, so the beat's
+    // phase carries straight on
+    int barBPM = atomic_exchange(&nextBarBPM, 0);
+    if (barBPM != 0) {
+        atomic_store(&bpm, barBPM);
+        currentTempo = getSequencerTempo();
+    }
+    if (barBPM != 0 && pSeq->running) {
+        setSequencerTempo(pSeq, frame, currentTempo);
+    }
+
+    const beatPatternSet_t *pSet = adoptPatternSet();
+    if (atomic_load(&songPlaying)) {
+        currentMode = startSongBar(pSet);
+    }
+    publishTransport();     // The bar's tempo and song position
+    // No tempo, no step frames: nothing can play
+    const beatPattern_t *pattern = currentTempo != 0 ? getPattern(pSet, currentMode) : NULL;
+    if (pattern == NULL) {
+        pSeq->running = false;
+        pSeq->mode = currentMode;
+        return STEP_STOPPED;
+    }
 
-    double halfBeatTime = (60.0 / localBPM) / 2 * 1000000; 
+    if (pSeq->running && barStart && pattern == pSeq->pattern && pSeq->setId == pSet->id) {
+        // The render is only played after a whole bar of the same pattern
+        // at this (whole BPM) tempo, so a tempo still settling plays live
+        pSeq->barNumber++;
+        pSeq->steadyBar = pSeq->barTempo != 0 && pSeq->tempo % TEMPO_SCALE == 0;
+        pSeq->barTempo = pSeq->tempo;
+        startTakeBar();
+        return STEP_NEXT_BAR;
+    }
+
+    pSeq->running = true;
+    pSeq->pattern = pattern;
+    pSeq->mode = currentMode;
+    pSeq->setId = pSet->id;
+    pSeq->barNumber = 0;
+    pSeq->barTempo = currentTempo;
+    pSeq->steadyBar = false;
+    pSeq->anchorFrame = frame;
+    pSeq->anchorTicks = 0;
+    pSeq->tempo = currentTempo;
+    memset(pSeq->nextStep, 0, sizeof(pSeq->nextStep));
+    fitTake(pattern);
+    return STEP_NEW_PATTERN;
+}
+
+// Starts one hit `offset` frames from now, on the sequencer's clock
+typedef void (*hitStarter_t)(wavedata_t *pSound, int offset, int velocity);
+
+// Play the hits of `layer`'s next step, `offset` frames from now, and move
+// the layer on. Swing and humanize delays land on their exact frame too.
+static void playStep(sequencer_t *pSeq, int layer, int offset, hitStarter_t startHit) {
+    const beatPattern_t *pattern = pSeq->pattern;
+    const beatLayer_t *pLayer = &pattern->layers[layer];
+    unsigned cycle = pSeq->nextStep[layer] / pLayer->numSteps;
+    int step = pSeq->nextStep[layer] % pLayer->numSteps;
+    double beatFrames = (double)getTicksPerBeat() / pSeq->tempo;
 
-    playBassDrum();
-    playHiHat();
-    usleep(halfBeatTime);
+    for (unsigned hits = pLayer->hits[step]; hits != 0; hits &= hits - 1) {
+        int track = __builtin_ctz(hits);
+        int velocity;
+        int delay = BeatPattern_getHitDelay(pattern, layer, cycle, step, track, beatFrames,
+                AudioMixer_getSampleRate(), &velocity);
+        startHit(getTrackSound(pattern, track), offset + delay, velocity);
+    }
+    pSeq->nextStep[layer]++;
+}
 
-    playHiHat();
-    usleep(halfBeatTime);
+// Play the take's hits on the first layer's next step, `offset` frames from
+// now. Called before that step moves on.
+static void playTakeStep(int offset, hitStarter_t startHit) {
+    const beatLayer_t *pLayer = &take.layers[0];
+    int step = seq.nextStep[0] % pLayer->numSteps;
+    for (unsigned hits = pLayer->hits[step]; hits != 0; hits &= hits - 1) {
+        int track = __builtin_ctz(hits);
+        startHit(getTrackSound(&take, track), offset, pLayer->velocity[step][track]);
+    }
+}
 
-    playSnare();
-    playHiHat();
-    usleep(halfBeatTime);
+// Beat-thread clock: when `frame` is due. Whole seconds are split off so
+// the math stays small.
+static long long getFrameTimeNs(unsigned long long frame) {
+    unsigned int rate = AudioMixer_getSampleRate();
+    return gridStartNs + (long long)(frame / rate) * NS_PER_SECOND
+            + (long long)(frame % rate) * NS_PER_SECOND / rate;
+}
+
+// Beat-thread clock: the last frame due by `timeNs`.
+static unsigned long long getFrameAt(long long timeNs) {
+    unsigned int rate = AudioMixer_getSampleRate();
+    long long ns = timeNs > gridStartNs ? timeNs - gridStartNs : 0;
+    return (ns / NS_PER_SECOND) * rate + (ns % NS_PER_SECOND) * rate / NS_PER_SECOND;
+}
+
+// Sequencer side: file the hits captured since the last call into the take,
+// each on the first layer's step nearest to where it was heard. Hits from
+// before the pattern started (or while nothing plays) are dropped.
+// Real-time safe.
+static void recordHits(void) {
+    int instrument;
+    long long time;
+
+    if (atomic_exchange(&takeCleared, false)) {
+        clearTake();
+    }
+    while (takeCapturedHit(&instrument, &time)) {
+        if (!seq.running || (sequencerType == BEATBOX_SEQ_THREAD && time < gridStartNs)) {
+            continue;
+        }
+        long long frame = sequencerType == BEATBOX_SEQ_AUDIO_CLOCK ? time : (long long)getFrameAt(time);
+
+        // Position when heard, scaled to steps of the grid and rounded
+        beatLayer_t *pTakeLayer = &take.layers[0];
+        long long ticksPerBeat = getTicksPerBeat();
+        long long ticks = seq.anchorTicks + (frame - (long long)seq.anchorFrame) * seq.tempo;
+        long long scaled = ticks * pTakeLayer->stepsPerBeat + ticksPerBeat / 2;
+        int track = scaled < 0 ? -1 : getTakeTrack(instrument);
+        if (track < 0) {
+            continue;
+        }
+        int step = (int)(scaled / ticksPerBeat % pTakeLayer->numSteps);
+        takePending[step] |= BEAT_HIT(track);
+        pTakeLayer->velocity[step][track] = AUDIOMIXER_MAX_VELOCITY;
+    }
+}
 
-    playHiHat();
-    usleep(halfBeatTime);
+static void recordStepTiming(long long lateNs) {
+    long long min = atomic_load(&statMinLateNs);
+    while (lateNs < min && !atomic_compare_exchange_weak(&statMinLateNs, &min, lateNs)) {
+        // min now holds the latest; retry against it
+    }
+    long long max = atomic_load(&statMaxLateNs);
+    while (lateNs > max && !atomic_compare_exchange_weak(&statMaxLateNs, &max, lateNs)) {
+        // Likewise
+    }
+    atomic_fetch_add(&statSumLateNs, lateNs);
+    atomic_store(&statLastLateNs, lateNs);
+    atomic_fetch_add(&statSteps, 1);
 }
 
-void playCustomBeat() {
-    int localBPM;
+// Sleep until `frame` on the beat thread's clock. A tempo change made while
+// waiting carries the position on at the new tempo from now, and returns
+// false so the caller re-aims at the next step (at once, if that has
+// passed); so does a start being scheduled or cancelled. Mode changes only
+// wake it; they are acted on at the next step.
+static _Bool waitFrame(unsigned long long frame) {
+    long long deadlineNs = getFrameTimeNs(frame);
+    long long pendingStart = atomic_load(&startAtNs);
+    struct timespec deadline = {
+        .tv_sec = deadlineNs / NS_PER_SECOND,
+        .tv_nsec = deadlineNs % NS_PER_SECOND,
+    };
+    _Bool reached = false;
 
     pthread_mutex_lock(&beatMutex);
-    localBPM = bpm;
+    while (isRunning) {
+        // Settings only change under beatMutex, so no half-made change here
+        int currentTempo = getSequencerTempo();
+        if (currentTempo != seq.tempo && !isTempoHeld(&seq, atomic_load(&mode))) {
+            setSequencerTempo(&seq, getFrameAt(getTimeNs()), currentTempo);
+            break;
+        }
+        if (atomic_load(&startAtNs) != pendingStart) {
+            break;
+        }
+        if (getTimeNs() >= deadlineNs) {
+            reached = true;
+            break;
+        }
+        pthread_cond_timedwait(&beatChanged, &beatMutex, &deadline);
+    }
     pthread_mutex_unlock(&beatMutex);
+    return reached;
+}
+
+// Mixer frame by which a render replaced now is surely silent: a voice of
+// it may still start in the buffer being mixed.
+#define RING_OUT_PERIODS 4
+
+static unsigned long long getRingOutEnd(const wavedata_t *pBar) {
+    return AudioMixer_getFramePosition() + pBar->numSamples
+            + RING_OUT_PERIODS * AudioMixer_getPeriodFrames();
+}
+
+// Free a render, fading out any voice of it still sounding.
+static void freeBar(barCache_t *pCache) {
+    if (pCache->bar.pData != NULL) {
+        AudioMixer_dequeueSound(&pCache->bar);
+        AudioMixer_freeWaveFileData(&pCache->bar);
+    }
+    pCache->valid = false;
+}
+
+static barCache_t *getOtherBarCache(void) {
+    return pBarCache == &barCaches[0] ? &barCaches[1] : &barCaches[0];
+}
+
+// Drop the cached bar, leaving its voices to ring out; the next render goes
+// in the other slot. Whatever that still held is freed first, cut short if
+// it still sounds (two changes within a render's length). Only called from
+// the beat thread.
+static void invalidateBarCache(void) {
+    if (!pBarCache->valid) {
+        return;
+    }
+    barCache_t *pOther = getOtherBarCache();
+    freeBar(pOther);
+    pBarCache->valid = false;
+    retiredBarEnd = getRingOutEnd(&pBarCache->bar);
+    pBarCache = pOther;
+}
+
+// Free the render the current one replaced, once it has rung out.
+static void freeRungOutBar(void) {
+    barCache_t *pOther = getOtherBarCache();
+    if (pOther->bar.pData != NULL && AudioMixer_getFramePosition() >= retiredBarEnd) {
+        freeBar(pOther);
+    }
+}
+
+static _Bool isBarCached(int barMode, int barSetId, int barBPM) {
+    return pBarCache->valid
+            && pBarCache->mode == barMode
+            && pBarCache->patternSetId == barSetId
+            && pBarCache->bpm == barBPM
+            && pBarCache->sampleSet == sampleSet;
+}
+
+// Start the cached render of this bar if it matches (pattern, bpm, samples).
+// Returns false when the bar has to be played live instead.
+static _Bool startCachedBar(int barMode, int barSetId, int barBPM) {
+    if (pBarCache->valid && (!isBarCacheEnabled() || !isBarCached(barMode, barSetId, barBPM))) {
+        invalidateBarCache();
+    }
+    if (!pBarCache->valid) {
+        return false;
+    }
+
+    // The render already carries each hit's attack; the previous bar's
+    // tails ring on in their own voices
+    AudioMixer_queueSoundNoAttack(&pBarCache->bar);
+    return true;
+}
+
+// Pre-mix one bar of a repeatable `pattern` at `barBPM`, every layer's hits
+// included, running on past the bar until the last of their tails ends.
+static void renderBar(const beatPattern_t *pattern, int barBPM, wavedata_t *pBar) {
+    const beatLayer_t *pBarLayer = &pattern->layers[0];
+    int length = getStepOffset(pBarLayer->numSteps, pBarLayer->stepsPerBeat, barBPM);
+    double beatFrames = 60.0 * AudioMixer_getSampleRate() / barBPM;
+
+    // The first pass finds where the last tail ends, the second mixes
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            AudioMixer_allocWaveData(pBar, length);
+        }
+        for (int layer = 0; layer < pattern->numLayers; layer++) {
+            const beatLayer_t *pLayer = &pattern->layers[layer];
+            // Whole loops of the layer, as the pattern is repeatable
+            int barSteps = pBarLayer->numSteps * pLayer->stepsPerBeat / pBarLayer->stepsPerBeat;
+            for (int i = 0; i < barSteps; i++) {
+                int step = i % pLayer->numSteps;
+                int stepOffset = getStepOffset(i, pLayer->stepsPerBeat, barBPM);
+                for (unsigned hits = pLayer->hits[step]; hits != 0; hits &= hits - 1) {
+                    int track = __builtin_ctz(hits);
+                    int velocity;
+                    int delay = BeatPattern_getHitDelay(pattern, layer, i / pLayer->numSteps, step,
+                            track, beatFrames, AudioMixer_getSampleRate(), &velocity);
+                    wavedata_t *pSound = getTrackSound(pattern, track);
+                    if (pass == 0 && stepOffset + delay + pSound->numSamples > length) {
+                        length = stepOffset + delay + pSound->numSamples;
+                    } else if (pass == 1) {
+                        AudioMixer_mixInto(pBar, pSound, stepOffset + delay, velocity);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Render the bar now playing live into the cache, unless it's there already.
+// The cache is only heard from the next bar, and only if this one stays at
+// the same tempo throughout.
+static void cacheBar(const beatPattern_t *pattern, int barMode, int barSetId, int barBPM) {
+    freeRungOutBar();
+    if (!isBarCacheEnabled() || !BeatPattern_isRepeatable(pattern)
+            || isBarCached(barMode, barSetId, barBPM)) {
+        return;
+    }
 
+    invalidateBarCache();   // Any render of another pattern or tempo
+    renderBar(pattern, barBPM, &pBarCache->bar);
+    pBarCache->mode = barMode;
+    pBarCache->patternSetId = barSetId;
+    pBarCache->bpm = barBPM;
+    pBarCache->sampleSet = sampleSet;
+    pBarCache->valid = true;
+}
 
-    double beatTime = (60.0 / localBPM) * 1000000;
-    double quarterBeat = beatTime / 4;
+static void freeClockBar(barCache_t *pCache) {
+    if (pCache != NULL) {
+        freeBar(pCache);
+        free(pCache);
+    }
+}
 
- 
-    playBassDrum();   
-    playHiHat();       
-    usleep(quarterBeat);
-    
-    playSnare();   
-    playTom();    
-    usleep(quarterBeat);
+// Free the audio-clock render last replaced once it has rung out.
+// Called with clockBarMutex held.
+static void freeRungOutClockBar(void) {
+    if (retiredClockBar != NULL && AudioMixer_getFramePosition() >= retiredClockBarEnd) {
+        freeClockBar(atomic_exchange(&retiredClockBar, NULL));
+    }
+}
 
-    playBassDrum();    
-    playHiHat();       
-    usleep(quarterBeat);
+// Swap in the render the audio-clock sequencer should use now (or none).
+// pNew may be NULL. The old render is left to ring out, and freed later;
+// one replaced before is freed now, cut short if it still sounds. Called
+// with clockBarMutex held.
+static void publishClockBar(barCache_t *pNew) {
+    barCache_t *pOld = atomic_exchange(&clockBar, pNew);
+    if (pOld != NULL) {
+        retiredClockBarEnd = getRingOutEnd(&pOld->bar);
+        freeClockBar(atomic_exchange(&retiredClockBar, pOld));
+    }
+}
 
-    playSnare();       
-    playTom(); 
-    usleep(quarterBeat);
+// Keep the audio-clock sequencer's bar render in step with the current
+// mode, tempo and samples. Called from control threads on any change.
+static void refreshClockBar(void) {
+    if (sequencerType != BEATBOX_SEQ_AUDIO_CLOCK || !isRunning) {
+        return;
+    }
 
-    playBassDrum();
-    playHiHat();
-    usleep(quarterBeat);
+    pthread_mutex_lock(&clockBarMutex);
+    freeRungOutClockBar();
+    // A scheduled start's pattern is the one that will be repeating
+    int currentMode = atomic_load(&startAtNs) != 0 ? atomic_load(&startAtMode) : getMode();
+    int currentBPM = getUpcomingBPM();
+    const beatPatternSet_t *pSet = atomic_load(&latestSet);
+    const beatPattern_t *pattern = getPattern(pSet, currentMode);
+    _Bool wanted = isBarCacheEnabled() && pattern != NULL && currentBPM != 0
+            && BeatPattern_isRepeatable(pattern);
 
-    playTom(); 
-    usleep(quarterBeat);
+    barCache_t *pCurrent = atomic_load(&clockBar);
+    _Bool upToDate = pCurrent != NULL
+            && pCurrent->mode == currentMode
+            && pCurrent->patternSetId == pSet->id
+            && pCurrent->bpm == currentBPM
+            && pCurrent->sampleSet == sampleSet;
 
-    playHiHat();
-    playSnare();
-    usleep(quarterBeat);
+    if (!wanted) {
+        publishClockBar(NULL);
+    } else if (!upToDate) {
+        barCache_t *pNew = malloc(sizeof(*pNew));
+        if (pNew != NULL) {
+            renderBar(pattern, currentBPM, &pNew->bar);
+            pNew->mode = currentMode;
+            pNew->patternSetId = pSet->id;
+            pNew->bpm = currentBPM;
+            pNew->sampleSet = sampleSet;
+            pNew->valid = true;
+        }
+        publishClockBar(pNew);
+    }
+    pthread_mutex_unlock(&clockBarMutex);
+}
 
-    playSplash(); 
-    usleep(quarterBeat);
+static void dropClockBar(void) {
+    pthread_mutex_lock(&clockBarMutex);
+    publishClockBar(NULL);
+    freeClockBar(atomic_exchange(&retiredClockBar, NULL));
+    pthread_mutex_unlock(&clockBarMutex);
 }
 
-void playSnare() {
-    AudioMixer_queueSound(&snare);
+static void startClockHit(wavedata_t *pSound, int offset, int velocity) {
+    AudioMixer_startSoundAt(pSound, offset, velocity, true);
 }
 
-void playBassDrum() {
-    AudioMixer_queueSound(&bassDrum);
+// Audio-clock sequencer: called by the mixer at the start of every buffer.
+// Starts every step of every layer that falls inside
+// [bufferStartFrame, +numFrames) at its exact frame offset, all in this one
+// pass. Tempo is re-read every buffer and mode at every step of the first
+// layer, so changes are heard at once; pattern set swaps wait for the next
+// bar. The position is published as of the buffer (or the pattern start
+// within it), timed by when the buffer is mixed.
+// Real-time: no locks, no allocation, no printing.
+static void sequenceBuffer(unsigned long long bufferStartFrame, int numFrames) {
+    unsigned long long bufferEndFrame = bufferStartFrame + numFrames;
+    long long bufferStartNs = getTimeNs();
+    unsigned int rate = AudioMixer_getSampleRate();
+    long long bufferEndNs = bufferStartNs + (long long)numFrames * NS_PER_SECOND / rate;
+
+    _Bool idle = !seq.running && atomic_load(&mode) == 0 && !atomic_load(&songPlaying);
+    if (!seq.running) {
+        // Idle: nothing to finish, so pattern set swaps apply at once
+        adoptPatternSet();
+        if (idle && atomic_load(&startAtNs) == 0) {
+            return;
+        }
+    } else {
+        int currentMode, currentTempo;
+        if (readSettings(&currentMode, &currentTempo) && !isTempoHeld(&seq, currentMode)) {
+            setSequencerTempo(&seq, bufferStartFrame, currentTempo);
+        }
+    }
+    recordHits();
+
+    // A render replaced mid-bar plays the bar on while it rings out, unless
+    // freed meanwhile (replaced again)
+    if (clockBarPlaying != NULL && (seq.barTempo == 0 || (clockBarPlaying != atomic_load(&clockBar)
+            && clockBarPlaying != atomic_load(&retiredClockBar)))) {
+        // The render no longer fits (tempo change) or is gone: fade it out
+        // and carry on live
+        AudioMixer_releaseSound(&clockBarPlaying->bar);
+        clockBarPlaying = NULL;
+    }
+
+    for (;;) {
+        int layer = 0;
+        unsigned long long stepFrame = idle ? bufferEndFrame : bufferStartFrame;
+        _Bool onGrid = seq.running;     // A step of the running pattern, not a scheduled start
+        long long lateFrames = 0;
+        if (seq.running) {
+            layer = getNextStep(&seq, &stepFrame);
+            if (stepFrame < bufferStartFrame) {
+                // Came due in a buffer already begun (a stall): starts late
+                lateFrames = bufferStartFrame - stepFrame;
+                stepFrame = bufferStartFrame;
+            }
+        }
+
+        // A scheduled start in this buffer, at or before that step, takes
+        // its place: the pattern starts afresh on the frame heard then
+        long long startNs = atomic_load(&startAtNs);
+        if (startNs != 0 && startNs < bufferEndNs) {
+            unsigned long long startFrame = bufferStartFrame;
+            if (startNs > bufferStartNs) {
+                startFrame += ((startNs - bufferStartNs) * rate + NS_PER_SECOND - 1) / NS_PER_SECOND;
+            }
+            if (startFrame <= stepFrame && startFrame < bufferEndFrame && claimScheduledStart(startNs)) {
+                seq.running = false;
+                onGrid = false;
+                layer = 0;
+                stepFrame = startFrame;
+                idle = false;
+            }
+        }
+
+        if (stepFrame >= bufferEndFrame) {
+            break;
+        }
+        int offset = (int)(stepFrame - bufferStartFrame);
+        if (onGrid) {
+            recordStepTiming(lateFrames * NS_PER_SECOND / rate);
+        }
+
+        if (layer == 0) {
+            _Bool barLine = seq.running && seq.nextStep[0] % seq.pattern->layers[0].numSteps == 0;
+            stepStart_t start = startStep(&seq, stepFrame);
+            if (clockBarPlaying != NULL && !barLine
+                    && (start == STEP_NEW_PATTERN || start == STEP_STOPPED)) {
+                // Cut off mid-bar: the rest of its hits must not sound
+                AudioMixer_releaseSound(&clockBarPlaying->bar);
+            }
+            if (start != STEP_IN_BAR) {
+                clockBarPlaying = NULL;     // Its tails ring on under what follows
+            }
+            if (start == STEP_STOPPED) {
+                break;
+            }
+
+            barCache_t *pBar = atomic_load(&clockBar);
+            if (start == STEP_NEXT_BAR && seq.steadyBar && pBar != NULL
+                    && pBar->mode == seq.mode && pBar->patternSetId == seq.setId
+                    && pBar->bpm * TEMPO_SCALE == seq.tempo) {
+                AudioMixer_startSoundAt(&pBar->bar, offset, AUDIOMIXER_MAX_VELOCITY, false);
+                clockBarPlaying = pBar;
+            }
+        }
+
+        if (layer == 0) {
+            playTakeStep(offset, startClockHit);
+        }
+        if (clockBarPlaying == NULL) {
+            playStep(&seq, layer, offset, startClockHit);
+        } else {
+            seq.nextStep[layer]++;  // In the render
+        }
+    }
+
+    unsigned long long frame = seq.anchorFrame > bufferStartFrame ? seq.anchorFrame : bufferStartFrame;
+    publishPosition(&seq, frame,
+            bufferStartNs + (long long)(frame - bufferStartFrame) * NS_PER_SECOND / rate);
 }
 
-void playHiHat() {
-    AudioMixer_queueSound(&hiHat);
+void BeatBox_getTimingStatsAndClear(BeatBox_timingStats_t *pStats) {
+    // Field by field: a step recorded meanwhile may land half in each window
+    int steps = atomic_exchange(&statSteps, 0);
+    long long min = atomic_exchange(&statMinLateNs, LLONG_MAX);
+    long long max = atomic_exchange(&statMaxLateNs, LLONG_MIN);
+    long long sum = atomic_exchange(&statSumLateNs, 0);
+    _Bool any = steps > 0 && min <= max;
+    pStats->numSteps = steps;
+    pStats->minLateMs = any ? min / NS_PER_MS : 0;
+    pStats->maxLateMs = any ? max / NS_PER_MS : 0;
+    pStats->avgLateMs = any ? sum / NS_PER_MS / steps : 0;
+    pStats->driftMs = atomic_load(&statLastLateNs) / NS_PER_MS;
+    pStats->numResyncs = atomic_exchange(&statResyncs, 0);
 }
 
-void playTom() {
-    AudioMixer_queueSound(&tom);
+// Beat-thread sequencer: the same steps as the audio-clock one, each queued
+// when its frame comes round on the thread's clock. A bar played live is
+// rendered into the cache just after its first step, and if it holds a
+// steady tempo the following bars play from the render until the pattern,
+// tempo or samples change. Rendering there leaves the bar boundary with
+// only the swap to do, so the first step of a bar never waits on a render.
+void* beatThread(void* arg) {
+    (void)arg;
+    _Bool cached = false;   // This bar is playing from the cache
+
+    while (isRunning) {
+        int layer = 0;
+        unsigned long long stepFrame = 0;
+        if (seq.running) {
+            layer = getNextStep(&seq, &stepFrame);
+        } else {
+            gridStartNs = getTimeNs();  // Start the clock afresh at frame 0
+        }
+
+        // A scheduled start before that step takes its place
+        long long startNs = atomic_load(&startAtNs);
+        _Bool scheduled = startNs != 0 && (!seq.running || startNs <= getFrameTimeNs(stepFrame));
+        if (scheduled) {
+            long long nowNs = getTimeNs();
+            layer = 0;
+            stepFrame = getFrameAt(startNs > nowNs ? startNs : nowNs);
+            if (getFrameTimeNs(stepFrame) < startNs) {
+                stepFrame++;
+            }
+        }
+
+        if (seq.running || scheduled) {
+            if (!waitFrame(stepFrame)) {
+                // Tempo change (or cleanup): the rest of the bar plays live
+                if (cached) {
+                    AudioMixer_dequeueSound(&pBarCache->bar);
+                    cached = false;
+                }
+                continue;
+            }
+
+            long long lateNs = getTimeNs() - getFrameTimeNs(stepFrame);
+            recordStepTiming(lateNs);
+            if (lateNs > GRID_RESYNC_NS) {
+                // Fell far behind (e.g. stalled): move the clock on rather
+                // than firing a burst of catch-up steps
+                gridStartNs += lateNs;
+                atomic_fetch_add(&statResyncs, 1);
+            }
+        }
+        if (scheduled) {
+            if (!claimScheduledStart(startNs)) {
+                continue;   // Replaced meanwhile
+            }
+            seq.running = false;
+        }
+        recordHits();
+
+        _Bool renderAhead = false;
+        if (layer == 0) {
+            _Bool barLine = seq.running && seq.nextStep[0] % seq.pattern->layers[0].numSteps == 0;
+            stepStart_t start = startStep(&seq, stepFrame);
+            if (cached && !barLine && (start == STEP_NEW_PATTERN || start == STEP_STOPPED)) {
+                // Cut off mid-bar: the rest of its hits must not sound
+                AudioMixer_dequeueSound(&pBarCache->bar);
+            }
+            if (start != STEP_IN_BAR) {
+                cached = false;
+            }
+
+            if (start == STEP_STOPPED) {
+                // Nothing to play: park until setMode(), a tempo, a song, a
+                // new pattern set or cleanup
+                publishPosition(&seq, stepFrame, 0);
+                int stoppedTempo = getSequencerTempo();
+                pthread_mutex_lock(&beatMutex);
+                while (isRunning && mode == seq.mode && latestSet == activeSet && !songPlaying
+                        && startAtNs == 0 && getSequencerTempo() == stoppedTempo) {
+                    pthread_cond_wait(&beatChanged, &beatMutex);
+                }
+                pthread_mutex_unlock(&beatMutex);
+                continue;
+            }
+
+            // Not with a start pending: it would cut the bar short
+            if (start == STEP_NEXT_BAR && seq.steadyBar && atomic_load(&startAtNs) == 0) {
+                cached = startCachedBar(seq.mode, seq.setId, seq.tempo / TEMPO_SCALE);
+            }
+            renderAhead = start != STEP_IN_BAR && !cached && atomic_load(&startAtNs) == 0;
+        }
+        unsigned long long frame = seq.anchorFrame > stepFrame ? seq.anchorFrame : stepFrame;
+        publishPosition(&seq, frame, getFrameTimeNs(frame));
+
+        if (layer == 0) {
+            playTakeStep(0, AudioMixer_queueSoundDelayed);
+        }
+        if (!cached) {
+            // Swing and humanize delays are applied by the mixer, in frames
+            playStep(&seq, layer, 0, AudioMixer_queueSoundDelayed);
+        } else {
+            seq.nextStep[layer]++;  // In the render
+        }
+
+        if (renderAhead) {
+            // The step is queued, so the render takes from the gap before the next
+            cacheBar(seq.pattern, seq.mode, seq.setId, seq.tempo / TEMPO_SCALE);
+        }
+    }
+    return NULL;
 }
 
-void playSplash() {
-    AudioMixer_queueSound(&splash);
+_Bool BeatBox_playInstrument(int id) {
+    wavedata_t *pSound = Instruments_get(id);
+    if (pSound == NULL) {
+        return false;
+    }
+    AudioMixer_queueSound(pSound);
+    if (atomic_load(&recording)) {
+        captureHit(id);
+    }
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "binaryProtocol.h"
+#include "beatbox.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+static inline uint32_t readU32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void writeU32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+int BinaryProtocol_parse(const uint8_t *frame, int length, Command_t *commands,
+        uint32_t *pRequestId) {
+    if (length < BINARY_HEADER_SIZE) {
+        return -1;
+    }
+    *pRequestId = readU32(frame + 4);
+    int numCommands = frame[2];
+    if (frame[0] != BINARY_PROTOCOL_MAGIC || frame[1] != BINARY_PROTOCOL_VERSION
+            || frame[3] != 0 || numCommands < 1 || numCommands > BINARY_MAX_COMMANDS
+            || length != BINARY_HEADER_SIZE + numCommands * BINARY_COMMAND_SIZE) {
+        return -1;
+    }
+
+    const uint8_t *p = frame + BINARY_HEADER_SIZE;
+    for (int i = 0; i < numCommands; i++, p += BINARY_COMMAND_SIZE) {
+        Command_t *pCommand = &commands[i];
+        unsigned id = p[0] - 1u;                // Opcode 0 wraps around
+        if (id >= NUM_COMMANDS || p[1] > BINARY_PAYLOAD_INT32 || p[2] != 0 || p[3] != 0) {
+            return -1;
+        }
+        pCommand->id = id;
+        pCommand->name = NULL;
+        pCommand->nameLength = 0;
+        pCommand->hasValue = p[1] == BINARY_PAYLOAD_INT32;
+        pCommand->value = (int32_t)readU32(p + 4);
+        if (pCommand->hasValue && !Command_isValid(pCommand)) {    // Queries always are
+            return -1;
+        }
+    }
+    return numCommands;
+}
+
+static void writeHeader(uint8_t *reply, int numResults, int status, uint32_t requestId) {
+    reply[0] = BINARY_PROTOCOL_MAGIC;
+    reply[1] = BINARY_PROTOCOL_VERSION;
+    reply[2] = numResults;
+    reply[3] = status;
+    writeU32(reply + 4, requestId);
+}
+
+int BinaryProtocol_handleFrame(const uint8_t *frame, int length, uint8_t *reply,
+        _Bool *pStopRequested) {
+    Command_t commands[BINARY_MAX_COMMANDS];
+    uint32_t requestId;
+    int numCommands = BinaryProtocol_parse(frame, length, commands, &requestId);
+    if (numCommands < 0) {
+        if (length < BINARY_HEADER_SIZE) {
+            return 0;       // No request ID to answer to
+        }
+        writeHeader(reply, 0, BINARY_STATUS_BAD_FRAME, requestId);
+        return BINARY_HEADER_SIZE;
+    }
+
+    // The frame's settings go in first, as one change; the last of each wins
+    int settings[NUM_COMMANDS];
+    settings[COMMAND_TEMPO] = settings[COMMAND_MODE] = settings[COMMAND_VOLUME] = -1;
+    _Bool anySettings = false;
+    for (int i = 0; i < numCommands; i++) {
+        _Bool isSet;
+        Command_id_t setting = Command_getSetting(&commands[i], &isSet);
+        if (setting != COMMAND_UNKNOWN && isSet) {
+            settings[setting] = commands[i].value;
+            anySettings = true;
+        }
+    }
+    _Bool settingsOk = !anySettings || BeatBox_setTransport(settings[COMMAND_TEMPO],
+            settings[COMMAND_MODE], settings[COMMAND_VOLUME]);
+
+    writeHeader(reply, numCommands, BINARY_STATUS_OK, requestId);
+    uint8_t *p = reply + BINARY_HEADER_SIZE;
+    for (int i = 0; i < numCommands; i++, p += BINARY_COMMAND_SIZE) {
+        int result = 0;
+        _Bool isSet = false;
+        _Bool ok;
+        if (Command_getSetting(&commands[i], &isSet) != COMMAND_UNKNOWN && isSet) {
+            ok = settingsOk;        // Already in
+            result = commands[i].value;
+        } else {
+            ok = Command_run(&commands[i], &result);
+        }
+        *pStopRequested |= ok && commands[i].id == COMMAND_STOP;
+        p[0] = frame[BINARY_HEADER_SIZE + i * BINARY_COMMAND_SIZE];    // Its opcode
+        p[1] = ok ? BINARY_STATUS_OK : BINARY_STATUS_FAILED;
+        p[2] = 0;
+        p[3] = 0;
+        writeU32(p + 4, (uint32_t)result);
+    }
+    return BINARY_HEADER_SIZE + numCommands * BINARY_COMMAND_SIZE;
+}
@@ -0,0 +1,375 @@
+#include "clockSync.h"
+#include "beatbox.h"
+#include <arpa/inet.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PULSES_PER_BEAT 24              // As MIDI clock
+#define MESSAGE_SIZE 64
+#define SYNC_BPM_MIN 40
+#define SYNC_BPM_MAX 300
+
+#define NS_PER_SECOND 1000000000LL
+#define NS_PER_MINUTE (60 * NS_PER_SECOND)
+#define WAIT_NS (100 * 1000000LL)       // How quickly role changes and cleanup are noticed
+#define IDLE_WAIT_NS (5 * 1000000LL)    // Master: polling for the beat to start
+#define PULSE_TIMEOUT_NS NS_PER_SECOND  // Slave: no pulses this long, let the tempo go
+
+// Slave loop filter, with the error in beats and the tempo in BPM:
+//   integral += PLL_KI * error * dt,  tempo = integral + PLL_KP * error
+// Our beat moves at tempo / 60 beats a second, so the loop is second order
+// with natural frequency sqrt(PLL_KI / 60) rad/s (0.2 Hz) and damping
+// PLL_KP / (2 * sqrt(60 * PLL_KI)) (0.7): slow enough to average out network
+// jitter, settling within a few seconds.
+#define PLL_KP 105.6
+#define PLL_KI 94.7
+#define PLL_RANGE 0.1                   // Correction limit, as a fraction of the tempo
+#define TEMPO_WINDOW PULSES_PER_BEAT    // Pulses the master's tempo is measured over
+#define LOCK_BEATS (1.0 / PULSES_PER_BEAT)  // Locked while within a pulse
+#define DISPLAY_HYSTERESIS 0.75         // BPM from the tempo shown before it follows
+
+static struct sockaddr_in destAddr;     // Where a master's pulses go
+static int port;
+static _Atomic ClockSync_role_t role = CLOCKSYNC_OFF;
+static _Atomic _Bool isRunning = false;
+static pthread_t syncThreadId;
+static int socketFd = -1;               // For the current role
+
+// Master
+static long long lastPulseSent;         // -1 before the first of a run
+static _Bool sendFailed;
+
+// Slave
+typedef enum {
+    SLAVE_WAITING,                      // For a master
+    SLAVE_ACQUIRING,                    // Measuring its tempo
+    SLAVE_TRACKING,                     // Steering ours to it
+} slaveState_t;
+static slaveState_t slaveState;
+static long long lastPulse;             // Count and arrival of the last pulse received
+static long long lastPulseNs;
+static long long windowPulse;           // Start of the tempo measurement
+static long long windowNs;
+static double integral;                 // Loop filter: the master's tempo, as far as we know
+
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static ClockSync_stats_t stats;
+static double sumAbsErrorMs;
+static int numErrors;
+
+static long long getTimeNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+static void sleepUntil(long long timeNs) {
+    struct timespec deadline = { timeNs / NS_PER_SECOND, timeNs % NS_PER_SECOND };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+}
+
+static double clampTempo(double tempo) {
+    return fmin(fmax(tempo, SYNC_BPM_MIN), SYNC_BPM_MAX);
+}
+
+// Our beat position at timeNs, extrapolated from the sequencer's snapshot
+static double getBeatsAt(const BeatBox_beatClock_t *pClock, long long timeNs) {
+    return pClock->beats + (timeNs - pClock->timeNs) * pClock->tempo / NS_PER_MINUTE;
+}
+
+static int openSocket(ClockSync_role_t newRole) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Clock sync: socket");
+        return -1;
+    }
+
+    int on = 1;
+    if (newRole == CLOCKSYNC_MASTER) {
+        setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        return fd;
+    }
+
+    // Slave: a receive timeout, so role changes and cleanup are noticed,
+    // and the kernel's arrival time on each pulse
+    struct timeval timeout = { 0, WAIT_NS / 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Clock sync: bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void letGo(void) {
+    slaveState = SLAVE_WAITING;
+    integral = 0;
+    BeatBox_setSyncTempo(0);
+
+    pthread_mutex_lock(&statsMutex);
+    stats.locked = false;
+    pthread_mutex_unlock(&statsMutex);
+}
+
+// Send the pulse due now, if any, and sleep until the next one.
+static void sendPulses(void) {
+    long long now = getTimeNs();
+    BeatBox_beatClock_t clock;
+    if (!BeatBox_getBeatClock(&clock)) {
+        lastPulseSent = -1;
+        sleepUntil(now + IDLE_WAIT_NS);
+        return;
+    }
+
+    long long due = (long long)floor(getBeatsAt(&clock, now) * PULSES_PER_BEAT);
+    if (due < lastPulseSent) {
+        lastPulseSent = due - 1;    // The pattern started again
+    }
+    if (due > lastPulseSent) {
+        // After a late wake, only the latest: its count covers the rest
+        char message[MESSAGE_SIZE];
+        int length = snprintf(message, sizeof(message), "clock %lld", due);
+        _Bool failed = sendto(socketFd, message, length, 0,
+                (const struct sockaddr *)&destAddr, sizeof(destAddr)) < 0;
+        if (failed && !sendFailed) {
+            perror("Clock sync: sendto");
+        }
+        sendFailed = failed;
+        lastPulseSent = due;
+
+        pthread_mutex_lock(&statsMutex);
+        stats.numPulses++;
+        stats.tempo = clock.tempo;
+        pthread_mutex_unlock(&statsMutex);
+    }
+
+    // The tempo may change before then: never sleep long
+    double nextBeats = (double)(lastPulseSent + 1) / PULSES_PER_BEAT;
+    long long wakeNs = clock.timeNs
+            + (long long)((nextBeats - clock.beats) * NS_PER_MINUTE / clock.tempo);
+    sleepUntil(wakeNs < now + WAIT_NS ? wakeNs : now + WAIT_NS);
+}
+
+// One step of the loop: steer our tempo by the phase error at this pulse.
+static void steer(long long pulse, long long timeNs, double dt) {
+    BeatBox_beatClock_t clock;
+    if (!BeatBox_getBeatClock(&clock)) {
+        return;     // Nothing playing to steer
+    }
+
+    double error = (double)pulse / PULSES_PER_BEAT - getBeatsAt(&clock, timeNs);
+    error -= round(error);      // To the nearest beat
+
+    integral = clampTempo(integral + PLL_KI * error * dt);
+    double correction = fmin(fmax(PLL_KP * error, -PLL_RANGE * integral), PLL_RANGE * integral);
+    double tempo = clampTempo(integral + correction);
+    BeatBox_setSyncTempo((int)lround(tempo * 1000));
+    if (fabs(tempo - getBPM()) > DISPLAY_HYSTERESIS) {
+        setBPM((int)lround(tempo));     // So the display follows too
+    }
+
+    double errorMs = error * 60000 / tempo;
+    pthread_mutex_lock(&statsMutex);
+    stats.locked = fabs(error) < LOCK_BEATS;
+    stats.tempo = integral;
+    stats.lastErrorMs = errorMs;
+    sumAbsErrorMs += fabs(errorMs);
+    numErrors++;
+    if (fabs(errorMs) > stats.maxAbsErrorMs) {
+        stats.maxAbsErrorMs = fabs(errorMs);
+    }
+    pthread_mutex_unlock(&statsMutex);
+}
+
+static void trackPulse(long long pulse, long long timeNs) {
+    pthread_mutex_lock(&statsMutex);
+    stats.numPulses++;
+    if (slaveState != SLAVE_WAITING && pulse > lastPulse) {
+        stats.numLost += pulse - lastPulse - 1;
+    }
+    pthread_mutex_unlock(&statsMutex);
+
+    if (slaveState == SLAVE_WAITING || pulse <= lastPulse) {
+        // A new master, or it started again: measure its tempo from here
+        if (slaveState == SLAVE_WAITING) {
+            slaveState = SLAVE_ACQUIRING;
+        }
+        windowPulse = pulse;
+        windowNs = timeNs;
+    } else {
+        if (pulse - windowPulse >= TEMPO_WINDOW) {
+            double beats = (double)(pulse - windowPulse) / PULSES_PER_BEAT;
+            double tempo = clampTempo(beats * NS_PER_MINUTE / (timeNs - windowNs));
+            windowPulse = pulse;
+            windowNs = timeNs;
+            // The first measurement, or a tempo change the loop can't pull in
+            if (fabs(tempo - integral) > PLL_RANGE * integral) {
+                integral = tempo;
+                slaveState = SLAVE_TRACKING;
+                printf("Clock sync: following the master at %.1f BPM\n", tempo);
+            }
+        }
+        if (slaveState == SLAVE_TRACKING) {
+            steer(pulse, timeNs, (double)(timeNs - lastPulseNs) / NS_PER_SECOND);
+        }
+    }
+    lastPulse = pulse;
+    lastPulseNs = timeNs;
+}
+
+// When a datagram arrived, on CLOCK_MONOTONIC. The kernel stamps it on
+// arrival (in CLOCK_REALTIME), so time this thread spent elsewhere doesn't
+// count as network delay; without a stamp, it's now.
+static long long getArrivalNs(struct msghdr *pHeader, long long now) {
+    for (struct cmsghdr *pCmsg = CMSG_FIRSTHDR(pHeader); pCmsg != NULL;
+            pCmsg = CMSG_NXTHDR(pHeader, pCmsg)) {
+        if (pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp, realNow;
+            memcpy(&stamp, CMSG_DATA(pCmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &realNow);
+            long long ageNs = (realNow.tv_sec - stamp.tv_sec) * NS_PER_SECOND
+                    + (realNow.tv_nsec - stamp.tv_nsec);
+            if (ageNs >= 0 && ageNs < PULSE_TIMEOUT_NS) {
+                return now - ageNs;
+            }
+        }
+    }
+    return now;
+}
+
+// Wait for a pulse (up to the receive timeout) and follow it.
+static void receivePulses(void) {
+    char message[MESSAGE_SIZE];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { message, sizeof(message) - 1 };
+    struct msghdr header = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t length = recvmsg(socketFd, &header, 0);
+    long long now = getTimeNs();
+
+    long long pulse;
+    if (length > 0) {
+        message[length] = '\0';
+        if (sscanf(message, "clock %lld", &pulse) == 1 && pulse >= 0) {
+            trackPulse(pulse, getArrivalNs(&header, now));
+            return;
+        }
+    }
+    if (slaveState != SLAVE_WAITING && now - lastPulseNs > PULSE_TIMEOUT_NS) {
+        printf("Clock sync: lost the master clock\n");
+        letGo();
+    }
+}
+
+static void leaveRole(ClockSync_role_t oldRole) {
+    if (oldRole == CLOCKSYNC_SLAVE) {
+        letGo();
+    }
+    if (socketFd >= 0) {
+        close(socketFd);
+        socketFd = -1;
+    }
+}
+
+static ClockSync_role_t enterRole(ClockSync_role_t newRole) {
+    if (newRole == CLOCKSYNC_OFF) {
+        return newRole;
+    }
+    socketFd = openSocket(newRole);
+    if (socketFd < 0) {
+        atomic_store(&role, CLOCKSYNC_OFF);
+        return CLOCKSYNC_OFF;
+    }
+    lastPulseSent = -1;
+    sendFailed = false;
+    slaveState = SLAVE_WAITING;
+    integral = 0;
+    return newRole;
+}
+
+static void* syncThread(void* arg) {
+    (void)arg;
+    ClockSync_role_t current = CLOCKSYNC_OFF;
+
+    while (isRunning) {
+        ClockSync_role_t wanted = atomic_load(&role);
+        if (wanted != current) {
+            leaveRole(current);
+            current = enterRole(wanted);
+        }
+
+        if (current == CLOCKSYNC_MASTER) {
+            sendPulses();
+        } else if (current == CLOCKSYNC_SLAVE) {
+            receivePulses();
+        } else {
+            sleepUntil(getTimeNs() + WAIT_NS);
+        }
+    }
+    leaveRole(current);
+    return NULL;
+}
+
+void ClockSync_init(const char *address, int syncPort) {
+    memset(&destAddr, 0, sizeof(destAddr));
+    destAddr.sin_family = AF_INET;
+    destAddr.sin_port = htons(syncPort);
+    if (inet_pton(AF_INET, address, &destAddr.sin_addr) != 1) {
+        printf("ERROR: Clock sync address %s is not an IPv4 address.\n", address);
+        return;
+    }
+    port = syncPort;
+
+    isRunning = true;
+    pthread_create(&syncThreadId, NULL, syncThread, NULL);
+}
+
+void ClockSync_cleanup(void) {
+    if (isRunning) {
+        isRunning = false;
+        pthread_join(syncThreadId, NULL);
+    }
+}
+
+void ClockSync_setRole(ClockSync_role_t newRole) {
+    if (newRole >= CLOCKSYNC_OFF && newRole <= CLOCKSYNC_SLAVE) {
+        atomic_store(&role, newRole);
+    }
+}
+
+ClockSync_role_t ClockSync_getRole(void) {
+    return atomic_load(&role);
+}
+
+void ClockSync_getStatsAndClear(ClockSync_stats_t *pStats) {
+    pthread_mutex_lock(&statsMutex);
+    *pStats = stats;
+    pStats->meanAbsErrorMs = numErrors > 0 ? sumAbsErrorMs / numErrors : 0;
+
+    stats.numPulses = 0;
+    stats.numLost = 0;
+    stats.maxAbsErrorMs = 0;
+    sumAbsErrorMs = 0;
+    numErrors = 0;
+    pthread_mutex_unlock(&statsMutex);
+}
@@ -0,0 +1,380 @@
+#include "command.h"
+#include "audioMixer.h"
+#include "beatbox.h"
+#include "clockSync.h"
+#include "instruments.h"
+#include "nodeSync.h"
+#include "tapTempo.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#define TEMPO_MIN 40
+#define TEMPO_MAX 300
+
+// Perfect hash of the command names: from their first two chars and
+// length, every name lands on its own slot. Names are fixed, so the table
+// is built at compile time; -Woverride-init (in -Wextra) rejects a
+// collision if one is added.
+#define HASH_SIZE 16
+#define COMMAND_HASH(c0, c1, length) (((c0) + 11 * (c1) + (length)) & (HASH_SIZE - 1))
+
+// A handler runs its command, and gives the number it answers with, or
+// false if it failed. The text reply is that number, or nothing on failure,
+// unless the command has its own formatter.
+typedef struct {
+    const char *name;
+    int nameLength;
+    _Bool (*handle)(const Command_t *pCommand, int *pResult);
+    int (*formatReply)(const Command_t *pCommand, _Bool ok, int result, char *reply);
+    _Bool (*isValidSet)(int value);     // Settings a later set replaces; NULL for others
+} handler_t;
+
+// Slot to command id + 1; 0 for an empty slot
+static const signed char hashTable[HASH_SIZE] = {
+    [COMMAND_HASH('m', 'o', 4)] = COMMAND_MODE + 1,
+    [COMMAND_HASH('s', 'o', 4)] = COMMAND_SONG + 1,
+    [COMMAND_HASH('r', 'e', 6)] = COMMAND_RECORD + 1,
+    [COMMAND_HASH('t', 'a', 3)] = COMMAND_TAP + 1,
+    [COMMAND_HASH('s', 'y', 4)] = COMMAND_SYNC + 1,
+    [COMMAND_HASH('n', 'o', 4)] = COMMAND_NODE + 1,
+    [COMMAND_HASH('s', 't', 5)] = COMMAND_START + 1,
+    [COMMAND_HASH('v', 'o', 6)] = COMMAND_VOLUME + 1,
+    [COMMAND_HASH('t', 'e', 5)] = COMMAND_TEMPO + 1,
+    [COMMAND_HASH('p', 'l', 4)] = COMMAND_PLAY + 1,
+    [COMMAND_HASH('s', 't', 4)] = COMMAND_STOP + 1,
+};
+
+static const char digitPairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int Command_formatInt(int value, char *buffer) {
+    char digits[10];
+    char *pDigit = digits + sizeof(digits);     // Written backwards, two at a time
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    while (magnitude >= 100) {
+        unsigned pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--pDigit = digitPairs[pair + 1];
+        *--pDigit = digitPairs[pair];
+    }
+    if (magnitude >= 10) {
+        *--pDigit = digitPairs[magnitude * 2 + 1];
+        *--pDigit = digitPairs[magnitude * 2];
+    } else {
+        *--pDigit = '0' + magnitude;
+    }
+
+    int length = 0;
+    if (value < 0) {
+        buffer[length++] = '-';
+    }
+    int numDigits = digits + sizeof(digits) - pDigit;
+    memcpy(buffer + length, pDigit, numDigits);
+    length += numDigits;
+    buffer[length] = '\0';
+    return length;
+}
+
+// Append `text` to the reply of `length` chars, as far as it fits
+static int appendText(char *reply, int length, const char *text) {
+    while (*text != '\0' && length < COMMAND_MAX_REPLY - 1) {
+        reply[length++] = *text++;
+    }
+    reply[length] = '\0';
+    return length;
+}
+
+static _Bool isValidMode(int value) {
+    return value >= 0 && value <= BeatBox_getNumPatterns();
+}
+
+static _Bool isValidVolume(int value) {
+    return value >= 0 && value <= AUDIOMIXER_MAX_VOLUME;
+}
+
+static _Bool isValidTempo(int value) {
+    return value >= TEMPO_MIN && value <= TEMPO_MAX;
+}
+
+static _Bool handleMode(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && isValidMode(pCommand->value)) {
+        setMode(pCommand->value);
+        printf("Mode changed to %d\n", pCommand->value);
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request current mode
+        *pResult = getMode();
+        return true;
+    }
+    printf("ERROR: Mode must be between 0 and %d.\n", BeatBox_getNumPatterns());
+    return false;
+}
+
+static _Bool handleSong(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && pCommand->value == -1) {
+        BeatBox_stopSong();
+        printf("Song stopped\n");
+        *pResult = -1;
+        return true;
+    } else if (pCommand->hasValue && BeatBox_playSong(pCommand->value)) {
+        printf("Song playing from bar %d\n", pCommand->value);
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request song position (-1: not playing)
+        *pResult = BeatBox_getSongPosition();
+        return true;
+    }
+    printf("ERROR: Song bar must be between 0 and %d (-1 stops).\n", BeatBox_getSongBars() - 1);
+    return false;
+}
+
+static _Bool handleRecord(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && pCommand->value == -1) {
+        BeatBox_clearRecording();
+        printf("Recording cleared\n");
+        *pResult = -1;
+        return true;
+    } else if (pCommand->hasValue && (pCommand->value == 0 || pCommand->value == 1)) {
+        BeatBox_setRecording(pCommand->value);
+        printf("Recording %s\n", pCommand->value ? "on" : "off");
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request recording state
+        *pResult = BeatBox_isRecording();
+        return true;
+    }
+    printf("ERROR: Record must be 1 (on), 0 (off) or -1 (clear).\n");
+    return false;
+}
+
+static _Bool handleTap(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && (pCommand->value == 0 || pCommand->value == 1)) {
+        TapTempo_setEnabled(pCommand->value);
+        printf("Tap tempo %s\n", pCommand->value ? "on" : "off");
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request tap tempo state
+        *pResult = TapTempo_isEnabled();
+        return true;
+    }
+    printf("ERROR: Tap must be 1 (on) or 0 (off).\n");
+    return false;
+}
+
+static _Bool handleSync(const Command_t *pCommand, int *pResult) {
+    int value = pCommand->value;
+    if (pCommand->hasValue && value >= CLOCKSYNC_OFF && value <= CLOCKSYNC_SLAVE) {
+        ClockSync_setRole(value);
+        printf("Clock sync %s\n", value == CLOCKSYNC_MASTER ? "master"
+                : value == CLOCKSYNC_SLAVE ? "slave" : "off");
+        *pResult = value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request clock sync role
+        *pResult = ClockSync_getRole();
+        return true;
+    }
+    printf("ERROR: Sync must be 0 (off), 1 (master) or 2 (slave).\n");
+    return false;
+}
+
+static _Bool handleNode(const Command_t *pCommand, int *pResult) {
+    int value = pCommand->value;
+    if (pCommand->hasValue && value >= NODESYNC_OFF && value <= NODESYNC_FOLLOWER) {
+        NodeSync_setRole(value);
+        printf("Node sync %s\n", value == NODESYNC_LEADER ? "leader"
+                : value == NODESYNC_FOLLOWER ? "follower" : "off");
+        *pResult = value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request node sync role
+        *pResult = NodeSync_getRole();
+        return true;
+    }
+    printf("ERROR: Node must be 0 (off), 1 (leader) or 2 (follower).\n");
+    return false;
+}
+
+static _Bool handleStart(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && NodeSync_startPattern(pCommand->value)) {
+        printf("Starting mode %d on every node\n", pCommand->value);
+        *pResult = pCommand->value;
+        return true;
+    }
+    printf("ERROR: Start needs a mode from 0 to %d, on the leader node.\n",
+            BeatBox_getNumPatterns());
+    return false;
+}
+
+static _Bool handleVolume(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && isValidVolume(pCommand->value)) {
+        AudioMixer_setVolume(pCommand->value);
+        printf("Volume set to %d\n", pCommand->value);
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request current volume
+        *pResult = AudioMixer_getVolume();
+        return true;
+    }
+    printf("ERROR: Volume must be between 0 and 100.\n");
+    return false;
+}
+
+static _Bool handleTempo(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && isValidTempo(pCommand->value)) {
+        setBPM(pCommand->value);
+        printf("Tempo set to %d BPM\n", pCommand->value);
+        *pResult = pCommand->value;
+        return true;
+    } else if (!pCommand->hasValue) {  // Request current tempo
+        *pResult = getBPM();
+        return true;
+    }
+    printf("ERROR: Tempo must be between 40 and 300 BPM.\n");
+    return false;
+}
+
+static _Bool handlePlay(const Command_t *pCommand, int *pResult) {
+    if (pCommand->hasValue && BeatBox_playInstrument(pCommand->value)) {
+        printf("Played %s\n", Instruments_getName(pCommand->value));
+        *pResult = pCommand->value;
+        return true;
+    }
+    printf("ERROR: Invalid sound selection. Use 0 (Bass), 1 (HiHat), 2 (Snare), up to %d.\n",
+            Instruments_getCount() - 1);
+    return false;
+}
+
+// Played and failed hits are both answered, by name or with the error
+static int formatPlay(const Command_t *pCommand, _Bool ok, int result, char *reply) {
+    (void)result;
+    if (ok) {
+        int length = appendText(reply, 0, "Played ");
+        return appendText(reply, length, Instruments_getName(pCommand->value));
+    }
+    return snprintf(reply, COMMAND_MAX_REPLY, "ERROR: Invalid sound selection. Use 0 (Bass), "
+            "1 (HiHat), 2 (Snare), up to %d.", Instruments_getCount() - 1);
+}
+
+static _Bool handleStop(const Command_t *pCommand, int *pResult) {
+    (void)pCommand;
+    *pResult = 0;
+    return true;
+}
+
+static int formatStop(const Command_t *pCommand, _Bool ok, int result, char *reply) {
+    (void)pCommand;
+    (void)ok;
+    (void)result;
+    // Send confirmation to the web UI before shutting down
+    return appendText(reply, 0, "Shutdown initiated...");
+}
+
+static const handler_t handlers[NUM_COMMANDS] = {
+    [COMMAND_MODE] = {"mode", 4, handleMode, NULL, isValidMode},
+    [COMMAND_SONG] = {"song", 4, handleSong, NULL, NULL},
+    [COMMAND_RECORD] = {"record", 6, handleRecord, NULL, NULL},
+    [COMMAND_TAP] = {"tap", 3, handleTap, NULL, NULL},
+    [COMMAND_SYNC] = {"sync", 4, handleSync, NULL, NULL},
+    [COMMAND_NODE] = {"node", 4, handleNode, NULL, NULL},
+    [COMMAND_START] = {"start", 5, handleStart, NULL, NULL},
+    [COMMAND_VOLUME] = {"volume", 6, handleVolume, NULL, isValidVolume},
+    [COMMAND_TEMPO] = {"tempo", 5, handleTempo, NULL, isValidTempo},
+    [COMMAND_PLAY] = {"play", 4, handlePlay, formatPlay, NULL},
+    [COMMAND_STOP] = {"stop", 4, handleStop, formatStop, NULL},
+};
+
+static Command_id_t lookUp(const char *name, int nameLength) {
+    if (nameLength < 2) {
+        return COMMAND_UNKNOWN;     // No command name is that short
+    }
+    int id = hashTable[COMMAND_HASH(name[0], name[1], nameLength)] - 1;
+    if (id < 0 || handlers[id].nameLength != nameLength
+            || memcmp(handlers[id].name, name, nameLength) != 0) {
+        return COMMAND_UNKNOWN;
+    }
+    return id;
+}
+
+static inline _Bool isSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+_Bool Command_parse(const char *text, int length, Command_t *pCommand) {
+    const char *pEnd = memchr(text, '\0', length);  // Text ends at a NUL, as a C string
+    if (pEnd == NULL) {
+        pEnd = text + length;
+    }
+
+    const char *p = text;
+    while (p < pEnd && isSpace(*p)) {
+        p++;
+    }
+    if (p == pEnd) {
+        printf("ERROR: Invalid command format.\n");
+        return false;
+    }
+    pCommand->name = p;
+    while (p < pEnd && !isSpace(*p)) {
+        p++;
+    }
+    pCommand->nameLength = p - pCommand->name;
+    pCommand->id = lookUp(pCommand->name, pCommand->nameLength);
+
+    // Optional value: a decimal integer (saturating), as "%d" reads it
+    while (p < pEnd && isSpace(*p)) {
+        p++;
+    }
+    _Bool negative = p < pEnd && *p == '-';
+    if (p < pEnd && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    long long value = 0;
+    pCommand->hasValue = p < pEnd && *p >= '0' && *p <= '9';
+    for (; p < pEnd && *p >= '0' && *p <= '9'; p++) {
+        if (value <= INT_MAX) {
+            value = value * 10 + (*p - '0');
+        }
+    }
+    value = negative ? -value : value;
+    pCommand->value = value > INT_MAX ? INT_MAX : value < INT_MIN ? INT_MIN : (int)value;
+    return true;
+}
+
+int Command_execute(const Command_t *pCommand, char *reply) {
+    if (pCommand->id == COMMAND_UNKNOWN) {
+        printf("ERROR: Unknown command: %.*s\n", pCommand->nameLength, pCommand->name);
+        return 0;
+    }
+    const handler_t *pHandler = &handlers[pCommand->id];
+    int result;
+    _Bool ok = pHandler->handle(pCommand, &result);
+    if (pHandler->formatReply != NULL) {
+        return pHandler->formatReply(pCommand, ok, result, reply);
+    }
+    return ok ? Command_formatInt(result, reply) : 0;
+}
+
+_Bool Command_run(const Command_t *pCommand, int *pResult) {
+    return handlers[pCommand->id].handle(pCommand, pResult);
+}
+
+_Bool Command_isValid(const Command_t *pCommand) {
+    if (pCommand->id < 0 || pCommand->id >= NUM_COMMANDS) {
+        return false;
+    }
+    const handler_t *pHandler = &handlers[pCommand->id];
+    return !pCommand->hasValue || pHandler->isValidSet == NULL || pHandler->isValidSet(pCommand->value);
+}
+
+Command_id_t Command_getSetting(const Command_t *pCommand, _Bool *pIsSet) {
+    if (pCommand->id == COMMAND_UNKNOWN || handlers[pCommand->id].isValidSet == NULL) {
+        return COMMAND_UNKNOWN;
+    }
+    *pIsSet = pCommand->hasValue && handlers[pCommand->id].isValidSet(pCommand->value);
+    return !pCommand->hasValue || *pIsSet ? pCommand->id : COMMAND_UNKNOWN;
+}
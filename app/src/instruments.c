@@ -0,0 +1,172 @@
+#include "instruments.h"
+#include <dirent.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PATH_LENGTH 256
+#define MAX_NAME_LENGTH 64
+#define NUM_LOADER_THREADS 4
+
+// File names of the kit, in instrumentKit_t order
+static const char *const kitFiles[INSTRUMENT_NUM_KIT] = {
+    [INSTRUMENT_BASS_DRUM] = "100051__menegass__gui-drum-bd-hard.wav",
+    [INSTRUMENT_HI_HAT] = "100053__menegass__gui-drum-cc.wav",
+    [INSTRUMENT_SNARE] = "100059__menegass__gui-drum-snare-soft.wav",
+    [INSTRUMENT_TOM] = "100063__menegass__gui-drum-tom-hi-soft.wav",
+    [INSTRUMENT_SPLASH] = "100061__menegass__gui-drum-splash-soft.wav",
+};
+
+static const char *const kitNames[INSTRUMENT_NUM_KIT] = {
+    [INSTRUMENT_BASS_DRUM] = "bass",
+    [INSTRUMENT_HI_HAT] = "hihat",
+    [INSTRUMENT_SNARE] = "snare",
+    [INSTRUMENT_TOM] = "tom",
+    [INSTRUMENT_SPLASH] = "splash",
+};
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    char name[MAX_NAME_LENGTH];
+    wavedata_t sound;
+} instrument_t;
+
+static instrument_t instruments[INSTRUMENTS_MAX];
+static int numInstruments = 0;
+
+// Next instrument for the loader threads to claim
+static atomic_int nextToLoad;
+
+static void addInstrument(const char *directory, const char *fileName, const char *name) {
+    instrument_t *pInstrument = &instruments[numInstruments++];
+    snprintf(pInstrument->path, sizeof(pInstrument->path), "%s/%s", directory, fileName);
+
+    if (name == NULL) {
+        // Drop ".wav" and a "<id>__<author>__" prefix
+        const char *start = fileName;
+        for (const char *p = strstr(start, "__"); p != NULL; p = strstr(start, "__")) {
+            start = p + 2;
+        }
+        int length = strlen(start) - strlen(".wav");
+        snprintf(pInstrument->name, sizeof(pInstrument->name), "%.*s", length, start);
+    } else {
+        snprintf(pInstrument->name, sizeof(pInstrument->name), "%s", name);
+    }
+}
+
+static _Bool isKitFile(const char *fileName) {
+    for (int i = 0; i < INSTRUMENT_NUM_KIT; i++) {
+        if (strcmp(fileName, kitFiles[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static _Bool isWaveFile(const char *fileName) {
+    size_t length = strlen(fileName);
+    return length > strlen(".wav") && strcmp(fileName + length - strlen(".wav"), ".wav") == 0;
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void* loaderThread(void* arg) {
+    (void)arg;
+    int index;
+    while ((index = atomic_fetch_add(&nextToLoad, 1)) < numInstruments) {
+        AudioMixer_readWaveFileIntoMemory(instruments[index].path, &instruments[index].sound);
+    }
+    return NULL;
+}
+
+void Instruments_init(const char *directory) {
+    numInstruments = 0;
+    for (int i = 0; i < INSTRUMENT_NUM_KIT; i++) {
+        addInstrument(directory, kitFiles[i], kitNames[i]);
+    }
+
+    // Everything else in the directory, in name order so IDs don't move
+    char *otherFiles[INSTRUMENTS_MAX];
+    int numOther = 0;
+    DIR *pDir = opendir(directory);
+    if (pDir == NULL) {
+        fprintf(stderr, "ERROR: Unable to open sample directory %s.\n", directory);
+    } else {
+        struct dirent *pEntry;
+        while ((pEntry = readdir(pDir)) != NULL) {
+            if (!isWaveFile(pEntry->d_name) || isKitFile(pEntry->d_name)) {
+                continue;
+            }
+            if (INSTRUMENT_NUM_KIT + numOther == INSTRUMENTS_MAX) {
+                fprintf(stderr, "WARNING: Over %d samples in %s; ignoring %s.\n",
+                        INSTRUMENTS_MAX, directory, pEntry->d_name);
+                continue;
+            }
+            otherFiles[numOther++] = strdup(pEntry->d_name);
+        }
+        closedir(pDir);
+    }
+    qsort(otherFiles, numOther, sizeof(otherFiles[0]), compareNames);
+    for (int i = 0; i < numOther; i++) {
+        addInstrument(directory, otherFiles[i], NULL);
+        free(otherFiles[i]);
+    }
+
+    // Decoding and resampling dominate startup: spread them over a few threads
+    pthread_t loaders[NUM_LOADER_THREADS];
+    atomic_store(&nextToLoad, 0);
+    for (int i = 0; i < NUM_LOADER_THREADS; i++) {
+        pthread_create(&loaders[i], NULL, loaderThread, NULL);
+    }
+    for (int i = 0; i < NUM_LOADER_THREADS; i++) {
+        pthread_join(loaders[i], NULL);
+    }
+    printf("Loaded %d instruments from %s\n", numInstruments, directory);
+}
+
+void Instruments_cleanup(void) {
+    for (int i = 0; i < numInstruments; i++) {
+        // Nothing may still be playing a sample once it is freed
+        AudioMixer_dequeueSound(&instruments[i].sound);
+        AudioMixer_freeWaveFileData(&instruments[i].sound);
+    }
+    numInstruments = 0;
+}
+
+int Instruments_getCount(void) {
+    return numInstruments;
+}
+
+wavedata_t *Instruments_get(int id) {
+    if (id < 0 || id >= numInstruments) {
+        return NULL;
+    }
+    return &instruments[id].sound;
+}
+
+const char *Instruments_getName(int id) {
+    if (id < 0 || id >= numInstruments) {
+        return NULL;
+    }
+    return instruments[id].name;
+}
+
+int Instruments_find(const char *name) {
+    char *end;
+    long id = strtol(name, &end, 10);
+    if (end != name && *end == '\0') {
+        return (id >= 0 && id < numInstruments) ? (int)id : -1;
+    }
+
+    for (int i = 0; i < numInstruments; i++) {
+        if (strcmp(name, instruments[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
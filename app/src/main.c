@@ -1,7 +1,12 @@
 #define _POSIX_C_SOURCE 200809L
 #include "audioMixer.h"
 #include "beatbox.h"
+#include "clockSync.h"
+#include "instruments.h"
+#include "nodeSync.h"
 #include "udp_server.h"
+#include "patternWatcher.h"
+#include "transport.h"
 #include "hal/joystick.h"
 #include "hal/joystick_press.h"
 #include "hal/lcd_display.h"
@@ -10,21 +15,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <time.h>
 #include <gpiod.h>
 #include <signal.h>
 #include <periodTimer.h>
+#include "rtAudit.h"
 
 
+#define WAVE_FILE_DIR "/mnt/remote/myApps/beatbox-wave-files"
+#define PATTERN_FILE "/mnt/remote/myApps/beatbox-patterns.txt"
+#define SYNC_ADDRESS "255.255.255.255"  // Clock pulses reach every BeatBox on the network
+#define SYNC_PORT 12346
+#define NODE_GROUP "239.255.43.3"       // Multicast group for synchronized starts...
+#define NODE_INTERFACE "0.0.0.0"        // ...through the default interface
+#define NODE_PORT 12347
+#define LOOP_PERIOD_MS 20               // How often the main loop polls
+#define LCD_REDRAW_MS 50                // At most one status-screen redraw per LCD frame
+
 volatile int keepRunning = 1;
 static long lastPrintTime = 0;
-static pthread_t udpThreadId;
-
-void* udp_server_thread(void* arg) {
-    (void)arg;
-    udp_server_main(NULL);
-    return NULL;
-}
 
 
 long getCurrentTimeMs() {
@@ -36,9 +45,13 @@ long getCurrentTimeMs() {
 void cleanup_resources() {
     printf("Cleaning up resources...\n");
     udp_server_cleanup();
+    PatternWatcher_cleanup();
+    ClockSync_cleanup();
+    NodeSync_cleanup();
     joystick_cleanup();
     joystick_press_cleanup();
     BeatBox_cleanup();
+    Instruments_cleanup();
     AudioMixer_cleanup();
     lcd_display_cleanup();
     RotaryEncoder_cleanup();
@@ -59,31 +72,49 @@ int main() {
     printf("Playing BeatBox\n");
     Period_init();
     AudioMixer_init();
+    Instruments_init(WAVE_FILE_DIR);  // Loads every sample
     BeatBox_init();  // Starts beatbox thread
+    PatternWatcher_init(PATTERN_FILE);
+    ClockSync_init(SYNC_ADDRESS, SYNC_PORT);
+    NodeSync_init(NODE_GROUP, NODE_INTERFACE, NODE_PORT);
     joystick_init();
     joystick_press_init();
     lcd_display_init();
     RotaryEncoder_init();
     accelerometer_init();
 
-    pthread_create(&udpThreadId, NULL, udp_server_thread, NULL);
-    pthread_detach(udpThreadId);
+    udp_server_init();
 
     printf("Press Ctrl+C to exit.\n");
 
     // Explicitly set mode and BPM to ensure beats play
-    setMode(1);  // Rock mode
     setBPM(120); // Default BPM
+    setMode(1);  // Rock mode
     lcd_display_screen(1);
+    unsigned shownGeneration = Transport_getGeneration();
+    long lastRedrawTime = getCurrentTimeMs();
+    const struct timespec pollDelay = {0, LOOP_PERIOD_MS * 1000000L};
 
-    // Main loop
+    // Main loop: sleeps between polls, so it takes next to no CPU
     while (keepRunning) { 
+        nanosleep(&pollDelay, NULL);    // Ctrl+C cuts it short
+
+        // Redraw the status screen soon after the tempo, mode or volume
+        // changes, but no faster than the LCD can show it
         long currentTime = getCurrentTimeMs();
+        unsigned generation = Transport_getGeneration();
+        if (generation != shownGeneration && currentTime - lastRedrawTime >= LCD_REDRAW_MS) {
+            shownGeneration = generation;
+            if (getScreen() == 1) {
+                lcd_display_screen(1);
+                lastRedrawTime = currentTime;
+            }
+        }
+
         if (currentTime - lastPrintTime >= 1000) {
             lastPrintTime = currentTime;
-            int mode = getMode();
-            int bpm = getBPM();
-            int volume = AudioMixer_getVolume();
+            Transport_state_t transport;
+            Transport_get(&transport);
 
             // Capture event timing data
             Period_statistics_t audioStats;
@@ -92,13 +123,47 @@ int main() {
             Period_getStatisticsAndClear(PERIOD_EVENT_AUDIO_BUFFER_FILL, &audioStats);
             Period_getStatisticsAndClear(PERIOD_EVENT_ACCELEROMETER_SAMPLE, &accelStats);
 
+            BeatBox_timingStats_t beatStats;
+            BeatBox_getTimingStatsAndClear(&beatStats);
+
+            ClockSync_stats_t syncStats;
+            ClockSync_getStatsAndClear(&syncStats);
+            NodeSync_stats_t nodeStats;
+            NodeSync_getStatsAndClear(&nodeStats);
+            udp_server_stats_t udpStats;
+            udp_server_getStatsAndClear(&udpStats);
+
             // Print system status
-            printf("M%d %dbpm vol:%d Audio[%.3f, %.3f] avg %.3f/%d Accel[%.3f, %.3f] avg %.3f/%d\n",
-                   mode, bpm, volume,
+            printf("M%d %dbpm vol:%d Audio[%.3f, %.3f] avg %.3f/%d Accel[%.3f, %.3f] avg %.3f/%d"
+                   " Beat[%.3f, %.3f] avg %.3f/%d drift %.3f",
+                   transport.mode, transport.bpm, transport.volume,
                    audioStats.minPeriodInMs, audioStats.maxPeriodInMs, audioStats.avgPeriodInMs, audioStats.numSamples,
-                   accelStats.minPeriodInMs, accelStats.maxPeriodInMs, accelStats.avgPeriodInMs, accelStats.numSamples);
+                   accelStats.minPeriodInMs, accelStats.maxPeriodInMs, accelStats.avgPeriodInMs, accelStats.numSamples,
+                   beatStats.minLateMs, beatStats.maxLateMs, beatStats.avgLateMs, beatStats.numSteps, beatStats.driftMs);
+            if (ClockSync_getRole() == CLOCKSYNC_SLAVE) {
+                printf(" Sync[%s %.1fbpm err %+.3f avg %.3f max %.3f lost %d]",
+                       syncStats.locked ? "locked" : "free", syncStats.tempo, syncStats.lastErrorMs,
+                       syncStats.meanAbsErrorMs, syncStats.maxAbsErrorMs, syncStats.numLost);
+            }
+            if (NodeSync_getRole() == NODESYNC_LEADER) {
+                printf(" Nodes[%d bars %d spread %.3f max %.3f]",
+                       nodeStats.numNodes, nodeStats.numBars, nodeStats.spreadMs, nodeStats.maxAbsAlignMs);
+            } else if (NodeSync_getRole() == NODESYNC_FOLLOWER) {
+                printf(" Node[offset %.3f skew %+.1fppm align %+.3f max %.3f]",
+                       nodeStats.offsetMs, nodeStats.skewPpm, nodeStats.lastAlignMs, nodeStats.maxAbsAlignMs);
+            }
+            if (udpStats.numDatagrams > 0) {
+                printf(" Udp[%d in %d batches avg %.1f max %d coalesced %d (%d across senders)"
+                       " binary %d sends %d]",
+                       udpStats.numDatagrams, udpStats.numBatches,
+                       (double)udpStats.numDatagrams / udpStats.numBatches, udpStats.maxBatch,
+                       udpStats.numCoalesced, udpStats.numCoalescedAcross, udpStats.numFrames,
+                       udpStats.numSendCalls);
+            }
+            printf("\n");
 
             lcd_display_screen(getScreen());
+            lastRedrawTime = currentTime;
 
         
             int dir = joystick_get_dir();
@@ -113,6 +178,11 @@ int main() {
     }
     
     cleanup_resources();
+
+    // Audit builds: a real-time violation fails the run
+    if (RtAudit_report() > 0) {
+        return EXIT_FAILURE;
+    }
     printf("Exited Cleanly.\n");
     return 0;
 }
\ No newline at end of file
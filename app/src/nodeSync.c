@@ -0,0 +1,515 @@
+#include "nodeSync.h"
+#include "beatbox.h"
+#include <arpa/inet.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESSAGE_SIZE 128
+#define MAX_NODES 16
+#define MAX_EXCHANGES 32                // Clock exchanges the estimate is fitted to
+#define MIN_SKEW_EXCHANGES 8            // Before the skew is estimated too
+#define MAX_SKEW 500e-6                 // Beyond any crystal: a bad fit
+#define START_REPEATS 3                 // Copies of each start, against loss
+
+#define NS_PER_SECOND 1000000000LL
+#define NS_PER_MS 1000000LL
+#define NS_PER_MINUTE (60 * NS_PER_SECOND)
+#define START_LEAD_NS (500 * NS_PER_MS)     // Covers the network and the audio buffered ahead
+#define EXCHANGE_NS (250 * NS_PER_MS)
+#define FAST_EXCHANGES 8                    // The first few go quicker
+#define FAST_EXCHANGE_NS (50 * NS_PER_MS)
+#define WAIT_MS 20                          // Longest wait for a message; bars are measured between
+
+static struct sockaddr_in groupAddr;
+static struct in_addr interfaceAddr;
+static _Atomic NodeSync_role_t role = NODESYNC_OFF;
+static _Atomic _Bool isRunning = false;
+static pthread_t syncThreadId;
+static unsigned nodeId;                 // Tells this node's messages from the others'
+
+// Everything below is guarded by nodeMutex: the sync thread and a leader's
+// NodeSync_startPattern() (from the UDP thread) share them.
+static pthread_mutex_t nodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static int socketFd = -1;               // For the current role
+static NodeSync_role_t activeRole = NODESYNC_OFF;
+static _Bool sendFailed;
+
+// The start the nodes are playing from, in leader time
+typedef struct {
+    _Bool active;
+    long long id;                       // Unique per leader and start
+    int mode;
+    int bpm;
+    long long leaderNs;
+    long long lastBar;                  // Last bar measured
+} schedule_t;
+static schedule_t schedule;
+static unsigned startCount;
+
+// Follower: one clock exchange. offset is the leader's clock minus ours at
+// localNs (the middle of the exchange), to within half its round trip.
+typedef struct {
+    long long localNs;
+    long long offsetNs;
+    long long delayNs;
+} exchange_t;
+static exchange_t exchanges[MAX_EXCHANGES];    // Ring of the latest
+static int numExchanges;
+static unsigned exchangeSeq;            // Of the request awaiting its reply
+static long long nextExchangeNs;
+
+// Follower: the fitted estimate, leader = local + offsetNs + skew * (local - refNs)
+static _Bool haveEstimate;
+static long long estimateRefNs;
+static double estimateOffsetNs;
+static double estimateSkew;
+static double estimateDelayNs;
+
+// Leader: each node's latest bar report
+typedef struct {
+    unsigned id;
+    long long bar;
+    double alignMs;
+} nodeReport_t;
+static nodeReport_t nodes[MAX_NODES];
+static int numNodes;
+
+static NodeSync_stats_t stats;
+
+static long long getTimeNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+// When a datagram arrived, on CLOCK_MONOTONIC: the kernel stamps it (in
+// CLOCK_REALTIME) on arrival. Without a stamp, it's now.
+static long long getArrivalNs(struct msghdr *pHeader, long long now) {
+    for (struct cmsghdr *pCmsg = CMSG_FIRSTHDR(pHeader); pCmsg != NULL;
+            pCmsg = CMSG_NXTHDR(pHeader, pCmsg)) {
+        if (pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp, realNow;
+            memcpy(&stamp, CMSG_DATA(pCmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &realNow);
+            long long ageNs = (realNow.tv_sec - stamp.tv_sec) * NS_PER_SECOND
+                    + (realNow.tv_nsec - stamp.tv_nsec);
+            if (ageNs >= 0 && ageNs < NS_PER_SECOND) {
+                return now - ageNs;
+            }
+        }
+    }
+    return now;
+}
+
+static void sendMessage(const char *message) {
+    _Bool failed = sendto(socketFd, message, strlen(message), 0,
+            (const struct sockaddr *)&groupAddr, sizeof(groupAddr)) < 0;
+    if (failed && !sendFailed) {
+        perror("Node sync: sendto");
+    }
+    sendFailed = failed;
+}
+
+static int openSocket(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Node sync: socket");
+        return -1;
+    }
+
+    // Several nodes may share a machine (and so the port)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = groupAddr.sin_port;
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Node sync: bind");
+        close(fd);
+        return -1;
+    }
+
+    // Join the group, and loop our own sends back for nodes on this machine
+    struct ip_mreq membership = { groupAddr.sin_addr, interfaceAddr };
+    unsigned char loop = 1;
+    unsigned char ttl = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr, sizeof(interfaceAddr)) < 0) {
+        perror("Node sync: multicast");
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    return fd;
+}
+
+// Our time to the leader's, and back. The leader's own clock is the timebase.
+static double localToLeader(double localNs) {
+    if (activeRole == NODESYNC_LEADER) {
+        return localNs;
+    }
+    return localNs + estimateOffsetNs + estimateSkew * (localNs - estimateRefNs);
+}
+
+static double leaderToLocal(double leaderNs) {
+    if (activeRole == NODESYNC_LEADER) {
+        return leaderNs;
+    }
+    return estimateRefNs + (leaderNs - estimateRefNs - estimateOffsetNs) / (1 + estimateSkew);
+}
+
+// Follower: the schedule's tempo, in our clock's minutes
+static void applyTempo(void) {
+    if (activeRole == NODESYNC_FOLLOWER && schedule.active) {
+        BeatBox_setSyncTempo((int)lround(schedule.bpm * 1000 * (1 + estimateSkew)));
+    }
+}
+
+static int compareDelays(const void *a, const void *b) {
+    long long x = ((const exchange_t *)a)->delayNs;
+    long long y = ((const exchange_t *)b)->delayNs;
+    return (x > y) - (x < y);
+}
+
+// Fit the estimate to the exchanges with the quickest round trips (the
+// slower a trip, the more one-way queueing can skew its offset): their mean
+// offset, and once there are enough, the slope of a least-squares line
+// through them as the skew.
+static void updateEstimate(void) {
+    int count = numExchanges < MAX_EXCHANGES ? numExchanges : MAX_EXCHANGES;
+    exchange_t best[MAX_EXCHANGES];
+    memcpy(best, exchanges, count * sizeof(best[0]));
+    qsort(best, count, sizeof(best[0]), compareDelays);
+    int used = count >= 4 ? count / 2 : count;
+
+    long long baseNs = best[0].localNs;     // Keeps the sums well within double precision
+    double meanT = 0, meanOffset = 0;
+    for (int i = 0; i < used; i++) {
+        meanT += (double)(best[i].localNs - baseNs) / used;
+        meanOffset += (double)best[i].offsetNs / used;
+    }
+    double sumTT = 0, sumTO = 0;
+    for (int i = 0; i < used; i++) {
+        double t = (best[i].localNs - baseNs) - meanT;
+        sumTT += t * t;
+        sumTO += t * (best[i].offsetNs - meanOffset);
+    }
+
+    double skew = 0;
+    if (count >= MIN_SKEW_EXCHANGES && sumTT > 0) {
+        skew = fmin(fmax(sumTO / sumTT, -MAX_SKEW), MAX_SKEW);
+    }
+    estimateRefNs = baseNs + (long long)meanT;
+    estimateOffsetNs = meanOffset;
+    estimateSkew = skew;
+    estimateDelayNs = (double)best[0].delayNs;
+    haveEstimate = true;
+}
+
+// Follower: one exchange is t1 (request sent, our clock), t2 (arrived,
+// leader's clock), t3 (reply sent, leader's) and t4 (reply arrived, ours).
+static void addExchange(long long t1, long long t2, long long t3, long long t4) {
+    exchange_t *pExchange = &exchanges[numExchanges % MAX_EXCHANGES];
+    pExchange->localNs = t1 + (t4 - t1) / 2;
+    pExchange->offsetNs = ((t2 - t1) + (t3 - t4)) / 2;
+    pExchange->delayNs = (t4 - t1) - (t3 - t2);
+    numExchanges++;
+    stats.numExchanges++;
+
+    updateEstimate();
+    applyTempo();
+}
+
+static void sendExchange(long long now) {
+    char message[MESSAGE_SIZE];
+    exchangeSeq++;
+    snprintf(message, sizeof(message), "time? %u %u %lld", nodeId, exchangeSeq, getTimeNs());
+    sendMessage(message);
+    nextExchangeNs = now + (numExchanges < FAST_EXCHANGES ? FAST_EXCHANGE_NS : EXCHANGE_NS);
+}
+
+static void startSchedule(long long id, int mode, int bpm, long long leaderNs) {
+    schedule.active = true;
+    schedule.id = id;
+    schedule.mode = mode;
+    schedule.bpm = bpm;
+    schedule.leaderNs = leaderNs;
+    schedule.lastBar = -1;
+    numNodes = 0;
+
+    if (getBPM() != bpm) {
+        setBPM(bpm);
+    }
+    applyTempo();
+    BeatBox_startPatternAt(mode, (long long)leaderToLocal(leaderNs));
+}
+
+static void addReport(unsigned id, long long bar, double alignMs) {
+    int i = 0;
+    while (i < numNodes && nodes[i].id != id) {
+        i++;
+    }
+    if (i == MAX_NODES) {
+        return;
+    }
+    if (i == numNodes) {
+        numNodes++;
+    }
+    nodes[i].id = id;
+    nodes[i].bar = bar;
+    nodes[i].alignMs = alignMs;
+
+    stats.numBars++;
+    if (fabs(alignMs) > stats.maxAbsAlignMs) {
+        stats.maxAbsAlignMs = fabs(alignMs);
+    }
+}
+
+static void handleMessage(const char *message, long long arrivalNs) {
+    unsigned id, seq;
+    long long t1, t2, t3, startId, leaderNs, bar, alignNs;
+    int mode, bpm;
+
+    if (activeRole == NODESYNC_LEADER) {
+        if (sscanf(message, "time? %u %u %lld", &id, &seq, &t1) == 3) {
+            char reply[MESSAGE_SIZE];
+            snprintf(reply, sizeof(reply), "time %u %u %lld %lld %lld", id, seq, t1, arrivalNs, getTimeNs());
+            sendMessage(reply);
+        } else if (sscanf(message, "bar %u %lld %lld %lld", &id, &startId, &bar, &alignNs) == 4
+                && schedule.active && startId == schedule.id) {
+            addReport(id, bar, (double)alignNs / NS_PER_MS);
+        }
+        return;
+    }
+
+    if (sscanf(message, "time %u %u %lld %lld %lld", &id, &seq, &t1, &t2, &t3) == 5) {
+        if (id == nodeId && seq == exchangeSeq) {
+            addExchange(t1, t2, t3, arrivalNs);
+        }
+    } else if (sscanf(message, "start %lld %d %d %lld", &startId, &mode, &bpm, &leaderNs) == 4) {
+        if (schedule.active && startId == schedule.id) {
+            return;     // A repeat
+        }
+        if (!haveEstimate) {
+            printf("Node sync: no estimate of the leader's clock yet; start ignored\n");
+            return;
+        }
+        startSchedule(startId, mode, bpm, leaderNs);
+    }
+}
+
+static void receiveMessages(void) {
+    char message[MESSAGE_SIZE];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { message, sizeof(message) - 1 };
+    struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    for (;;) {
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        ssize_t length = recvmsg(socketFd, &header, MSG_DONTWAIT);
+        if (length < 0) {
+            return;
+        }
+        message[length] = '\0';
+        handleMessage(message, getArrivalNs(&header, getTimeNs()));
+    }
+}
+
+// Measure the latest bar start of the schedule, once: where it fell, in the
+// leader's time, against where the schedule puts it.
+static void measureBar(void) {
+    BeatBox_beatClock_t clock;
+    if (!schedule.active || !BeatBox_getBeatClock(&clock) || getMode() != schedule.mode
+            || localToLeader(clock.timeNs) < schedule.leaderNs - NS_PER_MS) {
+        return;     // Not started (as far as this snapshot shows), or stopped since
+    }
+
+    double beatsNow = clock.beats + (getTimeNs() - clock.timeNs) * clock.tempo / NS_PER_MINUTE;
+    long long bar = (long long)floor(beatsNow / clock.beatsPerBar);
+    if (bar <= schedule.lastBar) {
+        return;
+    }
+    schedule.lastBar = bar;
+
+    double barBeats = bar * clock.beatsPerBar;
+    double barNs = clock.timeNs + (barBeats - clock.beats) * NS_PER_MINUTE / clock.tempo;
+    double scheduledNs = schedule.leaderNs + barBeats * NS_PER_MINUTE / schedule.bpm;
+    double alignNs = localToLeader(barNs) - scheduledNs;
+
+    stats.lastAlignMs = alignNs / NS_PER_MS;
+    if (activeRole == NODESYNC_LEADER) {
+        addReport(nodeId, bar, stats.lastAlignMs);
+        return;
+    }
+    stats.numBars++;
+    if (fabs(stats.lastAlignMs) > stats.maxAbsAlignMs) {
+        stats.maxAbsAlignMs = fabs(stats.lastAlignMs);
+    }
+    char message[MESSAGE_SIZE];
+    snprintf(message, sizeof(message), "bar %u %lld %lld %lld", nodeId, schedule.id, bar, llround(alignNs));
+    sendMessage(message);
+}
+
+// Called with nodeMutex held
+static void leaveRole(void) {
+    if (activeRole == NODESYNC_FOLLOWER && schedule.active) {
+        BeatBox_setSyncTempo(0);
+    }
+    if (socketFd >= 0) {
+        close(socketFd);
+        socketFd = -1;
+    }
+    activeRole = NODESYNC_OFF;
+}
+
+// Called with nodeMutex held
+static void enterRole(NodeSync_role_t newRole) {
+    schedule.active = false;
+    numExchanges = 0;
+    haveEstimate = false;
+    estimateSkew = 0;
+    numNodes = 0;
+    nextExchangeNs = 0;
+    sendFailed = false;
+    if (newRole == NODESYNC_OFF) {
+        return;
+    }
+    socketFd = openSocket();
+    if (socketFd < 0) {
+        atomic_store(&role, NODESYNC_OFF);
+        return;
+    }
+    activeRole = newRole;
+}
+
+static void* syncThread(void* arg) {
+    (void)arg;
+    struct timespec idleWait = { 0, WAIT_MS * NS_PER_MS };
+
+    while (isRunning) {
+        NodeSync_role_t wanted = atomic_load(&role);
+        if (wanted != activeRole) {
+            pthread_mutex_lock(&nodeMutex);
+            leaveRole();
+            enterRole(wanted);
+            pthread_mutex_unlock(&nodeMutex);
+        }
+        if (activeRole == NODESYNC_OFF) {
+            nanosleep(&idleWait, NULL);
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = socketFd, .events = POLLIN };
+        poll(&pfd, 1, WAIT_MS);
+
+        pthread_mutex_lock(&nodeMutex);
+        receiveMessages();
+        long long now = getTimeNs();
+        if (activeRole == NODESYNC_FOLLOWER && now >= nextExchangeNs) {
+            sendExchange(now);
+        }
+        measureBar();
+        pthread_mutex_unlock(&nodeMutex);
+    }
+
+    pthread_mutex_lock(&nodeMutex);
+    leaveRole();
+    pthread_mutex_unlock(&nodeMutex);
+    return NULL;
+}
+
+void NodeSync_init(const char *group, const char *interfaceAddress, int port) {
+    memset(&groupAddr, 0, sizeof(groupAddr));
+    groupAddr.sin_family = AF_INET;
+    groupAddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &groupAddr.sin_addr) != 1
+            || !IN_MULTICAST(ntohl(groupAddr.sin_addr.s_addr))
+            || inet_pton(AF_INET, interfaceAddress, &interfaceAddr) != 1) {
+        printf("ERROR: Node sync needs a multicast group and an interface address (%s, %s).\n",
+                group, interfaceAddress);
+        return;
+    }
+    nodeId = ((unsigned)getpid() * 2654435761u ^ (unsigned)getTimeNs()) & 0x7fffffff;
+
+    isRunning = true;
+    pthread_create(&syncThreadId, NULL, syncThread, NULL);
+}
+
+void NodeSync_cleanup(void) {
+    if (isRunning) {
+        isRunning = false;
+        pthread_join(syncThreadId, NULL);
+    }
+}
+
+void NodeSync_setRole(NodeSync_role_t newRole) {
+    if (newRole >= NODESYNC_OFF && newRole <= NODESYNC_FOLLOWER) {
+        atomic_store(&role, newRole);
+    }
+}
+
+NodeSync_role_t NodeSync_getRole(void) {
+    return atomic_load(&role);
+}
+
+_Bool NodeSync_startPattern(int mode) {
+    if (mode < 0 || mode > BeatBox_getNumPatterns()) {
+        return false;
+    }
+    pthread_mutex_lock(&nodeMutex);
+    _Bool leading = activeRole == NODESYNC_LEADER;
+    if (leading) {
+        long long id = (long long)nodeId << 32 | ++startCount;
+        int bpm = getBPM();
+        long long leaderNs = getTimeNs() + START_LEAD_NS;
+
+        char message[MESSAGE_SIZE];
+        snprintf(message, sizeof(message), "start %lld %d %d %lld", id, mode, bpm, leaderNs);
+        for (int i = 0; i < START_REPEATS; i++) {
+            sendMessage(message);
+        }
+        startSchedule(id, mode, bpm, leaderNs);
+    }
+    pthread_mutex_unlock(&nodeMutex);
+    return leading;
+}
+
+void NodeSync_getStatsAndClear(NodeSync_stats_t *pStats) {
+    pthread_mutex_lock(&nodeMutex);
+    *pStats = stats;
+    if (haveEstimate) {
+        double now = (double)getTimeNs();
+        pStats->offsetMs = (localToLeader(now) - now) / NS_PER_MS;
+        pStats->skewPpm = estimateSkew * 1e6;
+        pStats->delayMs = estimateDelayNs / NS_PER_MS;
+    }
+    if (activeRole == NODESYNC_LEADER && numNodes > 0) {
+        double earliest = nodes[0].alignMs, latest = nodes[0].alignMs;
+        for (int i = 1; i < numNodes; i++) {
+            earliest = fmin(earliest, nodes[i].alignMs);
+            latest = fmax(latest, nodes[i].alignMs);
+        }
+        pStats->numNodes = numNodes;
+        pStats->spreadMs = latest - earliest;
+    }
+
+    stats.numExchanges = 0;
+    stats.numBars = 0;
+    stats.maxAbsAlignMs = 0;
+    pthread_mutex_unlock(&nodeMutex);
+}
@@ -0,0 +1,108 @@
+#include "patternWatcher.h"
+#include "beatbox.h"
+#include "beatPattern.h"
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define POLL_TIMEOUT_MS 100     // How quickly cleanup is noticed
+#define MAX_PATH_LENGTH 256
+
+static char filePath[MAX_PATH_LENGTH];
+static const char *fileBaseName;
+static int inotifyFd = -1;
+static _Bool isRunning = false;
+static pthread_t watcherThreadId;
+
+static void loadPatterns(void) {
+    beatPatternSet_t *pSet = BeatPattern_loadFile(filePath);
+    if (pSet == NULL) {
+        return;     // Error already reported; keep the current set
+    }
+    printf("Loaded %d pattern(s) from %s\n", pSet->numPatterns, filePath);
+    BeatBox_setPatternSet(pSet);
+}
+
+// Drain pending events; true if any of them was for our file.
+static _Bool readEvents(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    _Bool changed = false;
+
+    ssize_t length;
+    while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            struct inotify_event *pEvent = (struct inotify_event *)p;
+            if (pEvent->len > 0 && strcmp(pEvent->name, fileBaseName) == 0) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + pEvent->len;
+        }
+    }
+    return changed;
+}
+
+static void* watcherThread(void* arg) {
+    (void)arg;
+    struct pollfd pfd = { .fd = inotifyFd, .events = POLLIN };
+
+    while (isRunning) {
+        if (poll(&pfd, 1, POLL_TIMEOUT_MS) > 0 && readEvents()) {
+            // Editors may write in several steps; reload once per burst
+            loadPatterns();
+        }
+    }
+    return NULL;
+}
+
+void PatternWatcher_init(const char *fileName) {
+    snprintf(filePath, sizeof(filePath), "%s", fileName);
+
+    // Watch the directory: saving via rename replaces the file's inode
+    char dirPath[MAX_PATH_LENGTH];
+    snprintf(dirPath, sizeof(dirPath), "%s", filePath);
+    char *slash = strrchr(dirPath, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        fileBaseName = filePath + (slash - dirPath) + 1;
+    } else {
+        strcpy(dirPath, ".");
+        fileBaseName = filePath;
+    }
+
+    if (access(filePath, R_OK) == 0) {
+        loadPatterns();
+    } else {
+        printf("No pattern file %s; using the built-in patterns\n", filePath);
+    }
+
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        perror("Pattern watcher: inotify_init1");
+        return;
+    }
+    if (inotify_add_watch(inotifyFd, dirPath, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("Pattern watcher: inotify_add_watch");
+        close(inotifyFd);
+        inotifyFd = -1;
+        return;
+    }
+
+    isRunning = true;
+    pthread_create(&watcherThreadId, NULL, watcherThread, NULL);
+}
+
+void PatternWatcher_cleanup(void) {
+    if (isRunning) {
+        isRunning = false;
+        pthread_join(watcherThreadId, NULL);
+    }
+    if (inotifyFd >= 0) {
+        close(inotifyFd);
+        inotifyFd = -1;
+    }
+}
@@ -0,0 +1,236 @@
+// Real-time audit: see rtAudit.h.
+// The __wrap_X functions below are only reached when linking with
+// -Wl,--wrap=X (set up by the BEATBOX_RT_AUDIT CMake option); __real_X is
+// then the original library function.
+#include "rtAudit.h"
+#include <stdio.h>
+
+#ifdef BEATBOX_RT_AUDIT
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_RECORDED_VIOLATIONS 16
+#define MAX_BACKTRACE_DEPTH 16
+
+typedef struct {
+    const char *function;
+    int depth;
+    void *frames[MAX_BACKTRACE_DEPTH];
+} violation_t;
+
+static _Thread_local bool inRtSection = false;
+static _Thread_local bool inCheck = false;
+static atomic_long violationCount = 0;
+static violation_t violations[MAX_RECORDED_VIOLATIONS];
+
+void RtAudit_setRtSection(bool enter)
+{
+    inRtSection = enter;
+}
+
+// Called on entry to every wrapped function. Must itself stay RT-safe:
+// it only bumps a counter and captures raw return addresses.
+static void check(const char *function)
+{
+    if (!inRtSection || inCheck) {
+        return;
+    }
+    inCheck = true;
+    long index = atomic_fetch_add(&violationCount, 1);
+    if (index < MAX_RECORDED_VIOLATIONS) {
+        violations[index].function = function;
+        violations[index].depth = backtrace(violations[index].frames, MAX_BACKTRACE_DEPTH);
+    }
+    inCheck = false;
+}
+
+long RtAudit_getViolationCount(void)
+{
+    return atomic_load(&violationCount);
+}
+
+long RtAudit_report(void)
+{
+    long count = RtAudit_getViolationCount();
+    fprintf(stderr, "RT audit: %ld violation(s) in the real-time section.\n", count);
+    for (long i = 0; i < count && i < MAX_RECORDED_VIOLATIONS; i++) {
+        fprintf(stderr, "RT audit: violation %ld: %s() called from:\n", i + 1, violations[i].function);
+        fflush(stderr);
+        backtrace_symbols_fd(violations[i].frames, violations[i].depth, STDERR_FILENO);
+    }
+    return count;
+}
+
+
+// Memory
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    check("malloc");
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    check("calloc");
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    check("realloc");
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    check("free");
+    __real_free(ptr);
+}
+
+
+// Blocking locks
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+int __real_pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *deadline);
+int __real_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int __real_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                  const struct timespec *deadline);
+int __real_pthread_cond_signal(pthread_cond_t *cond);
+int __real_pthread_cond_broadcast(pthread_cond_t *cond);
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    check("pthread_mutex_lock");
+    return __real_pthread_mutex_lock(mutex);
+}
+
+int __wrap_pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+    check("pthread_mutex_timedlock");
+    return __real_pthread_mutex_timedlock(mutex, deadline);
+}
+
+int __wrap_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    check("pthread_cond_wait");
+    return __real_pthread_cond_wait(cond, mutex);
+}
+
+int __wrap_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                                  const struct timespec *deadline)
+{
+    check("pthread_cond_timedwait");
+    return __real_pthread_cond_timedwait(cond, mutex, deadline);
+}
+
+// Signalling takes the condition's internal lock and may enter the kernel
+int __wrap_pthread_cond_signal(pthread_cond_t *cond)
+{
+    check("pthread_cond_signal");
+    return __real_pthread_cond_signal(cond);
+}
+
+int __wrap_pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    check("pthread_cond_broadcast");
+    return __real_pthread_cond_broadcast(cond);
+}
+
+
+// Sleeps
+int __real_nanosleep(const struct timespec *delay, struct timespec *remaining);
+int __real_usleep(useconds_t microseconds);
+
+int __wrap_nanosleep(const struct timespec *delay, struct timespec *remaining)
+{
+    check("nanosleep");
+    return __real_nanosleep(delay, remaining);
+}
+
+int __wrap_usleep(useconds_t microseconds)
+{
+    check("usleep");
+    return __real_usleep(microseconds);
+}
+
+
+// stdio (gcc may turn printf() into puts()/putchar() and fprintf() into fwrite())
+int __real_puts(const char *s);
+int __real_fputs(const char *s, FILE *stream);
+int __real_putchar(int c);
+size_t __real_fwrite(const void *ptr, size_t size, size_t count, FILE *stream);
+void __real_perror(const char *s);
+
+int __wrap_printf(const char *format, ...)
+{
+    check("printf");
+    va_list args;
+    va_start(args, format);
+    int result = vprintf(format, args);
+    va_end(args);
+    return result;
+}
+
+int __wrap_fprintf(FILE *stream, const char *format, ...)
+{
+    check("fprintf");
+    va_list args;
+    va_start(args, format);
+    int result = vfprintf(stream, format, args);
+    va_end(args);
+    return result;
+}
+
+int __wrap_puts(const char *s)
+{
+    check("puts");
+    return __real_puts(s);
+}
+
+int __wrap_fputs(const char *s, FILE *stream)
+{
+    check("fputs");
+    return __real_fputs(s, stream);
+}
+
+int __wrap_putchar(int c)
+{
+    check("putchar");
+    return __real_putchar(c);
+}
+
+size_t __wrap_fwrite(const void *ptr, size_t size, size_t count, FILE *stream)
+{
+    check("fwrite");
+    return __real_fwrite(ptr, size, count, stream);
+}
+
+void __wrap_perror(const char *s)
+{
+    check("perror");
+    __real_perror(s);
+}
+
+#else
+
+long RtAudit_getViolationCount(void)
+{
+    return 0;
+}
+
+long RtAudit_report(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "tapTempo.h"
+#include "beatbox.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define TAP_HISTORY 8                   // Intervals the median is taken over
+#define MIN_INTERVALS 2                 // Before the first estimate (three taps)
+#define OUTLIER_PERCENT 25              // Rejected if this far from the median
+#define MAX_OUTLIERS 3                  // Rejected in a row: a new tempo
+#define TAP_BPM_MIN 40
+#define TAP_BPM_MAX 300
+
+#define NS_PER_SECOND 1000000000LL
+#define NS_PER_MINUTE (60 * NS_PER_SECOND)
+#define MIN_INTERVAL_NS (NS_PER_MINUTE / TAP_BPM_MAX)  // Any shorter is a bounce
+#define MAX_INTERVAL_NS (NS_PER_MINUTE / TAP_BPM_MIN)  // Any longer starts a new run
+
+static pthread_mutex_t tapMutex = PTHREAD_MUTEX_INITIALIZER;
+static _Bool enabled = false;
+static long long lastTapNs = 0;             // 0 until a run of taps starts
+
+// The last TAP_HISTORY intervals, oldest at historyStart, and the same
+// intervals kept in order for the median
+static long long history[TAP_HISTORY];
+static long long sorted[TAP_HISTORY];
+static int historyStart;
+static int numIntervals;
+
+static long long outliers[MAX_OUTLIERS];    // Rejected in a row
+static int numOutliers;
+
+static long long getTimeNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+static void clearHistory(void) {
+    historyStart = 0;
+    numIntervals = 0;
+    numOutliers = 0;
+}
+
+// Add an interval, dropping the oldest once the window is full. The sorted
+// copy moves at most TAP_HISTORY entries, however many taps there have been.
+static void addInterval(long long interval) {
+    if (numIntervals == TAP_HISTORY) {
+        long long oldest = history[historyStart];
+        historyStart = (historyStart + 1) % TAP_HISTORY;
+        numIntervals--;
+
+        int i = 0;
+        while (sorted[i] != oldest) {
+            i++;
+        }
+        memmove(&sorted[i], &sorted[i + 1], (numIntervals - i) * sizeof(sorted[0]));
+    }
+
+    history[(historyStart + numIntervals) % TAP_HISTORY] = interval;
+    int i = numIntervals++;
+    while (i > 0 && sorted[i - 1] > interval) {
+        sorted[i] = sorted[i - 1];
+        i--;
+    }
+    sorted[i] = interval;
+}
+
+static long long getMedian(void) {
+    int middle = numIntervals / 2;
+    if (numIntervals % 2 == 1) {
+        return sorted[middle];
+    }
+    return (sorted[middle - 1] + sorted[middle]) / 2;
+}
+
+static _Bool isOutlier(long long interval) {
+    if (numIntervals < MIN_INTERVALS) {
+        return false;
+    }
+    long long median = getMedian();
+    long long error = interval > median ? interval - median : median - interval;
+    return error * 100 > median * OUTLIER_PERCENT;
+}
+
+void TapTempo_setEnabled(_Bool enable) {
+    pthread_mutex_lock(&tapMutex);
+    enabled = enable;
+    lastTapNs = 0;
+    clearHistory();
+    pthread_mutex_unlock(&tapMutex);
+}
+
+_Bool TapTempo_isEnabled(void) {
+    pthread_mutex_lock(&tapMutex);
+    _Bool isEnabled = enabled;
+    pthread_mutex_unlock(&tapMutex);
+    return isEnabled;
+}
+
+int TapTempo_tap(void) {
+    long long nowNs = getTimeNs();
+    int newBPM = 0;
+
+    pthread_mutex_lock(&tapMutex);
+    long long interval = nowNs - lastTapNs;
+    if (enabled && (lastTapNs == 0 || interval >= MIN_INTERVAL_NS)) {
+        if (lastTapNs == 0 || interval > MAX_INTERVAL_NS) {
+            clearHistory();     // First tap of a run
+        } else if (!isOutlier(interval)) {
+            numOutliers = 0;
+            addInterval(interval);
+        } else {
+            outliers[numOutliers++] = interval;
+            if (numOutliers == MAX_OUTLIERS) {
+                // Consistently off the median: the player changed tempo
+                clearHistory();
+                for (int i = 0; i < MAX_OUTLIERS; i++) {
+                    addInterval(outliers[i]);
+                }
+            }
+        }
+        lastTapNs = nowNs;
+
+        if (numOutliers == 0 && numIntervals >= MIN_INTERVALS) {
+            long long median = getMedian();
+            newBPM = (int)((NS_PER_MINUTE + median / 2) / median);
+            if (newBPM < TAP_BPM_MIN) {
+                newBPM = TAP_BPM_MIN;
+            } else if (newBPM > TAP_BPM_MAX) {
+                newBPM = TAP_BPM_MAX;
+            }
+        }
+    }
+    pthread_mutex_unlock(&tapMutex);
+
+    if (newBPM != 0) {
+        BeatBox_setBPMAtNextBar(newBPM);
+    }
+    return newBPM;
+}
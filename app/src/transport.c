@@ -0,0 +1,74 @@
+#include "transport.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Field layout of the state word, low bits first. The song position is
+// stored plus one, so the all-zero word is the initial state.
+#define GENERATION_BITS 28
+#define BPM_SHIFT 28
+#define BPM_BITS 9              // Up to 511; the range is 40-300
+#define MODE_SHIFT 37
+#define MODE_BITS 5             // Up to 31 patterns
+#define VOLUME_SHIFT 42
+#define VOLUME_BITS 7           // Up to 127; the range is 0-100
+#define POSITION_SHIFT 49
+#define POSITION_BITS 15        // Song bars up to 32766
+
+#define FIELD_MASK(bits) ((1ULL << (bits)) - 1)
+#define GET_FIELD(word, shift, bits) ((int)(((word) >> (shift)) & FIELD_MASK(bits)))
+#define FIELD(value, shift, bits) (((unsigned long long)(value) & FIELD_MASK(bits)) << (shift))
+
+#define BEAT_FIELDS (FIELD_MASK(BPM_BITS) << BPM_SHIFT | FIELD_MASK(MODE_BITS) << MODE_SHIFT \
+        | FIELD_MASK(POSITION_BITS) << POSITION_SHIFT)
+#define VOLUME_FIELD (FIELD_MASK(VOLUME_BITS) << VOLUME_SHIFT)
+
+static _Atomic unsigned long long state = 0;
+
+// `word` with `fields` replaced by those of `values`, one generation on
+static unsigned long long nextState(unsigned long long word, unsigned long long fields,
+        unsigned long long values) {
+    unsigned long long generation = (word + 1) & FIELD_MASK(GENERATION_BITS);
+    return (word & ~fields & ~FIELD_MASK(GENERATION_BITS)) | values | generation;
+}
+
+void Transport_get(Transport_state_t *pState) {
+    unsigned long long word = atomic_load(&state);
+    pState->bpm = GET_FIELD(word, BPM_SHIFT, BPM_BITS);
+    pState->mode = GET_FIELD(word, MODE_SHIFT, MODE_BITS);
+    pState->volume = GET_FIELD(word, VOLUME_SHIFT, VOLUME_BITS);
+    pState->songPosition = GET_FIELD(word, POSITION_SHIFT, POSITION_BITS) - 1;
+    pState->generation = (unsigned)(word & FIELD_MASK(GENERATION_BITS));
+}
+
+unsigned Transport_getGeneration(void) {
+    return (unsigned)(atomic_load(&state) & FIELD_MASK(GENERATION_BITS));
+}
+
+void Transport_setVolume(int volume) {
+    unsigned long long value = FIELD(volume, VOLUME_SHIFT, VOLUME_BITS);
+    unsigned long long word = atomic_load(&state);
+    while ((word & VOLUME_FIELD) != value
+            && !atomic_compare_exchange_weak(&state, &word, nextState(word, VOLUME_FIELD, value))) {
+        // word now holds the latest state; retry on it
+    }
+}
+
+_Bool Transport_setBeat(unsigned generation, int bpm, int mode, int songPosition, int volume) {
+    unsigned long long fields = BEAT_FIELDS;
+    unsigned long long values = FIELD(bpm, BPM_SHIFT, BPM_BITS) | FIELD(mode, MODE_SHIFT, MODE_BITS)
+            | FIELD(songPosition + 1, POSITION_SHIFT, POSITION_BITS);
+    if (volume >= 0) {
+        fields |= VOLUME_FIELD;
+        values |= FIELD(volume, VOLUME_SHIFT, VOLUME_BITS);
+    }
+    unsigned long long word = atomic_load(&state);
+    while ((word & FIELD_MASK(GENERATION_BITS)) == generation) {
+        if ((word & fields) == values) {
+            return true;        // Unchanged: no new generation
+        }
+        if (atomic_compare_exchange_weak(&state, &word, nextState(word, fields, values))) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -1,210 +1,360 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
-#include "audioMixer.h"
-#include "beatbox.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "binaryProtocol.h"
+#include "command.h"
 #include "udp_server.h"
-#include "hal/accelerometer.h"
-#include "hal/joystick_press.h"
-#include "hal/joystick.h"
-#include "hal/lcd_display.h"
-#include "hal/rotary_encoder.h"
-#include "periodTimer.h"
 
 #define PORT 12345
 #define BUFFER_SIZE 1024
+#define MAX_EVENTS 3                    // One per watched fd
+#define TICK_MS 1000                    // Period of the housekeeping timer
+#define SHUTDOWN_NOTIFY_TRIES 3         // Telling the Node.js server, a tick apart
+#define BATCH_SIZE 16                   // Datagrams per recvmmsg() / replies per sendmmsg()
 
 extern volatile int keepRunning;
 
-static int sockfd = -1;  // Global UDP socket
-static struct sockaddr_in clientAddr; // Store client info for replies
-static socklen_t addrLen;  // Store client address length
+static int sockfd = -1;  // Global UDP socket (non-blocking)
 
-void processCommand(char *command);
+// One batch of received datagrams, and the replies to them, sent back
+// together to each datagram's sender. Server thread only.
+static struct mmsghdr recvMsgs[BATCH_SIZE];
+static struct iovec recvIovs[BATCH_SIZE];
+static struct sockaddr_in clientAddrs[BATCH_SIZE];
+static char datagrams[BATCH_SIZE][BUFFER_SIZE];
+static Command_t commands[BATCH_SIZE];  // Parsed in place from datagrams
+static _Bool isCommand[BATCH_SIZE];     // False if the datagram held none
+static _Bool isFrame[BATCH_SIZE];       // A binary protocol frame, not text
+static char replies[BATCH_SIZE][COMMAND_MAX_REPLY];
+_Static_assert(BINARY_MAX_FRAME <= COMMAND_MAX_REPLY, "A binary reply must fit a reply buffer");
+static int replyLengths[BATCH_SIZE];    // 0: no reply
+static int supersededBy[BATCH_SIZE];    // Later set-command that replaces this one, or -1
 
-void* udp_server_main(void* arg) {
-    (void)arg;
-    struct sockaddr_in serverAddr;
-    char buffer[BUFFER_SIZE];
-    addrLen = sizeof(clientAddr);
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static udp_server_stats_t stats;
 
-    // Create UDP socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("UDP Socket creation failed");
+// The server thread sleeps in epoll_wait() on the socket, an eventfd
+// written to stop it, and a timerfd for periodic work.
+static int epollFd = -1;
+static int wakeFd = -1;
+static int timerFd = -1;
+static pthread_t serverThreadId;
+static int shutdownTriesLeft = 0;       // Server thread only
+
+static void watchFd(int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("UDP server: epoll_ctl");
         exit(EXIT_FAILURE);
     }
+}
 
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    memset(&clientAddr, 0, sizeof(clientAddr));
+// Tell the Node.js server we are shutting down; retried on the timer ticks
+// while the send fails. Once it is sent, or the tries run out, the main
+// loop is asked to exit.
+static void notifyShutdown(void) {
+    shutdownTriesLeft--;
 
-    // Configure server settings
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(PORT);
+    int shutdownSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (shutdownSocket >= 0) {
+        struct sockaddr_in nodeServerAddr;
+        memset(&nodeServerAddr, 0, sizeof(nodeServerAddr));
+        nodeServerAddr.sin_family = AF_INET;
+        nodeServerAddr.sin_port = htons(8089);
+        inet_pton(AF_INET, "127.0.0.1", &nodeServerAddr.sin_addr);
 
-    // Bind socket to port
-    if (bind(sockfd, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("UDP Socket bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        char shutdownMessage[] = "shutdown";
+        ssize_t sent = sendto(shutdownSocket, shutdownMessage, strlen(shutdownMessage), 0,
+                              (struct sockaddr *)&nodeServerAddr, sizeof(nodeServerAddr));
+        if (sent < 0) {
+            perror("❌ UDP sendto failed");
+        } else {
+            printf("✅ Sent shutdown signal to Node.js server.\n");
+            shutdownTriesLeft = 0;
+        }
+        close(shutdownSocket);
     }
 
-    printf("UDP BeatBox Server started on port %d\n", PORT);
+    if (shutdownTriesLeft == 0) {
+        keepRunning = 0;
+        printf("All resources cleaned up. Exiting now.\n");
+    }
+}
 
-    while (1) {
-        // Receive data from client
-        int n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&clientAddr, &addrLen);
-        if (n > 0) {
-            buffer[n] = '\0'; // Null-terminate received string
-            processCommand(buffer);
+// Periodic work, every TICK_MS
+static void handleTick(void) {
+    uint64_t expirations;
+    if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+        return;     // Already consumed
+    }
+    if (shutdownTriesLeft > 0) {
+        notifyShutdown();
+    }
+}
+
+static _Bool isSameSender(int i, int j) {
+    return clientAddrs[i].sin_addr.s_addr == clientAddrs[j].sin_addr.s_addr
+            && clientAddrs[i].sin_port == clientAddrs[j].sin_port;
+}
+
+// Mark the set-commands of the batch that a later set of the same setting
+// replaces, whoever sent it: the web UI's relay sends each message from a
+// new port, so a slider's run of sets comes from as many senders. Every
+// replaced sender is answered with the surviving set's reply, the value
+// now in effect. Anything else in between is a barrier: a query, any other
+// command or a binary frame may depend on the earlier value, so no set is
+// replaced across one. Returns how many there are; *pNumAcross counts those
+// replaced by another sender's set.
+static int coalesceBatch(int numDatagrams, int *pNumAcross) {
+    Command_id_t settings[BATCH_SIZE];  // Of each valid set, COMMAND_UNKNOWN for the rest
+    for (int i = 0; i < numDatagrams; i++) {
+        _Bool isSet = false;
+        settings[i] = COMMAND_UNKNOWN;
+        if (isCommand[i] && Command_getSetting(&commands[i], &isSet) != COMMAND_UNKNOWN && isSet) {
+            settings[i] = commands[i].id;
         }
     }
 
-    close(sockfd);
-    return NULL;
+    // Backwards, so a later set's own replacement is known: a chain of sets
+    // all take the last one's reply
+    int numSuperseded = 0;
+    *pNumAcross = 0;
+    for (int i = numDatagrams - 1; i >= 0; i--) {
+        supersededBy[i] = -1;
+        if (settings[i] == COMMAND_UNKNOWN) {
+            continue;
+        }
+        for (int j = i + 1; j < numDatagrams && settings[j] != COMMAND_UNKNOWN; j++) {
+            if (settings[j] == settings[i]) {
+                supersededBy[i] = supersededBy[j] >= 0 ? supersededBy[j] : j;
+                numSuperseded++;
+                *pNumAcross += !isSameSender(i, supersededBy[i]);
+                break;
+            }
+        }
+    }
+    return numSuperseded;
 }
 
-// Function to process received commands
-void processCommand(char *command) {
-    char cmd[BUFFER_SIZE];
-    int value;
-    int numScanned;
-
-    // Extract command and optional value
-    numScanned = sscanf(command, "%s %d", cmd, &value);
-
-    if (numScanned < 1) {
-        printf("ERROR: Invalid command format.\n");
-        return;
-    }
-
-
-    if (strcmp(cmd, "mode") == 0) {
-        if (numScanned == 2 && value >= 0 && value <= 2) {
-            setMode(value);
-            printf("Mode changed to %d\n", value);
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", value);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else if (numScanned == 1) {  // Request current mode
-            int currentMode = getMode();
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", currentMode);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else {
-            printf("ERROR: Mode must be between 0 and 2.\n");
+// Send the batch's replies with one sendmmsg() (more only if the socket
+// buffer fills part way). Returns the calls made.
+static int sendReplies(int numDatagrams) {
+    struct mmsghdr sendMsgs[BATCH_SIZE];
+    struct iovec sendIovs[BATCH_SIZE];
+    int numReplies = 0;
+    for (int i = 0; i < numDatagrams; i++) {
+        if (replyLengths[i] == 0) {
+            continue;
         }
+        sendIovs[numReplies].iov_base = replies[i];
+        sendIovs[numReplies].iov_len = replyLengths[i];
+        memset(&sendMsgs[numReplies], 0, sizeof(sendMsgs[numReplies]));
+        sendMsgs[numReplies].msg_hdr.msg_name = &clientAddrs[i];
+        sendMsgs[numReplies].msg_hdr.msg_namelen = recvMsgs[i].msg_hdr.msg_namelen;
+        sendMsgs[numReplies].msg_hdr.msg_iov = &sendIovs[numReplies];
+        sendMsgs[numReplies].msg_hdr.msg_iovlen = 1;
+        numReplies++;
     }
 
-    else if (strcmp(cmd, "volume") == 0) {
-        if (numScanned == 2 && value >= 0 && value <= 100) {
-            AudioMixer_setVolume(value);
-            printf("Volume set to %d\n", value);
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", value);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else if (numScanned == 1) {  // Request current volume
-            int currentVolume = AudioMixer_getVolume();
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", currentVolume);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else {
-            printf("ERROR: Volume must be between 0 and 100.\n");
+    int numCalls = 0;
+    for (int sent = 0; sent < numReplies; ) {
+        int n = sendmmsg(sockfd, &sendMsgs[sent], numReplies - sent, 0);
+        numCalls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("UDP server: sendmmsg");
+            }
+            break;      // Replies are best effort, as datagrams
         }
+        sent += n;
     }
+    return numCalls;
+}
 
-    else if (strcmp(cmd, "tempo") == 0) {
-        if (numScanned == 2 && value >= 40 && value <= 300) {
-            setBPM(value);
-            printf("Tempo set to %d BPM\n", value);
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", value);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else if (numScanned == 1) {  // Request current tempo
-            int currentBPM = getBPM();
-            char response[BUFFER_SIZE];
-            sprintf(response, "%d", currentBPM);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } else {
-            printf("ERROR: Tempo must be between 40 and 300 BPM.\n");
+// Handle one batch of datagrams: the superseded set-commands are skipped,
+// and answered with the reply to the one that replaced them.
+static void handleBatch(int numDatagrams) {
+    for (int i = 0; i < numDatagrams; i++) {
+        isFrame[i] = BinaryProtocol_isFrame(datagrams[i], recvMsgs[i].msg_len);
+        isCommand[i] = !isFrame[i] && Command_parse(datagrams[i], recvMsgs[i].msg_len, &commands[i]);
+        replyLengths[i] = 0;
+    }
+    int numAcross;
+    int numSuperseded = coalesceBatch(numDatagrams, &numAcross);
+    _Bool stopRequested = false;
+    int numFrames = 0;
+    for (int i = 0; i < numDatagrams; i++) {
+        if (isFrame[i]) {
+            replyLengths[i] = BinaryProtocol_handleFrame((const uint8_t *)datagrams[i],
+                    recvMsgs[i].msg_len, (uint8_t *)replies[i], &stopRequested);
+            numFrames++;
+        } else if (isCommand[i] && supersededBy[i] < 0) {
+            replyLengths[i] = Command_execute(&commands[i], replies[i]);
+            stopRequested |= commands[i].id == COMMAND_STOP;
+        }
+    }
+    for (int i = 0; i < numDatagrams; i++) {
+        int by = supersededBy[i];
+        if (by >= 0) {
+            memcpy(replies[i], replies[by], replyLengths[by]);
+            replyLengths[i] = replyLengths[by];
         }
     }
+    int numSendCalls = sendReplies(numDatagrams);
+    if (stopRequested && shutdownTriesLeft == 0) {
+        // Exits once the Node.js server has been told
+        shutdownTriesLeft = SHUTDOWN_NOTIFY_TRIES;
+        notifyShutdown();
+    }
+
+    pthread_mutex_lock(&statsMutex);
+    stats.numBatches++;
+    stats.numDatagrams += numDatagrams;
+    if (numDatagrams > stats.maxBatch) {
+        stats.maxBatch = numDatagrams;
+    }
+    stats.numCoalesced += numSuperseded;
+    stats.numCoalescedAcross += numAcross;
+    stats.numFrames += numFrames;
+    stats.numSendCalls += numSendCalls;
+    pthread_mutex_unlock(&statsMutex);
+}
 
-    else if (strcmp(cmd, "play") == 0) {
-        char response[BUFFER_SIZE];
-    
-        if (numScanned == 2 && value >= 0 && value <= 2) {
-            if (value == 0) {
-                playBassDrum();
-                sprintf(response, "Played Bass Drum");
-            } else if (value == 1) {
-                playHiHat();
-                sprintf(response, "Played Hi-Hat");
-            } else if (value == 2) {
-                playSnare();
-                sprintf(response, "Played Snare");
+// Handle every datagram queued on the socket, a batch per recvmmsg()
+static void drainSocket(void) {
+    while (1) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            recvMsgs[i].msg_hdr.msg_namelen = sizeof(clientAddrs[i]);
+        }
+        int n = recvmmsg(sockfd, recvMsgs, BATCH_SIZE, 0, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-    
-            printf("%s\n", response);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-        } 
-        else {
-            sprintf(response, "ERROR: Invalid sound selection. Use 0 (Bass), 1 (HiHat), or 2 (Snare).");
-            printf("%s\n", response);
-            sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("UDP server: recvmmsg");
+            }
+            return;
+        }
+        handleBatch(n);
+        if (n < BATCH_SIZE) {
+            return;     // Drained; epoll wakes us for any more
         }
     }
+}
+
+static void *serverThread(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    _Bool running = true;
 
-    else if (strcmp(cmd, "stop") == 0) {
-        // Send confirmation to the web UI before shutting down
-        char response[] = "Shutdown initiated...";
-        sendto(sockfd, response, strlen(response), 0, (struct sockaddr *)&clientAddr, addrLen);
-
-        int shutdownSocket = socket(AF_INET, SOCK_DGRAM, 0);
-        if (shutdownSocket >= 0) {
-            struct sockaddr_in nodeServerAddr;
-            memset(&nodeServerAddr, 0, sizeof(nodeServerAddr));
-            nodeServerAddr.sin_family = AF_INET;
-            nodeServerAddr.sin_port = htons(8089);
-            inet_pton(AF_INET, "127.0.0.1", &nodeServerAddr.sin_addr);
-        
-            char shutdownMessage[] = "shutdown";
-            
-            int retries = 3;
-            for (int i = 0; i < retries; i++) {
-                ssize_t sent = sendto(shutdownSocket, shutdownMessage, strlen(shutdownMessage), 0,
-                                      (struct sockaddr *)&nodeServerAddr, sizeof(nodeServerAddr));
-                if (sent < 0) {
-                    perror("❌ UDP sendto failed");
-                } else {
-                    printf("✅ Sent shutdown signal to Node.js server.\n");
-                    break;
-                }
-                sleep(1);  // Wait 1 sec before retry
+    // A stop request is seen on the next wakeup, after the rest of its events
+    while (running) {
+        int numEvents = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        
-            close(shutdownSocket);
+            perror("UDP server: epoll_wait");
+            break;
         }
+        for (int i = 0; i < numEvents; i++) {
+            if (events[i].data.fd == sockfd) {
+                drainSocket();
+            } else if (events[i].data.fd == timerFd) {
+                handleTick();
+            } else if (events[i].data.fd == wakeFd) {
+                running = false;
+            }
+        }
+    }
+    return NULL;
+}
 
-        keepRunning = 0;
-        //cleanup_resources();
+void udp_server_init(void) {
+    struct sockaddr_in serverAddr;
 
-        printf("All resources cleaned up. Exiting now.\n");
-        //exit(0);
+    // Create UDP socket
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("UDP Socket creation failed");
+        exit(EXIT_FAILURE);
     }
 
-    else {
-        printf("ERROR: Unknown command: %s\n", cmd);
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        recvIovs[i].iov_base = datagrams[i];
+        recvIovs[i].iov_len = BUFFER_SIZE;
+        recvMsgs[i].msg_hdr.msg_name = &clientAddrs[i];
+        recvMsgs[i].msg_hdr.msg_iov = &recvIovs[i];
+        recvMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Configure server settings
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(PORT);
+
+    // Bind socket to port
+    if (bind(sockfd, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+        perror("UDP Socket bind failed");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (wakeFd < 0 || timerFd < 0 || epollFd < 0) {
+        perror("UDP server: event fds");
+        exit(EXIT_FAILURE);
     }
+    struct itimerspec tick = {
+        .it_interval = {TICK_MS / 1000, (TICK_MS % 1000) * 1000000L},
+        .it_value = {TICK_MS / 1000, (TICK_MS % 1000) * 1000000L},
+    };
+    timerfd_settime(timerFd, 0, &tick, NULL);
+    watchFd(sockfd);
+    watchFd(wakeFd);
+    watchFd(timerFd);
+
+    printf("UDP BeatBox Server started on port %d\n", PORT);
+    pthread_create(&serverThreadId, NULL, serverThread, NULL);
+}
+
+void udp_server_getStatsAndClear(udp_server_stats_t *pStats) {
+    pthread_mutex_lock(&statsMutex);
+    *pStats = stats;
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&statsMutex);
 }
 
-// Cleanup function to close the socket
+// Stop the server thread (it exits on its next wakeup), then close its fds
 void udp_server_cleanup(void) {
     if (sockfd != -1) {
         printf("Closing UDP server...\n");
+        uint64_t stop = 1;
+        if (write(wakeFd, &stop, sizeof(stop)) < 0) {
+            perror("UDP server: eventfd write");
+        }
+        pthread_join(serverThreadId, NULL);
+        close(epollFd);
+        close(timerFd);
+        close(wakeFd);
         close(sockfd);
         sockfd = -1;
     }
-}
\ No newline at end of file
+}
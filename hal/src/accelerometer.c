@@ -9,6 +9,8 @@
 #include <math.h>
 #include "audioMixer.h"
 #include "beatbox.h"
+#include "instruments.h"
+#include "tapTempo.h"
 #include "hal/accelerometer.h"
 #include "periodTimer.h"
 #include "hal/rotary_encoder.h"
@@ -25,6 +27,14 @@
 #define THRESHOLD_Y 0.7
 #define THRESHOLD_Z 1.8
 
+// Instrument ID each air-drum axis plays
+enum { AXIS_X, AXIS_Y, AXIS_Z, NUM_AXES };
+static const int airDrumInstrument[NUM_AXES] = {
+    [AXIS_X] = INSTRUMENT_SNARE,
+    [AXIS_Y] = INSTRUMENT_HI_HAT,
+    [AXIS_Z] = INSTRUMENT_BASS_DRUM,
+};
+
 #define ROTARY_PRESS_THRESHOLD_X 4.0
 #define ROTARY_PRESS_THRESHOLD_Y 4.0
 #define ROTARY_PRESS_THRESHOLD_Z 5.0
@@ -150,26 +160,33 @@ void *accelerometer_listener(void *arg) {
 
 
         if(!rotaryButtonPressed){
+        _Bool hit = false;     // One tap per sample, however many axes fired
         if (fabs(xG) > thresholdX && (currentTime - lastXTime > DEBOUNCE_TIME_X)) {
-            printf("Air-Drum X (Snare)");
+            printf("Air-Drum X (%s)", Instruments_getName(airDrumInstrument[AXIS_X]));
             printf("G-Force: X: %.2fg Y: %.2fg Z: %.2fg\n",xG, yG, zG);
-            playSnare();
+            BeatBox_playInstrument(airDrumInstrument[AXIS_X]);
+            hit = true;
             lastXTime = currentTime;
         }
 
         if (fabs(yG) > thresholdY && (currentTime - lastYTime > DEBOUNCE_TIME_Y)) {
-            printf("Air-Drum Y (HiHat)");
+            printf("Air-Drum Y (%s)", Instruments_getName(airDrumInstrument[AXIS_Y]));
             printf("G-Force: X: %.2fg Y: %.2fg Z: %.2fg\n",xG, yG, zG);
-            playHiHat();
+            BeatBox_playInstrument(airDrumInstrument[AXIS_Y]);
+            hit = true;
             lastYTime = currentTime;  
         }
 
         if (fabs(zG) > thresholdZ && (currentTime - lastZTime > DEBOUNCE_TIME_Z)) {
-            printf("Air-Drum Z (Bass Drum)");
+            printf("Air-Drum Z (%s)", Instruments_getName(airDrumInstrument[AXIS_Z]));
             printf("G-Force: X: %.2fg Y: %.2fg Z: %.2fg\n",xG, yG, zG);
-            playBassDrum();
+            BeatBox_playInstrument(airDrumInstrument[AXIS_Z]);
+            hit = true;
             lastZTime = currentTime; 
         }
+        if (hit) {
+            TapTempo_tap();
+        }
         }
         usleep(10000); // **100Hz polling rate**
     }
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include "periodTimer.h"
+#include "tapTempo.h"
 #include "hal/lcd_display.h"
 #include "hal/joystick_press.h"
 
@@ -60,12 +61,16 @@ void *joystick_listener_push(void *arg) {
             if (currentTime - lastPressTime > 200) { // 200ms debounce
                 lastPressTime = currentTime;
                 lastState = currentState;
-                setScreen((getScreen() % 3) + 1);  // Cycle screens
+                if (TapTempo_isEnabled()) {
+                    TapTempo_tap();
+                } else {
+                    setScreen((getScreen() % 3) + 1);  // Cycle screens
+                }
             }
         }
 
         lastState = currentState;
-        usleep(100000);  // Sleep 100ms to prevent CPU overuse
+        usleep(10000);  // Sleep 10ms: prevents CPU overuse, fine enough for tap tempo
     }
     return NULL;
 }
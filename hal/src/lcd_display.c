@@ -5,8 +5,7 @@
 #include "GUI_Paint.h"
 #include "GUI_BMP.h"
 #include "periodTimer.h"
-#include "audioMixer.h"
-#include "beatbox.h"
+#include "transport.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,7 +37,9 @@ void lcd_display_screen(int screen) {
     LCD_1IN54_Clear(WHITE);
 
     if (screen == 1) {
-        lcd_display_status_screen(getMode(), getBPM(), AudioMixer_getVolume());
+        Transport_state_t transport;
+        Transport_get(&transport);
+        lcd_display_status_screen(transport.mode, transport.bpm, transport.volume);
     } else if (screen == 2) {
         Period_statistics_t audioStats;
         Period_getStatisticsAndClear(PERIOD_EVENT_AUDIO_BUFFER_FILL, &audioStats);